@@ -0,0 +1,121 @@
+//
+// Motion activity grid
+//
+#include "activity_grid.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+void put16(uint8_t* p, uint32_t v) {
+    p[0] = static_cast<uint8_t>(v);
+    p[1] = static_cast<uint8_t>(v >> 8);
+}
+
+void put32(uint8_t* p, uint32_t v) {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+void put64(uint8_t* p, uint64_t v) {
+    put32(p, static_cast<uint32_t>(v));
+    put32(p + 4, static_cast<uint32_t>(v >> 32));
+}
+}
+
+ActivityGrid::ActivityGrid(int tiles_x, int tiles_y, int tile_size, int width, int height,
+                           const vector<uint32_t>& tile_zones, int frames_per_message)
+    : per_message(max(0, frames_per_message)), frames(0),
+      previous_empty(true), force_key(true), since_key(0), sequence(0) {
+    // Smallest pooling that fits the message
+    int pool = 1;
+    while (((tiles_x + pool - 1) / pool) * ((tiles_y + pool - 1) / pool) > kMaxCells) {
+        pool++;
+    }
+    cols = (tiles_x + pool - 1) / pool;
+    row_count = (tiles_y + pool - 1) / pool;
+
+    size_t cells = static_cast<size_t>(cols) * row_count;
+    cell_of_tile.assign(static_cast<size_t>(tiles_x) * tiles_y, -1);
+    cell_pixels.assign(cells, 0);
+    for (int y = 0; y < tiles_y; y++) {
+        for (int x = 0; x < tiles_x; x++) {
+            size_t t = static_cast<size_t>(y) * tiles_x + x;
+            if (t < tile_zones.size() && tile_zones[t] == 0) continue;
+            int cell = (y / pool) * cols + x / pool;
+            cell_of_tile[t] = cell;
+            // Edge tiles are clipped to the image
+            int tw = min(tile_size, width - x * tile_size);
+            int th = min(tile_size, height - y * tile_size);
+            cell_pixels[cell] += static_cast<uint32_t>(max(0, tw) * max(0, th));
+        }
+    }
+    sums.assign(cells, 0);
+    current.assign(cells, 0);
+    previous.assign(cells, 0);
+}
+
+bool ActivityGrid::add(const vector<uint32_t>& tile_counts, bool motion, int64_t timestamp_ms,
+                       ActivityFrame& out) {
+    if (!enabled()) return false;
+
+    if (motion) {
+        size_t n = min(tile_counts.size(), cell_of_tile.size());
+        for (size_t t = 0; t < n; t++) {
+            int cell = cell_of_tile[t];
+            if (cell >= 0) sums[cell] += tile_counts[t];
+        }
+    }
+    if (++frames < per_message) return false;
+
+    bool empty = true;
+    for (size_t c = 0; c < current.size(); c++) {
+        uint64_t scale = static_cast<uint64_t>(frames) * cell_pixels[c];
+        current[c] = scale ? static_cast<uint8_t>(min<uint64_t>(255, (sums[c] * 255 + scale / 2) / scale)) : 0;
+        if (current[c]) empty = false;
+    }
+    fill(sums.begin(), sums.end(), 0);
+    // Quiet stays quiet; the first empty period after motion clears the grid
+    bool sent = !empty || !previous_empty;
+
+    if (sent) {
+        // After silence subscribers are in sync on all zeros, but a
+        // keyframe lets one that just joined start here
+        bool key = force_key || previous_empty || since_key >= kKeyInterval;
+        encode(key, timestamp_ms, out);
+        previous.swap(current);
+        previous_empty = empty;
+        force_key = false;
+        since_key = key ? 1 : since_key + 1;
+    }
+    frames = 0;
+    return sent;
+}
+
+void ActivityGrid::encode(bool key, int64_t timestamp_ms, ActivityFrame& out) {
+    uint8_t* p = out.data;
+    p[0] = 1;
+    p[1] = key ? 1 : 0;
+    put16(p + 2, static_cast<uint32_t>(cols));
+    put16(p + 4, static_cast<uint32_t>(row_count));
+    put16(p + 6, static_cast<uint32_t>(min(frames, 65535)));
+    put32(p + 8, sequence++);
+    put64(p + 12, static_cast<uint64_t>(timestamp_ms));
+
+    size_t length = ActivityFrame::kHeaderBytes;
+    size_t c = 0;
+    while (c < current.size()) {
+        uint8_t value = key ? current[c] : static_cast<uint8_t>(current[c] - previous[c]);
+        size_t run = 1;
+        while (c + run < current.size() && run < 255) {
+            uint8_t next = key ? current[c + run] : static_cast<uint8_t>(current[c + run] - previous[c + run]);
+            if (next != value) break;
+            run++;
+        }
+        out.data[length++] = static_cast<uint8_t>(run);
+        out.data[length++] = value;
+        c += run;
+    }
+    out.length = static_cast<uint16_t>(length);
+}
@@ -0,0 +1,84 @@
+//
+// Motion activity grid: the motion kernel's per-tile counts pooled into a
+// coarse heatmap, averaged over N analysed frames and packed into a small
+// delta/RLE-coded binary message for opensentry/<id>/activity.
+//
+#ifndef OPENSENTRY_ACTIVITY_GRID_H
+#define OPENSENTRY_ACTIVITY_GRID_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// One encoded message, fixed-size so it can be queued without allocating.
+//
+// Layout, little-endian:
+//   0  u8   version (1)
+//   1  u8   flags: bit 0 = keyframe (cells are absolute, not deltas)
+//   2  u16  columns
+//   4  u16  rows
+//   6  u16  frames averaged
+//   8  u32  sequence number, +1 per message, so gaps are visible
+//  12  i64  Unix time of the last frame, milliseconds
+//  20  (run u8, value u8) pairs, row-major, run 1..255
+// Each cell is the share of its pixels that were active, 0..255, averaged
+// over the frames. A delta message carries (cell - previous cell) mod 256,
+// so unchanged cells are runs of zeros.
+struct ActivityFrame {
+    static const size_t kHeaderBytes = 20;
+    static const size_t kMaxBytes = 2048;
+
+    uint16_t length = 0;
+    uint8_t data[kMaxBytes];
+};
+
+class ActivityGrid {
+public:
+    static const int kMaxCells = (ActivityFrame::kMaxBytes - ActivityFrame::kHeaderBytes) / 2;
+    static const int kKeyInterval = 10;   // Messages between keyframes
+
+    // Kernel grid of `tiles_x` x `tiles_y` tiles of `tile_size` pixels over
+    // a `width` x `height` analysis image. Tiles with no zone bits in
+    // `tile_zones` (excluded or outside every zone) always read 0. Tiles
+    // are pooled into square cells of several tiles if the grid wouldn't
+    // fit in a message. `frames_per_message` 0 disables the grid.
+    ActivityGrid(int tiles_x, int tiles_y, int tile_size, int width, int height,
+                 const std::vector<uint32_t>& tile_zones, int frames_per_message);
+
+    bool enabled() const { return per_message > 0; }
+
+    // Adds one analysed frame; only frames with motion contribute counts.
+    // Returns true when `out` holds a message to send. Periods without
+    // motion send nothing, apart from the one that clears the grid.
+    bool add(const std::vector<uint32_t>& tile_counts, bool motion, int64_t timestamp_ms,
+             ActivityFrame& out);
+
+    // The last message never got out: the next one is a keyframe, sent
+    // even if it's empty so subscribers don't keep a stale grid
+    void lost() {
+        force_key = true;
+        previous_empty = false;
+    }
+
+    int columns() const { return cols; }
+    int rows() const { return row_count; }
+
+private:
+    void encode(bool key, int64_t timestamp_ms, ActivityFrame& out);
+
+    int cols;
+    int row_count;
+    int per_message;
+    std::vector<int> cell_of_tile;       // -1 for tiles left out
+    std::vector<uint32_t> cell_pixels;   // Analysis pixels counted per cell
+    std::vector<uint64_t> sums;          // Active pixels this period
+    std::vector<uint8_t> current;
+    std::vector<uint8_t> previous;       // As last sent
+    int frames;
+    bool previous_empty;
+    bool force_key;
+    int since_key;
+    uint32_t sequence;
+};
+
+#endif // OPENSENTRY_ACTIVITY_GRID_H
@@ -0,0 +1,76 @@
+//
+// Debug-only heap allocation counter for the pipeline stages
+//
+#include "alloc_trace.h"
+
+#ifdef OPENSENTRY_ALLOC_TRACE
+
+#include <cstddef>
+#include <iostream>
+
+// glibc's real allocator entry points
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+}
+
+namespace {
+// Static TLS so counting never allocates from inside malloc itself
+__thread uint64_t thread_allocations __attribute__((tls_model("initial-exec"))) = 0;
+
+const uint64_t WARMUP_FRAMES = 100;
+const uint64_t REPORT_EVERY = 300;
+}
+
+// Interposed for the whole process: the executable's definitions win over
+// libc's for every shared library as well.
+extern "C" {
+void* malloc(size_t size) {
+    thread_allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    thread_allocations++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    thread_allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) {
+    thread_allocations++;
+    void* p = __libc_memalign(alignment, size);
+    if (!p) return 12;  // ENOMEM
+    *out = p;
+    return 0;
+}
+}
+
+uint64_t allocTraceThreadCount() {
+    return thread_allocations;
+}
+
+StageAllocProbe::StageAllocProbe(const char* stage_name)
+    : stage(stage_name), start(0), frames(0), allocations(0) {}
+
+void StageAllocProbe::end() {
+    uint64_t used = allocTraceThreadCount() - start;
+    frames++;
+    if (frames <= WARMUP_FRAMES) return;
+
+    allocations += used;
+    uint64_t counted = frames - WARMUP_FRAMES;
+    if (counted % REPORT_EVERY == 0) {
+        std::cout << "[Alloc] " << stage << ": "
+                  << static_cast<double>(allocations) / REPORT_EVERY
+                  << " allocations/frame" << std::endl;
+        allocations = 0;
+    }
+}
+
+#endif // OPENSENTRY_ALLOC_TRACE
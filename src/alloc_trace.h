@@ -0,0 +1,45 @@
+//
+// Debug-only heap allocation counter for the pipeline stages
+//
+// Built with -DOPENSENTRY_ALLOC_TRACE=ON, every malloc/calloc/realloc/
+// memalign in the process (ours, OpenCV's, FFmpeg's) is counted per thread
+// and each stage logs its allocations per frame. In normal builds the probe
+// compiles to nothing.
+//
+#ifndef OPENSENTRY_ALLOC_TRACE_H
+#define OPENSENTRY_ALLOC_TRACE_H
+
+#include <cstdint>
+
+#ifdef OPENSENTRY_ALLOC_TRACE
+
+// Allocations made by the calling thread since it started
+uint64_t allocTraceThreadCount();
+
+// Brackets one frame of work in a stage; logs the average every few
+// hundred frames once past warm-up.
+class StageAllocProbe {
+public:
+    explicit StageAllocProbe(const char* stage_name);
+    void begin() { start = allocTraceThreadCount(); }
+    void end();
+
+private:
+    const char* stage;
+    uint64_t start;
+    uint64_t frames;
+    uint64_t allocations;
+};
+
+#else
+
+class StageAllocProbe {
+public:
+    explicit StageAllocProbe(const char*) {}
+    void begin() {}
+    void end() {}
+};
+
+#endif // OPENSENTRY_ALLOC_TRACE
+
+#endif // OPENSENTRY_ALLOC_TRACE_H
@@ -0,0 +1,233 @@
+//
+// Fixed-point background model
+//
+// All state is int16: the mean is luma in 8.7 fixed point, so the update
+// delta (cur << 7) - mean always fits in 16 bits, and the variance is kept
+// as mean squared difference / 4 so it fits too. Each row is one pass of
+// 16-bit SIMD: threshold against the mean (and variance), then move the
+// model towards the frame by delta >> shift, slower where foreground.
+//
+#include "background_model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define BACKGROUND_MODEL_SSE2 1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define BACKGROUND_MODEL_NEON 1
+#endif
+
+using namespace std;
+
+namespace {
+
+struct RowParams {
+    int shift;
+    int slow_shift;
+    uint16_t sigma_mul;
+    uint8_t thr;
+};
+
+// ============================================================================
+// Scalar reference
+// ============================================================================
+template <bool Var>
+uint32_t update_row_scalar(const uint8_t* cur, int16_t* mean, int16_t* var,
+                           uint8_t* out, int n, const RowParams& p) {
+    uint32_t count = 0;
+    for (int x = 0; x < n; x++) {
+        int c = cur[x];
+        int m = mean[x];
+        int d = abs(c - (m >> 7));
+        bool fg = d > p.thr;
+        if (Var) {
+            int dd = (d * d) >> 2;
+            int v = var[x];
+            fg = fg && (dd >> 4) > ((v * p.sigma_mul) >> 16);
+            var[x] = static_cast<int16_t>(v + ((dd - v) >> (fg ? p.slow_shift : p.shift)));
+        }
+        mean[x] = static_cast<int16_t>(m + (((c << 7) - m) >> (fg ? p.slow_shift : p.shift)));
+        out[x] = fg ? 0xFF : 0;
+        count += fg;
+    }
+    return count;
+}
+
+// ============================================================================
+// SSE2
+// ============================================================================
+#ifdef BACKGROUND_MODEL_SSE2
+// Eight pixels in 16-bit lanes; returns the foreground lanes as 0xFFFF
+template <bool Var>
+inline __m128i update8_sse2(__m128i c, int16_t* mean, int16_t* var,
+                            __m128i thr, __m128i sigma_mul, __m128i shift, __m128i slow) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mean));
+    __m128i diff = _mm_sub_epi16(c, _mm_srai_epi16(m, 7));
+    __m128i d = _mm_max_epi16(diff, _mm_sub_epi16(zero, diff));
+    __m128i fg = _mm_cmpgt_epi16(d, thr);
+
+    if (Var) {
+        // d*d wraps int16 but is exact as uint16, hence the logical shifts
+        __m128i dd = _mm_srli_epi16(_mm_mullo_epi16(d, d), 2);
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(var));
+        __m128i noise = _mm_mulhi_epu16(v, sigma_mul);
+        fg = _mm_and_si128(fg, _mm_cmpgt_epi16(_mm_srli_epi16(dd, 4), noise));
+        __m128i dv = _mm_sub_epi16(dd, v);
+        __m128i step = _mm_or_si128(_mm_and_si128(fg, _mm_sra_epi16(dv, slow)),
+                                    _mm_andnot_si128(fg, _mm_sra_epi16(dv, shift)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(var), _mm_add_epi16(v, step));
+    }
+
+    __m128i dm = _mm_sub_epi16(_mm_slli_epi16(c, 7), m);
+    __m128i step = _mm_or_si128(_mm_and_si128(fg, _mm_sra_epi16(dm, slow)),
+                                _mm_andnot_si128(fg, _mm_sra_epi16(dm, shift)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(mean), _mm_add_epi16(m, step));
+    return fg;
+}
+
+template <bool Var>
+uint32_t update_row_sse2(const uint8_t* cur, int16_t* mean, int16_t* var,
+                         uint8_t* out, int n, const RowParams& p) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i thr = _mm_set1_epi16(p.thr);
+    const __m128i sigma_mul = _mm_set1_epi16(static_cast<short>(p.sigma_mul));
+    const __m128i shift = _mm_cvtsi32_si128(p.shift);
+    const __m128i slow = _mm_cvtsi32_si128(p.slow_shift);
+    __m128i sum = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i c8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + x));
+        __m128i lo = update8_sse2<Var>(_mm_unpacklo_epi8(c8, zero), mean + x,
+                                       Var ? var + x : nullptr, thr, sigma_mul, shift, slow);
+        __m128i hi = update8_sse2<Var>(_mm_unpackhi_epi8(c8, zero), mean + x + 8,
+                                       Var ? var + x + 8 : nullptr, thr, sigma_mul, shift, slow);
+        __m128i m = _mm_packs_epi16(lo, hi);  // 0xFFFF -> 0xFF
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), m);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_and_si128(m, one), zero));
+    }
+    uint32_t count = static_cast<uint32_t>(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+    return count + update_row_scalar<Var>(cur + x, mean + x, Var ? var + x : nullptr, out + x, n - x, p);
+}
+#endif
+
+// ============================================================================
+// NEON
+// ============================================================================
+#ifdef BACKGROUND_MODEL_NEON
+template <bool Var>
+inline uint16x8_t update8_neon(int16x8_t c, int16_t* mean, int16_t* var, int16x8_t thr,
+                               uint16x4_t sigma_mul, int16x8_t shift, int16x8_t slow) {
+    int16x8_t m = vld1q_s16(mean);
+    int16x8_t d = vabdq_s16(c, vshrq_n_s16(m, 7));
+    uint16x8_t fg = vcgtq_s16(d, thr);
+
+    if (Var) {
+        uint16x8_t du = vreinterpretq_u16_s16(d);
+        uint16x8_t dd = vshrq_n_u16(vmulq_u16(du, du), 2);
+        int16x8_t v = vld1q_s16(var);
+        uint16x8_t vu = vreinterpretq_u16_s16(v);
+        uint16x8_t noise = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(vu), sigma_mul), 16),
+                                        vshrn_n_u32(vmull_u16(vget_high_u16(vu), sigma_mul), 16));
+        fg = vandq_u16(fg, vcgtq_u16(vshrq_n_u16(dd, 4), noise));
+        int16x8_t dv = vsubq_s16(vreinterpretq_s16_u16(dd), v);
+        vst1q_s16(var, vaddq_s16(v, vbslq_s16(fg, vshlq_s16(dv, slow), vshlq_s16(dv, shift))));
+    }
+
+    int16x8_t dm = vsubq_s16(vshlq_n_s16(c, 7), m);
+    vst1q_s16(mean, vaddq_s16(m, vbslq_s16(fg, vshlq_s16(dm, slow), vshlq_s16(dm, shift))));
+    return fg;
+}
+
+template <bool Var>
+uint32_t update_row_neon(const uint8_t* cur, int16_t* mean, int16_t* var,
+                         uint8_t* out, int n, const RowParams& p) {
+    const int16x8_t thr = vdupq_n_s16(p.thr);
+    const uint16x4_t sigma_mul = vdup_n_u16(p.sigma_mul);
+    // vshlq by a negative count is an arithmetic right shift
+    const int16x8_t shift = vdupq_n_s16(static_cast<int16_t>(-p.shift));
+    const int16x8_t slow = vdupq_n_s16(static_cast<int16_t>(-p.slow_shift));
+    uint32x4_t sum = vdupq_n_u32(0);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        uint8x16_t c8 = vld1q_u8(cur + x);
+        int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(c8)));
+        int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(c8)));
+        uint16x8_t fg_lo = update8_neon<Var>(lo, mean + x, Var ? var + x : nullptr,
+                                             thr, sigma_mul, shift, slow);
+        uint16x8_t fg_hi = update8_neon<Var>(hi, mean + x + 8, Var ? var + x + 8 : nullptr,
+                                             thr, sigma_mul, shift, slow);
+        uint8x16_t m = vcombine_u8(vmovn_u16(fg_lo), vmovn_u16(fg_hi));
+        vst1q_u8(out + x, m);
+        sum = vpadalq_u16(sum, vpaddlq_u8(vshrq_n_u8(m, 7)));
+    }
+    uint32_t count = vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) +
+                     vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+    return count + update_row_scalar<Var>(cur + x, mean + x, Var ? var + x : nullptr, out + x, n - x, p);
+}
+#endif
+
+typedef uint32_t (*UpdateRowFn)(const uint8_t*, int16_t*, int16_t*, uint8_t*, int, const RowParams&);
+
+template <bool Var>
+UpdateRowFn select_update_row() {
+#if defined(BACKGROUND_MODEL_SSE2)
+    return update_row_sse2<Var>;
+#elif defined(BACKGROUND_MODEL_NEON)
+    return update_row_neon<Var>;
+#else
+    return update_row_scalar<Var>;
+#endif
+}
+
+} // namespace
+
+BackgroundModel::BackgroundModel(int width, int height, MotionMode mode, int learn_shift,
+                                 double sigma_k, uint8_t threshold)
+    : w(width), h(height), model_mode(mode),
+      shift(min(7, max(1, learn_shift))), slow_shift(min(7, max(1, learn_shift)) + 3),
+      thr(threshold),
+      mean(static_cast<size_t>(width) * height, 0),
+      var(mode == MotionMode::Variance ? static_cast<size_t>(width) * height : 0, 0) {
+    // noise = (var * sigma_mul) >> 16 is k^2 * var / 16, compared against
+    // dd / 16; k is capped just under 4 so the multiplier fits 16 bits
+    double k2 = min(15.99, max(0.0, sigma_k * sigma_k));
+    sigma_mul = static_cast<uint16_t>(lround(k2 * 4096));
+}
+
+void BackgroundModel::reset(const uint8_t* frame, int stride) {
+    // Start every pixel at sigma_k standard deviations == threshold, so
+    // until the model has seen real noise it behaves like the Average mode
+    int t2 = static_cast<int>(thr) * thr;
+    int16_t v0 = static_cast<int16_t>(sigma_mul ? min(16256, t2 * 1024 / sigma_mul) : t2 >> 2);
+    for (int y = 0; y < h; y++) {
+        const uint8_t* row = frame + static_cast<size_t>(y) * stride;
+        int16_t* m = mean.data() + static_cast<size_t>(y) * w;
+        for (int x = 0; x < w; x++) {
+            m[x] = static_cast<int16_t>(row[x] << 7);
+        }
+    }
+    fill(var.begin(), var.end(), v0);
+}
+
+uint32_t BackgroundModel::update_row(int y, const uint8_t* row, uint8_t* mask) {
+    static const UpdateRowFn average_row = select_update_row<false>();
+    static const UpdateRowFn variance_row = select_update_row<true>();
+
+    RowParams p;
+    p.shift = shift;
+    p.slow_shift = slow_shift;
+    p.sigma_mul = sigma_mul;
+    p.thr = thr;
+
+    size_t offset = static_cast<size_t>(y) * w;
+    if (model_mode == MotionMode::Variance) {
+        return variance_row(row, mean.data() + offset, var.data() + offset, mask, w, p);
+    }
+    return average_row(row, mean.data() + offset, nullptr, mask, w, p);
+}
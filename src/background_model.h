@@ -0,0 +1,71 @@
+//
+// Per-pixel background model for motion detection: a running average, or a
+// running average plus variance, kept in 16-bit fixed point and updated in
+// place in the same pass that thresholds the frame.
+//
+#ifndef OPENSENTRY_BACKGROUND_MODEL_H
+#define OPENSENTRY_BACKGROUND_MODEL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What the current frame is compared against
+enum class MotionMode {
+    FrameDiff,   // Previous frame (original behaviour)
+    Average,     // Running average of past frames
+    Variance     // Running average, with a per-pixel noise estimate
+};
+
+inline MotionMode parseMotionMode(const std::string& name) {
+    if (name == "average") return MotionMode::Average;
+    if (name == "variance") return MotionMode::Variance;
+    return MotionMode::FrameDiff;
+}
+
+inline const char* motionModeName(MotionMode mode) {
+    switch (mode) {
+        case MotionMode::FrameDiff: return "diff";
+        case MotionMode::Average: return "average";
+        case MotionMode::Variance: return "variance";
+    }
+    return "unknown";
+}
+
+// Learning rates are powers of two, 1/2^learn_shift per frame. Pixels
+// flagged as foreground learn 8x slower: a slow mover is still reported,
+// and something that stops for good is absorbed eventually.
+class BackgroundModel {
+public:
+    // `threshold` is the minimum luma difference that counts, as in frame
+    // differencing. In Variance mode a pixel must also differ by more than
+    // `sigma_k` standard deviations of its own history.
+    BackgroundModel(int width, int height, MotionMode mode, int learn_shift,
+                    double sigma_k, uint8_t threshold);
+
+    // Starts the model over from one frame
+    void reset(const uint8_t* frame, int stride);
+
+    // Thresholds row `y` of the current frame against the model into
+    // `mask` (0/255 bytes), updates the model for that row and returns the
+    // number of foreground pixels.
+    uint32_t update_row(int y, const uint8_t* row, uint8_t* mask);
+
+    int width() const { return w; }
+    int height() const { return h; }
+    MotionMode mode() const { return model_mode; }
+
+private:
+    int w;
+    int h;
+    MotionMode model_mode;
+    int shift;         // Background learning shift
+    int slow_shift;    // Foreground learning shift
+    uint16_t sigma_mul;  // sigma_k^2 scaled for the fixed-point variance test
+    uint8_t thr;
+
+    std::vector<int16_t> mean;   // Luma << 7 (8.7 fixed point)
+    std::vector<int16_t> var;    // Mean squared difference / 4 (Variance mode only)
+};
+
+#endif // OPENSENTRY_BACKGROUND_MODEL_H
@@ -0,0 +1,35 @@
+//
+// Detection cadence
+//
+#include "detection_scheduler.h"
+
+using namespace std;
+
+DetectionScheduler::DetectionScheduler(int idle_fps, int idle_after_ms)
+    : interval(idle_fps > 0 ? 1000000 / idle_fps : 0), idle_after(idle_after_ms),
+      is_idle(enabled()), changes(0) {}
+
+bool DetectionScheduler::due(chrono::steady_clock::time_point captured) {
+    if (!enabled() || !is_idle) return true;
+    if (captured < next_due) return false;
+    // Keeps the average rate on frame timing that doesn't divide the
+    // interval; after a gap in the input it restarts from this frame
+    next_due += interval;
+    if (next_due <= captured) next_due = captured + interval;
+    return true;
+}
+
+void DetectionScheduler::analysed(bool change, chrono::steady_clock::time_point captured) {
+    if (!enabled()) return;
+    if (change) {
+        last_change = captured;
+        if (is_idle) {
+            is_idle = false;
+            changes++;
+        }
+    } else if (!is_idle && captured - last_change >= idle_after) {
+        is_idle = true;
+        next_due = captured + interval;
+        changes++;
+    }
+}
@@ -0,0 +1,40 @@
+//
+// Detection cadence: a quiet scene is only analysed a few times a second,
+// and every frame is analysed from the moment anything changes until the
+// scene has been quiet for a while again.
+//
+#ifndef OPENSENTRY_DETECTION_SCHEDULER_H
+#define OPENSENTRY_DETECTION_SCHEDULER_H
+
+#include <chrono>
+#include <cstdint>
+
+class DetectionScheduler {
+public:
+    // Idle scenes are analysed at `idle_fps` (0 analyses every frame,
+    // always); `idle_after_ms` without change drops back to that rate.
+    DetectionScheduler(int idle_fps, int idle_after_ms);
+
+    bool enabled() const { return interval.count() > 0; }
+
+    // Whether the frame captured at `captured` should be analysed. Always
+    // true while active; while idle, the first frame of each interval.
+    bool due(std::chrono::steady_clock::time_point captured);
+
+    // Result of an analysed frame. Change (motion, or activity short of
+    // it) makes the schedule active.
+    void analysed(bool change, std::chrono::steady_clock::time_point captured);
+
+    bool idle() const { return is_idle; }
+    uint64_t transitions() const { return changes; }   // Idle <-> active, either way
+
+private:
+    std::chrono::microseconds interval;
+    std::chrono::milliseconds idle_after;
+    bool is_idle;
+    std::chrono::steady_clock::time_point next_due;     // Idle: next frame to analyse
+    std::chrono::steady_clock::time_point last_change;  // Active: last frame that saw change
+    uint64_t changes;
+};
+
+#endif // OPENSENTRY_DETECTION_SCHEDULER_H
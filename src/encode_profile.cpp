@@ -0,0 +1,92 @@
+//
+// Motion-adaptive encoding
+//
+#include "encode_profile.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/opt.h>
+}
+
+using namespace std;
+
+EncodeProfile::EncodeProfile(AVCodecContext* codec_ctx, const EncodeProfileConfig& cfg)
+    : codec(codec_ctx), config(cfg), rate_divisor(1), crf_offset(0),
+      frame_count(0), quiet_frames(0), is_idle(false) {
+    roi_pool = av_buffer_pool_init(sizeof(AVRegionOfInterest), nullptr);
+
+    int fps = codec->framerate.num > 0 && codec->framerate.den > 0
+                  ? codec->framerate.num / codec->framerate.den : 30;
+    source_fps = fps;
+    idle_divisor = config.idle_fps > 0 ? max(1, fps / config.idle_fps) : 1;
+    idle_after_frames = static_cast<int64_t>(config.idle_after_ms) * fps / 1000;
+
+    cout << "[Encode] Adaptive profile: active crf " << config.active_crf
+         << ", idle crf " << config.idle_crf << " at " << fps / idle_divisor << " fps" << endl;
+}
+
+EncodeProfile::~EncodeProfile() {
+    av_buffer_pool_uninit(&roi_pool);
+}
+
+bool EncodeProfile::prepare(AVFrame* frame, bool motion, const cv::Rect& region) {
+    int64_t n = frame_count++;
+
+    if (motion) {
+        quiet_frames = 0;
+        if (is_idle) {
+            is_idle = false;
+            set_crf(config.active_crf + crf_offset);
+        }
+    } else if (!is_idle && ++quiet_frames > idle_after_frames) {
+        is_idle = true;
+        set_crf(config.idle_crf + crf_offset);
+    }
+
+    if (is_idle) {
+        return n % max(idle_divisor, rate_divisor) == 0;
+    }
+    if (n % rate_divisor != 0) {
+        return false;
+    }
+
+    if (motion && region.area() > 0 && config.roi_qoffset != 0) {
+        // Buffers come back to the pool when the encoder drops the frame
+        AVBufferRef* buf = av_buffer_pool_get(roi_pool);
+        if (buf) {
+            AVRegionOfInterest* roi = reinterpret_cast<AVRegionOfInterest*>(buf->data);
+            roi->self_size = sizeof(AVRegionOfInterest);
+            roi->top = region.y;
+            roi->bottom = region.y + region.height;
+            roi->left = region.x;
+            roi->right = region.x + region.width;
+            roi->qoffset = {static_cast<int>(config.roi_qoffset * 100), 100};
+            if (!av_frame_new_side_data_from_buf(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, buf)) {
+                av_buffer_unref(&buf);
+            }
+        }
+    }
+    return true;
+}
+
+void EncodeProfile::finish(AVFrame* frame) {
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+}
+
+void EncodeProfile::set_limits(int max_fps, int offset) {
+    rate_divisor = max_fps > 0 ? max(1, source_fps / max_fps) : 1;
+    if (offset != crf_offset) {
+        crf_offset = offset;
+        set_crf((is_idle ? config.idle_crf : config.active_crf) + crf_offset);
+    }
+}
+
+void EncodeProfile::set_crf(int crf) {
+    // libx264 compares its crf option against the running parameters before
+    // every frame and reconfigures the encoder when they differ.
+    av_opt_set(codec->priv_data, "crf", to_string(min(max(crf, 0), 51)).c_str(), 0);
+}
@@ -0,0 +1,65 @@
+//
+// Motion-adaptive encoding: ROI quantisation around detected motion and a
+// cheaper idle profile (lower frame rate and quality) for static scenes.
+//
+#ifndef OPENSENTRY_ENCODE_PROFILE_H
+#define OPENSENTRY_ENCODE_PROFILE_H
+
+#include <opencv2/core.hpp>
+#include <cstdint>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+}
+
+struct EncodeProfileConfig {
+    int active_crf = 23;         // x264 CRF while there is motion
+    int idle_crf = 30;           // x264 CRF for static scenes
+    int idle_fps = 5;            // Frame rate for static scenes (0 = full rate)
+    int idle_after_ms = 3000;    // Quiet time before dropping to the idle profile
+    double roi_qoffset = -0.3;   // Quantiser offset inside the motion box (-1..1, lower = better)
+};
+
+class EncodeProfile {
+public:
+    // `codec` must be libx264 opened with config.active_crf; the CRF is then
+    // changed in place, which libx264 applies with x264_encoder_reconfig.
+    EncodeProfile(AVCodecContext* codec, const EncodeProfileConfig& config);
+    ~EncodeProfile();
+
+    EncodeProfile(const EncodeProfile&) = delete;
+    EncodeProfile& operator=(const EncodeProfile&) = delete;
+
+    // Chooses the profile for the next live frame. Returns false if the
+    // idle frame rate or the quality cap says to skip it. Otherwise, when `motion` is set,
+    // attaches `region` as ROI side data. Motion switches back to the
+    // active profile on that same frame.
+    bool prepare(AVFrame* frame, bool motion, const cv::Rect& region);
+
+    // Drops the ROI side data again once the encoder has taken its reference
+    void finish(AVFrame* frame);
+
+    // Caps the output frame rate and shifts both CRFs, for the quality
+    // controller. Applies from the next prepare().
+    void set_limits(int max_fps, int crf_offset);
+
+    bool idle() const { return is_idle; }
+
+private:
+    void set_crf(int crf);
+
+    AVCodecContext* codec;
+    EncodeProfileConfig config;
+    AVBufferPool* roi_pool;   // One AVRegionOfInterest per buffer, recycled
+    int source_fps;
+    int idle_divisor;         // Encode every Nth frame while idle
+    int rate_divisor;         // Encode every Nth frame under the quality cap
+    int crf_offset;
+    int64_t frame_count;
+    int64_t quiet_frames;     // Frames since motion was last seen
+    int64_t idle_after_frames;
+    bool is_idle;
+};
+
+#endif // OPENSENTRY_ENCODE_PROFILE_H
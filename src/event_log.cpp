@@ -0,0 +1,170 @@
+//
+// Memory-mapped motion event log
+//
+#include "event_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const char kMagic[8] = {'O', 'S', 'E', 'V', 'L', 'O', 'G', '1'};
+const size_t kHeaderBytes = 4096;   // Records start on their own page
+const size_t kMinSlots = 16;
+
+} // namespace
+
+struct EventLog::Header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t slots;
+    uint64_t next_seq;     // Seq the next append gets
+    uint64_t acked_seq;    // Every record up to here was delivered
+};
+
+EventLog::EventLog()
+    : fd(-1), mapping(nullptr), mapped_bytes(0), header(nullptr), records(nullptr), slots(0) {}
+
+EventLog::~EventLog() {
+    close();
+}
+
+void EventLog::close() {
+    if (mapping) {
+        munmap(mapping, mapped_bytes);
+        mapping = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    header = nullptr;
+    records = nullptr;
+}
+
+bool EventLog::open(const string& path, size_t max_bytes) {
+    close();
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        cerr << "[EventLog] Cannot open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    // An existing log is read as it was made; a new one is sized from
+    // max_bytes and its blocks reserved up front, so appends never grow it
+    Header existing;
+    bool reuse = pread(fd, &existing, sizeof(existing), 0) == static_cast<ssize_t>(sizeof(existing)) &&
+                 memcmp(existing.magic, kMagic, sizeof(kMagic)) == 0 &&
+                 existing.record_size == sizeof(EventRecord) && existing.slots >= kMinSlots;
+    size_t configured = max(kMinSlots, (max_bytes > kHeaderBytes ? max_bytes - kHeaderBytes : 0) / sizeof(EventRecord));
+    size_t want = reuse ? static_cast<size_t>(existing.slots) : configured;
+    mapped_bytes = kHeaderBytes + want * sizeof(EventRecord);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (reuse && static_cast<size_t>(st.st_size) < mapped_bytes)) {
+        reuse = false;  // Truncated: start over
+    }
+    if (!reuse) {
+        int err = ftruncate(fd, 0) == 0 ? posix_fallocate(fd, 0, static_cast<off_t>(mapped_bytes)) : errno;
+        if (err != 0) {
+            cerr << "[EventLog] Cannot allocate " << mapped_bytes << " bytes for " << path << ": " << strerror(err) << endl;
+            close();
+            return false;
+        }
+    }
+
+    mapping = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        cerr << "[EventLog] Cannot map " << path << ": " << strerror(errno) << endl;
+        close();
+        return false;
+    }
+    header = static_cast<Header*>(mapping);
+    records = reinterpret_cast<EventRecord*>(static_cast<char*>(mapping) + kHeaderBytes);
+    slots = want;
+
+    if (!reuse) {
+        // posix_fallocate zero-fills, so every slot already reads as unused
+        memcpy(header->magic, kMagic, sizeof(kMagic));
+        header->record_size = sizeof(EventRecord);
+        header->reserved = 0;
+        header->slots = slots;
+        header->next_seq = 1;
+        header->acked_seq = 0;
+        cout << "[EventLog] Created " << path << " (" << slots << " events)" << endl;
+    } else {
+        // The header is bumped after the record is written; a crash in
+        // between leaves records the header doesn't count yet
+        while (slot(header->next_seq)->seq == header->next_seq) {
+            header->next_seq++;
+        }
+        header->acked_seq = min(header->acked_seq, header->next_seq - 1);
+        if (configured != slots) {
+            cout << "[EventLog] " << path << " keeps its size of " << slots
+                 << " events; delete it to apply a new size" << endl;
+        }
+        cout << "[EventLog] Opened " << path << ": " << end_seq() - first_seq() << " events, "
+             << end_seq() - max(acked() + 1, first_seq()) << " not yet delivered" << endl;
+    }
+    return true;
+}
+
+uint64_t EventLog::append(EventRecord& record) {
+    uint64_t seq = header->next_seq;
+    record.seq = seq;
+    record.index_time = record.timestamp;
+    if (seq > first_seq()) {
+        record.index_time = max(record.index_time, slot(seq - 1)->index_time);
+    }
+    // Overwriting the oldest record also drops it from the undelivered range
+    *slot(seq) = record;
+    header->next_seq = seq + 1;
+    return seq;
+}
+
+const EventRecord* EventLog::get(uint64_t seq) const {
+    if (seq < first_seq() || seq >= end_seq()) return nullptr;
+    return slot(seq);
+}
+
+uint64_t EventLog::first_seq() const {
+    uint64_t end = header->next_seq;
+    return end > slots ? end - slots : 1;
+}
+
+uint64_t EventLog::end_seq() const {
+    return header->next_seq;
+}
+
+uint64_t EventLog::lower_bound(int64_t time) const {
+    uint64_t lo = first_seq();
+    uint64_t hi = end_seq();
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (slot(mid)->index_time < time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+uint64_t EventLog::acked() const {
+    return header->acked_seq;
+}
+
+void EventLog::set_acked(uint64_t seq) {
+    header->acked_seq = seq;
+}
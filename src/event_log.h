@@ -0,0 +1,86 @@
+//
+// On-device motion event log: one memory-mapped file per camera holding a
+// ring of fixed-size records, so events survive a broker outage or a
+// restart and can be looked up by time. The file is allocated once at its
+// full size and written sequentially in place; appends only dirty the page
+// cache and reach the card with the kernel's periodic writeback, so a busy
+// scene costs a few block writes a minute, not one per event.
+//
+#ifndef OPENSENTRY_EVENT_LOG_H
+#define OPENSENTRY_EVENT_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// One motion event as stored. Plain data with a fixed layout: the file is
+// the array of these behind a one-page header.
+struct EventRecord {
+    enum Kind : uint8_t { MotionStart = 0, MotionEnd = 1 };
+    static const size_t kClipPath = 192;
+
+    uint64_t seq = 0;             // From 1, per camera; 0 marks an unused slot
+    int64_t timestamp = 0;        // Unix seconds, as published
+    int64_t index_time = 0;       // Timestamp, never less than the previous record's (the lookup key)
+    uint8_t kind = MotionStart;
+    uint8_t reserved[3] = {0, 0, 0};
+    int32_t duration = 0;         // MotionEnd: seconds
+    int32_t area[4] = {0, 0, 0, 0};  // MotionStart: x, y, width, height
+    uint32_t zones = 0;
+    uint32_t snapshot = 0;        // MotionStart: snapshot id (0 = none)
+    char clip[kClipPath] = {0};   // MotionEnd: clip path, empty if none
+    uint8_t padding[8] = {0};
+};
+
+static_assert(sizeof(EventRecord) == 256, "EventRecord is the on-disk layout");
+
+// Single-threaded: the event publisher's thread is the only user.
+class EventLog {
+public:
+    EventLog();
+    ~EventLog();
+
+    EventLog(const EventLog&) = delete;
+    EventLog& operator=(const EventLog&) = delete;
+
+    // Opens or creates the log at `path`, sized for `max_bytes`. An existing
+    // log keeps the size it was created with. Prints why and returns false
+    // on failure.
+    bool open(const std::string& path, size_t max_bytes);
+
+    // Stores `record`, overwriting the oldest one once the ring is full.
+    // Sets its seq and index_time and returns the seq.
+    uint64_t append(EventRecord& record);
+
+    // The record with sequence number `seq`, or null if it was overwritten
+    // or not written yet
+    const EventRecord* get(uint64_t seq) const;
+
+    // Records held are [first_seq(), end_seq())
+    uint64_t first_seq() const;
+    uint64_t end_seq() const;
+    size_t capacity() const { return slots; }
+
+    // First seq in the log whose index time is at or after `time`
+    // (end_seq() if none): a binary search over the ring
+    uint64_t lower_bound(int64_t time) const;
+
+    // Every record up to `seq` has been delivered
+    uint64_t acked() const;
+    void set_acked(uint64_t seq);
+
+private:
+    struct Header;
+
+    EventRecord* slot(uint64_t seq) const { return records + (seq - 1) % slots; }
+    void close();
+
+    int fd;
+    void* mapping;
+    size_t mapped_bytes;
+    Header* header;
+    EventRecord* records;
+    size_t slots;
+};
+
+#endif // OPENSENTRY_EVENT_LOG_H
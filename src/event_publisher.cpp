@@ -0,0 +1,692 @@
+//
+// MQTT event publisher
+//
+#include "event_publisher.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+using namespace std;
+
+EventPublisher::EventPublisher(mqtt::async_client& mqtt, const PublisherConfig& cfg)
+    : client(mqtt), config(cfg), queue(cfg.queue_capacity), accepting(false), running(false),
+      dropped(0), waiters(0), json(4096), activity_lost(0), spool_file(nullptr), spool_bytes(0),
+      spooled(0), spool_lost(0), merged(0), log_lost(0), log_replayed(0) {}
+
+EventPublisher::~EventPublisher() {
+    stop();
+}
+
+void* EventPublisher::ActivityQueue::operator new(size_t size) {
+    void* mem;
+    if (posix_memalign(&mem, alignof(ActivityQueue), size) != 0) throw bad_alloc();
+    return mem;
+}
+
+void EventPublisher::ActivityQueue::operator delete(void* mem) {
+    free(mem);
+}
+
+int EventPublisher::add_camera(const string& id, const vector<string>& zone_names) {
+    CameraState camera;
+    camera.status_topic = "opensentry/" + id + "/status";
+    camera.motion_topic = "opensentry/" + id + "/motion";
+    camera.quality_topic = "opensentry/" + id + "/quality";
+    camera.activity_topic = "opensentry/" + id + "/activity";
+    camera.snapshot_topic = "opensentry/" + id + "/snapshot";
+    camera.events_topic = "opensentry/" + id + "/events";
+    camera.zone_names = zone_names;
+    camera.activity.reset(new ActivityQueue());
+    camera.snapshots.reset(new SnapshotCache(config.snapshot_cache));
+    if (!config.log_dir.empty()) {
+        camera.log.reset(new EventLog());
+        if (camera.log->open(config.log_dir + "/" + id + ".evlog", config.log_max_bytes)) {
+            // Whatever the last run didn't get acknowledged goes out first
+            camera.log_cursor = max(camera.log->acked() + 1, camera.log->first_seq());
+        } else {
+            cerr << "[MQTT] " << id << ": no event log, motion events use the spool" << endl;
+            camera.log.reset();
+        }
+    }
+    cameras.push_back(move(camera));
+    return static_cast<int>(cameras.size()) - 1;
+}
+
+void EventPublisher::start() {
+    if (!config.spool_path.empty()) {
+        // Anything left over from a previous run goes out first
+        FILE* f = fopen(config.spool_path.c_str(), "rb");
+        if (f) {
+            fseek(f, 0, SEEK_END);
+            spool_bytes = static_cast<size_t>(max(0L, ftell(f)));
+            fclose(f);
+        }
+    }
+    running = true;
+    accepting = true;
+    worker = thread(&EventPublisher::run, this);
+}
+
+void EventPublisher::stop() {
+    if (!worker.joinable()) return;
+    accepting = false;
+    running = false;
+    {
+        lock_guard<mutex> lock(wake_mutex);
+        wake.notify_all();
+    }
+    worker.join();
+    if (spool_file) {
+        fclose(spool_file);
+        spool_file = nullptr;
+    }
+    if (dropped.load() || spooled || spool_lost || merged || activity_lost || log_lost || log_replayed) {
+        cout << "[MQTT] Events: " << merged << " motion restarts merged, " << spooled << " spooled, "
+             << dropped.load() << " dropped (queue full), " << spool_lost << " lost (spool full), "
+             << activity_lost << " activity grids not sent, " << log_replayed << " resent from the event log, "
+             << log_lost << " overwritten in the log before delivery" << endl;
+    }
+}
+
+void EventPublisher::post(NodeEvent& event) {
+    if (!accepting.load(memory_order_relaxed)) return;
+    event.timestamp = time(nullptr);
+    if (!queue.try_push(event)) {
+        dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    notify();
+}
+
+void EventPublisher::notify() {
+    // Same handshake as StageQueue: the publisher either sees the event
+    // when it re-checks the rings, or we see it waiting and wake it
+    atomic_thread_fence(memory_order_seq_cst);
+    if (waiters.load() > 0) {
+        lock_guard<mutex> lock(wake_mutex);
+        wake.notify_one();
+    }
+}
+
+bool EventPublisher::activity(int camera, const ActivityFrame& frame) {
+    if (!accepting.load(memory_order_relaxed) || camera < 0 || camera >= static_cast<int>(cameras.size())) {
+        return false;
+    }
+    if (!cameras[camera].activity->ring.try_push(frame)) {
+        return false;
+    }
+    notify();
+    return true;
+}
+
+void EventPublisher::status(int camera, const char* status) {
+    NodeEvent event;
+    event.kind = NodeEvent::Kind::Status;
+    event.camera = static_cast<uint16_t>(camera);
+    event.status = status;
+    post(event);
+}
+
+void EventPublisher::motion_start(int camera, int x, int y, int width, int height, uint32_t zones,
+                                  uint32_t snapshot) {
+    NodeEvent event;
+    event.kind = NodeEvent::Kind::MotionStart;
+    event.camera = static_cast<uint16_t>(camera);
+    event.area[0] = x;
+    event.area[1] = y;
+    event.area[2] = width;
+    event.area[3] = height;
+    event.zones = zones;
+    event.snapshot = snapshot;
+    post(event);
+}
+
+void EventPublisher::motion_end(int camera, int duration, uint32_t zones, const string& clip) {
+    NodeEvent event;
+    event.kind = NodeEvent::Kind::MotionEnd;
+    event.camera = static_cast<uint16_t>(camera);
+    event.duration = duration;
+    event.zones = zones;
+    if (clip.size() < sizeof(event.clip)) {
+        memcpy(event.clip, clip.c_str(), clip.size() + 1);
+    } else {
+        cerr << "[MQTT] Clip path too long for motion_end, omitted: " << clip << endl;
+    }
+    post(event);
+}
+
+void EventPublisher::quality(int camera, const QualityReport& report) {
+    NodeEvent event;
+    event.kind = NodeEvent::Kind::Quality;
+    event.camera = static_cast<uint16_t>(camera);
+    event.quality = report;
+    post(event);
+}
+
+void EventPublisher::snapshot(int camera, shared_ptr<const Snapshot> snapshot) {
+    if (!accepting.load(memory_order_relaxed) || camera < 0 || camera >= static_cast<int>(cameras.size())) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(snapshot_mutex);
+        new_snapshots.emplace_back(camera, move(snapshot));
+    }
+    notify();
+}
+
+void EventPublisher::resend_snapshots(int camera) {
+    NodeEvent event;
+    event.kind = NodeEvent::Kind::ResendSnapshots;
+    event.camera = static_cast<uint16_t>(camera);
+    post(event);
+}
+
+void EventPublisher::query(int camera, const EventQuery& query) {
+    NodeEvent event;
+    event.kind = NodeEvent::Kind::Query;
+    event.camera = static_cast<uint16_t>(camera);
+    event.query = query;
+    post(event);
+}
+
+bool EventPublisher::logging(int camera) const {
+    return camera >= 0 && camera < static_cast<int>(cameras.size()) && cameras[camera].log;
+}
+
+void EventPublisher::run() {
+    NodeEvent event;
+    while (true) {
+        // Read before draining, so everything posted before stop() is seen
+        bool stopping = !running.load();
+        while (queue.try_pop(event)) {
+            absorb(event, Clock::now());
+        }
+        send_activity();
+        send_snapshots();
+        if (spool_bytes > 0 && client.is_connected()) {
+            replay_spool();
+        }
+        auto now = Clock::now();
+        for (CameraState& c : cameras) {
+            if (!c.log) continue;
+            collect_acks(c, now);
+            send_logged(c);
+        }
+        flush(now, stopping);
+        if (stopping) break;
+
+        waiters.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool idle = queue.empty();
+        {
+            lock_guard<mutex> lock(snapshot_mutex);
+            if (!new_snapshots.empty()) idle = false;
+        }
+        for (const CameraState& c : cameras) {
+            if (!c.activity->ring.empty()) idle = false;
+        }
+        if (idle && running) {
+            unique_lock<mutex> lock(wake_mutex);
+            // Wakes for pending deadlines, and once a second to notice the
+            // broker coming back while only the spool or state is waiting
+            wake.wait_until(lock, next_due(now));
+        }
+        waiters.fetch_sub(1);
+    }
+}
+
+void EventPublisher::send_activity() {
+    for (CameraState& c : cameras) {
+        while (c.activity->ring.try_pop(grid)) {
+            bool sent = false;
+            if (client.is_connected()) {
+                try {
+                    client.publish(c.activity_topic, grid.data, grid.length, 0, false);
+                    sent = true;
+                } catch (const mqtt::exception&) {
+                }
+            }
+            // Subscribers resync on the next keyframe (sequence numbers show the gap)
+            if (!sent) activity_lost++;
+        }
+    }
+}
+
+void EventPublisher::send_snapshots() {
+    {
+        lock_guard<mutex> lock(snapshot_mutex);
+        sending.swap(new_snapshots);
+    }
+    for (auto& entry : sending) {
+        CameraState& c = cameras[entry.first];
+        c.snapshots->add(entry.second);
+        publish_snapshot(c, *entry.second, true);
+    }
+    sending.clear();
+}
+
+void EventPublisher::publish_snapshot(const CameraState& camera, const Snapshot& snapshot, bool latest) {
+    if (!client.is_connected()) return;
+    try {
+        client.publish(camera.snapshot_topic + "/" + to_string(snapshot.id),
+                       snapshot.jpeg.data(), snapshot.jpeg.size(), 0, false);
+        if (latest) {
+            // Retained, so a dashboard that connects later still gets it
+            client.publish(camera.snapshot_topic, snapshot.jpeg.data(), snapshot.jpeg.size(), 0, true);
+        }
+    } catch (const mqtt::exception&) {
+    }
+}
+
+void EventPublisher::absorb(const NodeEvent& event, Clock::time_point now) {
+    if (event.camera >= cameras.size()) return;
+    CameraState& c = cameras[event.camera];
+    switch (event.kind) {
+    case NodeEvent::Kind::Status:
+        c.status = event;
+        c.status_pending = true;
+        break;
+    case NodeEvent::Kind::Quality:
+        c.quality = event;
+        c.quality_pending = true;
+        break;
+    case NodeEvent::Kind::ResendSnapshots:
+        for (const auto& snapshot : c.snapshots->recent()) {
+            publish_snapshot(c, *snapshot, false);
+        }
+        break;
+    case NodeEvent::Kind::Query:
+        answer_query(c, event.query);
+        break;
+    case NodeEvent::Kind::MotionStart:
+        if (c.end_pending) {
+            // Motion came back within the window: the held end never goes
+            // out and the event carries on
+            c.end_pending = false;
+            c.motion_zones |= event.zones;
+            merged++;
+            return;
+        }
+        c.motion_open = true;
+        c.motion_started = event.timestamp;
+        c.motion_zones = event.zones;
+        send_motion(c, event);
+        break;
+    case NodeEvent::Kind::MotionEnd:
+        // A merged event reports every zone it touched; the latest clip wins
+        c.end = event;
+        c.end.zones |= c.motion_zones;
+        c.motion_zones = c.end.zones;
+        c.end_pending = true;
+        c.end_due = now + config.coalesce;
+        break;
+    }
+}
+
+void EventPublisher::flush(Clock::time_point now, bool final) {
+    for (CameraState& c : cameras) {
+        if (c.end_pending && (final || now >= c.end_due)) {
+            if (c.motion_open) {
+                c.end.duration = static_cast<int32_t>(c.end.timestamp - c.motion_started);
+            }
+            send_motion(c, c.end);
+            c.end_pending = false;
+            c.motion_open = false;
+            c.motion_zones = 0;
+        }
+        // Status and quality only keep their latest value: while the
+        // broker is away they stay pending rather than being spooled
+        if (c.status_pending && (final || now >= c.status_sent + config.coalesce)) {
+            if (send(c.status_topic, status_json(c.status)) || final) {
+                c.status_pending = false;
+                c.status_sent = now;
+            }
+        }
+        if (c.quality_pending && (final || now >= c.quality_sent + config.coalesce)) {
+            if (send(c.quality_topic, quality_json(c.quality)) || final) {
+                c.quality_pending = false;
+                c.quality_sent = now;
+            }
+        }
+    }
+}
+
+EventPublisher::Clock::time_point EventPublisher::next_due(Clock::time_point now) const {
+    Clock::time_point due = now + chrono::seconds(1);
+    for (const CameraState& c : cameras) {
+        // Acks arrive on Paho's thread; look for them soon
+        if (!c.in_flight.empty()) due = min(due, now + chrono::milliseconds(50));
+        if (c.end_pending) due = min(due, c.end_due);
+        if (c.status_pending) due = min(due, max(now, c.status_sent + config.coalesce));
+        if (c.quality_pending) due = min(due, max(now, c.quality_sent + config.coalesce));
+    }
+    return due;
+}
+
+size_t EventPublisher::status_json(const NodeEvent& event) {
+    int n = snprintf(json.data(), json.size(),
+                     "{\"status\": \"%s\",\"node_type\": \"motion\","
+                     "\"capabilities\": [\"streaming\", \"motion_detection\"],"
+                     "\"timestamp\": %lld}",
+                     event.status, static_cast<long long>(event.timestamp));
+    return min(static_cast<size_t>(max(n, 0)), json.size() - 1);
+}
+
+size_t EventPublisher::motion_json(const CameraState& camera, const NodeEvent& event) {
+    // Logged events carry their seq, so a subscriber can drop the copies a
+    // resend after a reconnect may produce
+    char seq[32] = "";
+    if (event.seq) {
+        snprintf(seq, sizeof(seq), "\"seq\": %llu,", static_cast<unsigned long long>(event.seq));
+    }
+    int n;
+    if (event.kind == NodeEvent::Kind::MotionStart) {
+        // The JPEG follows on this topic once the worker has encoded it
+        char snapshot[256] = "";
+        if (event.snapshot) {
+            snprintf(snapshot, sizeof(snapshot), "\"snapshot\": \"%s/%u\",",
+                     camera.snapshot_topic.c_str(), event.snapshot);
+        }
+        n = snprintf(json.data(), json.size(),
+                     "{\"event\": \"motion_start\",%s\"timestamp\": %lld,"
+                     "\"area_x\": %d,\"area_y\": %d,\"area_width\": %d,\"area_height\": %d,"
+                     "%s\"zones\": [",
+                     seq, static_cast<long long>(event.timestamp),
+                     event.area[0], event.area[1], event.area[2], event.area[3], snapshot);
+    } else {
+        n = snprintf(json.data(), json.size(),
+                     "{\"event\": \"motion_end\",%s\"timestamp\": %lld,\"duration\": %d,\"zones\": [",
+                     seq, static_cast<long long>(event.timestamp), event.duration);
+    }
+    size_t length = min(static_cast<size_t>(max(n, 0)), json.size() - 1);
+    append_zones(length, camera, event.zones);
+    // Clip is finished post-roll seconds after motion_end
+    if (event.kind == NodeEvent::Kind::MotionEnd && event.clip[0]) {
+        n = snprintf(json.data() + length, json.size() - length, "],\"clip\": \"%s\"}", event.clip);
+    } else {
+        n = snprintf(json.data() + length, json.size() - length, "]}");
+    }
+    return min(length + static_cast<size_t>(max(n, 0)), json.size() - 1);
+}
+
+void EventPublisher::append_zones(size_t& length, const CameraState& camera, uint32_t zones) {
+    bool first = true;
+    for (size_t z = 0; z < camera.zone_names.size() && z < 32; z++) {
+        if (!(zones & (1u << z))) continue;
+        int n = snprintf(json.data() + length, json.size() - length, "%s\"%s\"",
+                         first ? "" : ",", camera.zone_names[z].c_str());
+        length = min(length + static_cast<size_t>(max(n, 0)), json.size() - 1);
+        first = false;
+    }
+}
+
+size_t EventPublisher::quality_json(const NodeEvent& event) {
+    const QualityReport& q = event.quality;
+    int n = snprintf(json.data(), json.size(),
+                     "{\"rung\": %d, \"rungs\": %d, \"fps\": %d, \"max_kbps\": %d, \"crf_offset\": %d, "
+                     "\"reason\": \"%s\", \"encode_load\": %.2f, \"write_load\": %.2f, \"backlog\": %.2f}",
+                     q.rung, q.rungs, q.fps, q.max_kbps, q.crf_offset, q.reason,
+                     q.encode_load, q.write_load, q.backlog);
+    return min(static_cast<size_t>(max(n, 0)), json.size() - 1);
+}
+
+bool EventPublisher::send(const string& topic, size_t length) {
+    if (!client.is_connected()) return false;
+    try {
+        client.publish(topic, json.data(), length, 0, false);
+        return true;
+    } catch (const mqtt::exception&) {
+        // Lost between the check and the publish; the reconnect is Paho's
+        return false;
+    }
+}
+
+void EventPublisher::send_motion(CameraState& camera, const NodeEvent& event) {
+    if (!camera.log) {
+        send_or_spool(camera.motion_topic, motion_json(camera, event));
+        return;
+    }
+    EventRecord record;
+    record.kind = event.kind == NodeEvent::Kind::MotionStart ? EventRecord::MotionStart : EventRecord::MotionEnd;
+    record.timestamp = event.timestamp;
+    record.duration = event.duration;
+    copy(event.area, event.area + 4, record.area);
+    record.zones = event.zones;
+    record.snapshot = event.snapshot;
+    memcpy(record.clip, event.clip, sizeof(record.clip));
+    camera.log->append(record);
+    // Earlier events still waiting for the broker go first
+    send_logged(camera);
+}
+
+void EventPublisher::send_or_spool(const string& topic, size_t length) {
+    // Spooled events go first so the broker sees them in order
+    if (spool_bytes == 0 && send(topic, length)) return;
+    spool(topic, length);
+}
+
+void EventPublisher::spool(const string& topic, size_t length) {
+    size_t line = topic.size() + 1 + length + 1;
+    if (config.spool_path.empty() || spool_bytes + line > config.spool_max_bytes) {
+        spool_lost++;
+        return;
+    }
+    if (!spool_file) {
+        spool_file = fopen(config.spool_path.c_str(), "ab");
+        if (!spool_file) {
+            cerr << "[MQTT] Cannot open spool " << config.spool_path << endl;
+            spool_lost++;
+            return;
+        }
+    }
+    // One "topic<TAB>payload" line per message; the JSON has no newlines
+    fprintf(spool_file, "%s\t%.*s\n", topic.c_str(), static_cast<int>(length), json.data());
+    fflush(spool_file);
+    if (spool_bytes == 0) {
+        cout << "[MQTT] Broker unreachable, spooling events to " << config.spool_path << endl;
+    }
+    spool_bytes += line;
+    spooled++;
+}
+
+void EventPublisher::replay_spool() {
+    if (spool_file) {
+        fclose(spool_file);
+        spool_file = nullptr;
+    }
+    FILE* f = fopen(config.spool_path.c_str(), "rb");
+    if (!f) {
+        spool_bytes = 0;
+        return;
+    }
+    // Bounded by spool_max_bytes, so reading it whole is fine on this
+    // (cold) path
+    string contents;
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        contents.append(chunk, n);
+    }
+    fclose(f);
+
+    size_t pos = 0;
+    size_t sent = 0;
+    while (pos < contents.size()) {
+        size_t eol = contents.find('\n', pos);
+        if (eol == string::npos) eol = contents.size();
+        size_t tab = contents.find('\t', pos);
+        if (tab != string::npos && tab < eol) {
+            if (!client.is_connected()) break;
+            try {
+                client.publish(contents.substr(pos, tab - pos), contents.data() + tab + 1,
+                               eol - tab - 1, 0, false);
+            } catch (const mqtt::exception&) {
+                break;
+            }
+            sent++;
+        }
+        pos = eol + 1;
+    }
+
+    // Keep whatever didn't go out for the next reconnect
+    if (pos >= contents.size()) {
+        remove(config.spool_path.c_str());
+    } else if ((f = fopen(config.spool_path.c_str(), "wb"))) {
+        fwrite(contents.data() + pos, 1, contents.size() - pos, f);
+        fclose(f);
+    }
+    spool_bytes = pos < contents.size() ? contents.size() - pos : 0;
+    if (sent) {
+        cout << "[MQTT] Replayed " << sent << " spooled event(s)"
+             << (spool_bytes ? ", broker lost again" : "") << endl;
+    }
+}
+
+// ============================================================================
+// Event log
+// ============================================================================
+namespace {
+
+NodeEvent eventFromRecord(const EventRecord& record) {
+    NodeEvent event;
+    event.kind = record.kind == EventRecord::MotionStart ? NodeEvent::Kind::MotionStart : NodeEvent::Kind::MotionEnd;
+    event.timestamp = record.timestamp;
+    event.duration = record.duration;
+    copy(record.area, record.area + 4, event.area);
+    event.zones = record.zones;
+    event.snapshot = record.snapshot;
+    memcpy(event.clip, record.clip, sizeof(event.clip));
+    event.clip[sizeof(event.clip) - 1] = 0;
+    event.seq = record.seq;
+    return event;
+}
+
+// Value of "key": in a flat JSON object, or null if it isn't there
+const char* findKey(const string& json, const char* key) {
+    string quoted = string("\"") + key + "\"";
+    for (size_t at = json.find(quoted); at != string::npos; at = json.find(quoted, at + 1)) {
+        // Skips the same text as a value: only a key is followed by ':'
+        size_t colon = json.find_first_not_of(" \t", at + quoted.size());
+        if (colon == string::npos || json[colon] != ':') continue;
+        size_t value = json.find_first_not_of(" \t", colon + 1);
+        return value == string::npos ? nullptr : json.c_str() + value;
+    }
+    return nullptr;
+}
+
+bool readInteger(const char* text, long long min_value, long long& value) {
+    if (!text || !(isdigit(static_cast<unsigned char>(*text)) || *text == '-')) return false;
+    char* end;
+    errno = 0;
+    value = strtoll(text, &end, 10);
+    return errno == 0 && end != text && value >= min_value;
+}
+
+} // namespace
+
+bool parseEventQuery(const string& payload, EventQuery& query) {
+    query = EventQuery();
+    long long value;
+    if (!readInteger(findKey(payload, "from"), 0, value)) return false;
+    query.from = value;
+    if (!readInteger(findKey(payload, "to"), query.from, value)) return false;
+    query.to = value;
+    if (const char* after = findKey(payload, "after")) {
+        if (!readInteger(after, 0, value)) return false;
+        query.after = static_cast<uint64_t>(value);
+    }
+    if (const char* limit = findKey(payload, "limit")) {
+        if (!readInteger(limit, 1, value)) return false;
+        query.limit = static_cast<int>(min<long long>(value, EventQuery::kMaxLimit));
+    }
+    if (const char* id = findKey(payload, "id")) {
+        if (*id++ != '"') return false;
+        size_t n = 0;
+        while (id[n] && id[n] != '"') {
+            if (n == EventQuery::kMaxId || !(isalnum(static_cast<unsigned char>(id[n])) || id[n] == '_' || id[n] == '-')) {
+                return false;
+            }
+            query.id[n] = id[n];
+            n++;
+        }
+        if (id[n] != '"') return false;
+    }
+    return true;
+}
+
+void EventPublisher::send_logged(CameraState& c) {
+    if (c.log_cursor < c.log->first_seq()) {
+        // The broker was away for longer than the log holds
+        log_lost += c.log->first_seq() - c.log_cursor;
+        c.log_cursor = c.log->first_seq();
+    }
+    while (c.log_cursor < c.log->end_seq() && c.in_flight.size() < kMaxInFlight && client.is_connected()) {
+        NodeEvent event = eventFromRecord(*c.log->get(c.log_cursor));
+        size_t length = motion_json(c, event);
+        mqtt::delivery_token_ptr token;
+        try {
+            token = client.publish(c.motion_topic, json.data(), length, 1, false);
+        } catch (const mqtt::exception&) {
+            return;  // Lost between the check and the publish; sent once back
+        }
+        // Anything older than the newest event is a resend
+        if (c.log_cursor + 1 < c.log->end_seq()) log_replayed++;
+        c.in_flight.push_back({c.log_cursor, token, Clock::now()});
+        c.log_cursor++;
+    }
+}
+
+void EventPublisher::collect_acks(CameraState& c, Clock::time_point now) {
+    uint64_t acked = c.log->acked();
+    while (!c.in_flight.empty()) {
+        const CameraState::Delivery& d = c.in_flight.front();
+        bool failed = d.token->is_complete() ? d.token->get_return_code() != 0
+                                             : now - d.sent > chrono::seconds(30);
+        if (failed || !client.is_connected()) {
+            // Not confirmed by this session; everything from here goes again
+            c.in_flight.clear();
+            break;
+        }
+        if (!d.token->is_complete()) break;
+        acked = d.seq;
+        c.in_flight.pop_front();
+    }
+    if (acked != c.log->acked()) c.log->set_acked(acked);
+    if (c.in_flight.empty()) {
+        c.log_cursor = max(acked + 1, c.log->first_seq());
+    }
+}
+
+void EventPublisher::answer_query(CameraState& c, const EventQuery& q) {
+    string reply = string("{\"id\": \"") + q.id + "\",";
+    if (!c.log) {
+        reply += "\"error\": \"no event log\"}";
+    } else {
+        // Binary search to the window, then read only what it covers
+        uint64_t seq = max(c.log->lower_bound(q.from), q.after + 1);
+        uint64_t end = c.log->end_seq();
+        reply += "\"from\": " + to_string(q.from) + ",\"to\": " + to_string(q.to) + ",\"events\": [";
+        int count = 0;
+        for (; seq < end && count < q.limit; seq++) {
+            const EventRecord* record = c.log->get(seq);
+            if (!record || record->index_time > q.to) break;
+            if (count++) reply += ",";
+            reply.append(json.data(), motion_json(c, eventFromRecord(*record)));
+        }
+        const EventRecord* next = c.log->get(seq);
+        bool more = next && next->index_time <= q.to;
+        // "more": ask again with "after" set to last_seq for the rest
+        reply += "],\"count\": " + to_string(count) + ",\"more\": " + (more ? "true" : "false") +
+                 ",\"last_seq\": " + to_string(seq - 1) + "}";
+    }
+    if (!client.is_connected()) return;
+    try {
+        client.publish(c.events_topic, reply.data(), reply.size(), 0, false);
+    } catch (const mqtt::exception&) {
+    }
+}
@@ -0,0 +1,249 @@
+//
+// MQTT event publishing off the video path: stages post small fixed-size
+// events to a lock-free queue and return; one publisher thread coalesces
+// them, serialises the JSON and is the only user of the Paho client for
+// camera events.
+//
+#ifndef OPENSENTRY_EVENT_PUBLISHER_H
+#define OPENSENTRY_EVENT_PUBLISHER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mqtt/async_client.h"
+#include "activity_grid.h"
+#include "event_log.h"
+#include "mpsc_ring.h"
+#include "quality_controller.h"
+#include "snapshot.h"
+#include "spsc_ring.h"
+
+// A request on opensentry/<id>/events/query for the logged events of a
+// time window, oldest first
+struct EventQuery {
+    static const size_t kMaxId = 32;
+    static const int kMaxLimit = 500;
+
+    int64_t from = 0;             // Unix seconds, inclusive
+    int64_t to = 0;
+    uint64_t after = 0;           // Only events after this seq (paging)
+    int limit = 100;
+    char id[kMaxId + 1] = {0};    // Echoed in the reply
+};
+
+// Parses {"from": T, "to": T[, "after": N][, "limit": N][, "id": "..."]}.
+// Returns false if the request is malformed.
+bool parseEventQuery(const std::string& payload, EventQuery& query);
+
+// One camera event. Trivially copyable and fixed-size so posting it is a
+// copy into the ring; every string is either static or copied inline.
+struct NodeEvent {
+    enum class Kind : uint8_t { Status, MotionStart, MotionEnd, Quality, ResendSnapshots, Query };
+    static const size_t kClipPath = EventRecord::kClipPath;
+
+    Kind kind = Kind::Status;
+    uint16_t camera = 0;          // Index from EventPublisher::add_camera()
+    int64_t timestamp = 0;        // Unix seconds, taken when posted
+    const char* status = "";      // Status: static string
+    int32_t area[4] = {0, 0, 0, 0};  // MotionStart: x, y, width, height
+    uint32_t zones = 0;           // Motion: zone bits, see zoneNames()
+    uint32_t snapshot = 0;        // MotionStart: id of the snapshot being made (0 = none)
+    int32_t duration = 0;         // MotionEnd: seconds
+    char clip[kClipPath] = {0};   // MotionEnd: finished clip path, empty if none
+    uint64_t seq = 0;             // Motion: position in the event log (0 = not logged)
+    QualityReport quality;        // Quality
+    EventQuery query;             // Query
+};
+
+struct PublisherConfig {
+    std::chrono::milliseconds coalesce{1000};  // Window for merging redundant updates
+    size_t queue_capacity = 256;               // Events in flight before posts are dropped
+    std::string spool_path;                    // Motion events kept here while the broker is away (empty = dropped)
+    size_t spool_max_bytes = 1 << 20;
+    std::string log_dir;                       // Per-camera event logs here (empty = spool only)
+    size_t log_max_bytes = 1 << 20;            // Per camera
+    size_t snapshot_cache = 8;                 // Snapshots kept per camera for ResendSnapshots
+};
+
+// Per camera, within the coalescing window:
+//  - status and quality go out at most once, latest value wins; the first
+//    change after a quiet window goes out straight away
+//  - motion_start goes out straight away, motion_end is held for the
+//    window: motion starting again before it expires continues the same
+//    event (one start/end pair, zones merged, duration to the real end)
+// While the broker is unreachable, motion events are appended to the spool
+// file (bounded) and replayed in order on reconnect; status and quality
+// only keep their latest value. With an event log, motion events are logged
+// first and go out from the log at QoS 1 instead: whatever the broker
+// hasn't acknowledged, including across restarts, is sent again once it is
+// reachable, and the log answers time-window queries. Activity grids and snapshots are streams of
+// their own, never coalesced or spooled: one that can't be sent is dropped.
+class EventPublisher {
+public:
+    EventPublisher(mqtt::async_client& client, const PublisherConfig& config);
+    ~EventPublisher();
+
+    EventPublisher(const EventPublisher&) = delete;
+    EventPublisher& operator=(const EventPublisher&) = delete;
+
+    // Before start(). `zone_names` name the bits of motion zone masks.
+    // Returns the index events for this camera carry.
+    int add_camera(const std::string& id, const std::vector<std::string>& zone_names);
+
+    void start();
+
+    // Publishes (or spools) whatever is pending and ends the thread. Events
+    // posted afterwards are discarded.
+    void stop();
+
+    // Producers, from any thread: a copy into the ring and at most a
+    // notify, never a lock held across I/O. Dropped (and counted) when the
+    // publisher isn't running or the queue is full.
+    void status(int camera, const char* status);
+    void motion_start(int camera, int x, int y, int width, int height, uint32_t zones,
+                      uint32_t snapshot);
+    void motion_end(int camera, int duration, uint32_t zones, const std::string& clip);
+    void quality(int camera, const QualityReport& report);
+
+    // One producer per camera (its motion strand). Returns false if the
+    // grid was dropped, so the next one can be a keyframe.
+    bool activity(int camera, const ActivityFrame& frame);
+
+    // A finished JPEG, from the snapshot worker. Published on
+    // opensentry/<id>/snapshot/<n> and, retained, on opensentry/<id>/snapshot,
+    // and kept in the camera's cache.
+    void snapshot(int camera, std::shared_ptr<const Snapshot> snapshot);
+
+    // Publishes the cached snapshots again (the "snapshot" command)
+    void resend_snapshots(int camera);
+
+    // Answers `query` from the camera's event log on opensentry/<id>/events
+    void query(int camera, const EventQuery& query);
+
+    // True if `camera` has an event log to query
+    bool logging(int camera) const;
+
+    uint64_t dropped_count() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    static const size_t kActivityDepth = 8;
+    static const size_t kMaxInFlight = 32;   // Logged events awaiting the broker's ack, per camera
+
+    // Activity grids are too big for NodeEvent; each camera queues its own
+    struct ActivityQueue {
+        SpscRing<ActivityFrame> ring{kActivityDepth};
+
+        // The ring keeps its indices on separate cache lines; C++14 new
+        // doesn't honour that alignment on its own
+        static void* operator new(size_t size);
+        static void operator delete(void* mem);
+    };
+
+    struct CameraState {
+        std::string status_topic;
+        std::string motion_topic;
+        std::string quality_topic;
+        std::string activity_topic;
+        std::vector<std::string> zone_names;
+        std::string snapshot_topic;
+        std::string events_topic;
+        std::unique_ptr<ActivityQueue> activity;
+        std::unique_ptr<SnapshotCache> snapshots;
+
+        // Event log, null without one. Events from log_cursor on are yet
+        // to be published; in_flight ones are published but not acknowledged.
+        struct Delivery {
+            uint64_t seq;
+            mqtt::delivery_token_ptr token;
+            Clock::time_point sent;
+        };
+        std::unique_ptr<EventLog> log;
+        uint64_t log_cursor = 1;
+        std::deque<Delivery> in_flight;
+
+        bool status_pending = false;
+        NodeEvent status;
+        Clock::time_point status_sent;
+
+        bool quality_pending = false;
+        NodeEvent quality;
+        Clock::time_point quality_sent;
+
+        bool motion_open = false;     // A start went out without its end
+        int64_t motion_started = 0;
+        uint32_t motion_zones = 0;    // Zones seen so far in the open event
+        bool end_pending = false;
+        NodeEvent end;
+        Clock::time_point end_due;
+    };
+
+    void post(NodeEvent& event);
+    void notify();
+    void send_activity();
+    void send_snapshots();
+    void publish_snapshot(const CameraState& camera, const Snapshot& snapshot, bool latest);
+    void run();
+    void absorb(const NodeEvent& event, Clock::time_point now);
+    void flush(Clock::time_point now, bool final);
+    Clock::time_point next_due(Clock::time_point now) const;
+
+    // Serialisers write into `json`, reused for every message
+    size_t status_json(const NodeEvent& event);
+    size_t motion_json(const CameraState& camera, const NodeEvent& event);
+    size_t quality_json(const NodeEvent& event);
+    void append_zones(size_t& length, const CameraState& camera, uint32_t zones);
+
+    // Sends `json`. Motion events that can't be sent are spooled.
+    bool send(const std::string& topic, size_t length);
+    void send_motion(CameraState& camera, const NodeEvent& event);
+    void send_or_spool(const std::string& topic, size_t length);
+    void spool(const std::string& topic, size_t length);
+    void replay_spool();
+
+    // Event log: publishes from the cursor, and moves the acknowledged
+    // mark past what the broker confirmed
+    void send_logged(CameraState& camera);
+    void collect_acks(CameraState& camera, Clock::time_point now);
+    void answer_query(CameraState& camera, const EventQuery& query);
+
+    mqtt::async_client& client;
+    PublisherConfig config;
+    std::vector<CameraState> cameras;
+
+    MpscRing<NodeEvent> queue;
+    std::atomic<bool> accepting;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> dropped;
+    std::atomic<int> waiters;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::thread worker;
+
+    std::vector<char> json;
+    ActivityFrame grid;           // Popped activity message
+    // Finished snapshots waiting for the publisher: heap objects, handed
+    // over under a lock (a handful per motion event)
+    std::mutex snapshot_mutex;
+    std::vector<std::pair<int, std::shared_ptr<const Snapshot>>> new_snapshots;
+    std::vector<std::pair<int, std::shared_ptr<const Snapshot>>> sending;
+    uint64_t activity_lost;
+    FILE* spool_file;
+    size_t spool_bytes;
+    uint64_t spooled;
+    uint64_t spool_lost;
+    uint64_t merged;
+    uint64_t log_lost;            // Overwritten in the log before the broker had them
+    uint64_t log_replayed;        // Sent again after a reconnect or restart
+};
+
+#endif // OPENSENTRY_EVENT_PUBLISHER_H
@@ -0,0 +1,352 @@
+//
+// Motion event clips
+//
+#include "event_recorder.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include <sys/stat.h>
+
+extern "C" {
+#include <libavutil/dict.h>
+#include <libavutil/mathematics.h>
+}
+
+using namespace std;
+
+namespace {
+// Clip ids still being referenced at once: the open clip, the one the
+// writer is finishing, and a motion_end payload in flight
+const size_t kPathSlots = 8;
+
+int frameRate(const AVCodecContext* codec) {
+    return codec->framerate.num > 0 && codec->framerate.den > 0
+               ? codec->framerate.num / codec->framerate.den : 30;
+}
+
+// Sized for the full frame rate; idle and paused modes only produce fewer
+// packets. Pre-roll plus one GOP, since the ring has to start on a keyframe.
+size_t ringCapacity(const AVCodecContext* codec, const RecorderConfig& config) {
+    if (config.dir.empty()) return 0;
+    int fps = frameRate(codec);
+    return static_cast<size_t>(ceil(config.preroll_sec * fps)) +
+           static_cast<size_t>(max(codec->gop_size, fps)) + 1;
+}
+
+// Room for a full pre-roll flush plus two seconds of writer stall
+size_t queueCapacity(const AVCodecContext* codec, const RecorderConfig& config) {
+    if (config.dir.empty()) return 0;
+    return ringCapacity(codec, config) + 2 * frameRate(codec);
+}
+}
+
+EventRecorder::EventRecorder(const AVCodecContext* codec, const string& camera,
+                             const RecorderConfig& cfg)
+    : config(cfg), camera_id(camera), codecpar(avcodec_parameters_alloc()),
+      time_base(codec->time_base), motion_clip(0), clip_counter(0),
+      paths(kPathSlots), ring_head(0), ring_count(0), recording_clip(0),
+      truncated(false), close_pending(false), closing_clip(0),
+      pending(queueCapacity(codec, cfg), DropPolicy::DropNewest),
+      returned(ringCapacity(codec, cfg) + pending.capacity() + 2), writer_running(false),
+      out(nullptr), open_clip(0), clip_start_dts(0), waiting_for_key(true), clip_failed(false) {
+    avcodec_parameters_from_context(codecpar, codec);
+    preroll_ticks = av_rescale_q(static_cast<int64_t>(config.preroll_sec * 1000000),
+                                 {1, 1000000}, time_base);
+    if (!enabled()) return;
+
+    if (mkdir(config.dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        cerr << "[Recorder] Cannot create " << config.dir << ": " << strerror(errno) << endl;
+    }
+
+    ring.resize(ringCapacity(codec, config));
+    size_t packet_count = ring.size() + pending.capacity() + 2;
+    spare.reserve(packet_count);
+    for (size_t i = 0; i < packet_count; i++) {
+        AVPacket* pkt = av_packet_alloc();
+        packet_storage.push_back(pkt);
+        spare.push_back(pkt);
+    }
+
+    writer_running = true;
+    writer = thread(&EventRecorder::writer_loop, this);
+    cout << "[Recorder] Clips to " << config.dir << " (" << config.preroll_sec << "s pre-roll, "
+         << config.postroll_sec << "s post-roll" << (config.fragmented ? ", fragmented" : "")
+         << ")" << endl;
+}
+
+EventRecorder::~EventRecorder() {
+    stop();
+    for (AVPacket* pkt : packet_storage) {
+        av_packet_free(&pkt);
+    }
+    avcodec_parameters_free(&codecpar);
+}
+
+// ============================================================================
+// Motion thread
+// ============================================================================
+int32_t EventRecorder::clip_for_frame(bool motion, chrono::steady_clock::time_point now) {
+    if (!enabled()) return 0;
+
+    if (motion) {
+        if (motion_clip == 0) {
+            motion_clip = ++clip_counter;
+
+            time_t t = time(nullptr);
+            tm local;
+            localtime_r(&t, &local);
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+
+            lock_guard<mutex> lock(path_mutex);
+            paths[motion_clip % kPathSlots] = config.dir + "/" + camera_id + "_" + stamp + ".mp4";
+        }
+        clip_until = now + chrono::microseconds(static_cast<int64_t>(config.postroll_sec * 1000000));
+    } else if (motion_clip != 0 && now >= clip_until) {
+        motion_clip = 0;
+    }
+    return motion_clip;
+}
+
+string EventRecorder::clip_path(int32_t clip) {
+    lock_guard<mutex> lock(path_mutex);
+    return paths[clip % kPathSlots];
+}
+
+// ============================================================================
+// Encode thread
+// ============================================================================
+void EventRecorder::on_packet(const AVPacket* pkt, int32_t clip) {
+    if (!enabled()) return;
+
+    if (close_pending) {
+        close_clip(closing_clip);
+    }
+
+    if (clip != recording_clip) {
+        if (recording_clip != 0) {
+            close_clip(recording_clip);
+        }
+        recording_clip = clip;
+        truncated = false;
+        if (clip != 0) {
+            // Event starts: everything in the pre-roll ring goes first
+            while (AVPacket* old = ring_pop()) {
+                send(old);
+            }
+        }
+    }
+
+    if (recording_clip != 0 && truncated) {
+        return;
+    }
+
+    AVPacket* copy = take_packet();
+    if (!copy) return;
+    if (av_packet_ref(copy, pkt) < 0) {
+        recycle(copy);
+        return;
+    }
+
+    if (recording_clip != 0) {
+        send(copy);
+    } else {
+        ring_add(copy);
+    }
+}
+
+AVPacket* EventRecorder::take_packet() {
+    AVPacket* pkt;
+    if (returned.try_pop(pkt)) return pkt;
+    if (!spare.empty()) {
+        pkt = spare.back();
+        spare.pop_back();
+        return pkt;
+    }
+    // Everything is queued for the writer or held as pre-roll; give up the
+    // oldest pre-roll rather than stall
+    pkt = ring_pop();
+    if (pkt) av_packet_unref(pkt);
+    return pkt;
+}
+
+void EventRecorder::recycle(AVPacket* pkt) {
+    av_packet_unref(pkt);
+    spare.push_back(pkt);
+}
+
+void EventRecorder::ring_add(AVPacket* pkt) {
+    if (ring_count == ring.size()) {
+        // Full: drop the oldest GOP
+        recycle(ring_pop());
+        while (ring_count > 0 && !(ring[ring_head]->flags & AV_PKT_FLAG_KEY)) {
+            recycle(ring_pop());
+        }
+    }
+
+    // A clip can only start on a keyframe, so never keep a headless GOP
+    if (ring_count == 0 && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+        recycle(pkt);
+        return;
+    }
+    ring[(ring_head + ring_count) % ring.size()] = pkt;
+    ring_count++;
+
+    // Trim whole GOPs while the next one still covers the pre-roll window
+    int64_t cutoff = pkt->dts - preroll_ticks;
+    for (;;) {
+        size_t next_key = 0;
+        for (size_t i = 1; i < ring_count; i++) {
+            if (ring[(ring_head + i) % ring.size()]->flags & AV_PKT_FLAG_KEY) {
+                next_key = i;
+                break;
+            }
+        }
+        if (next_key == 0 || ring[(ring_head + next_key) % ring.size()]->dts > cutoff) {
+            break;
+        }
+        for (size_t i = 0; i < next_key; i++) {
+            recycle(ring_pop());
+        }
+    }
+}
+
+AVPacket* EventRecorder::ring_pop() {
+    if (ring_count == 0) return nullptr;
+    AVPacket* pkt = ring[ring_head];
+    ring_head = (ring_head + 1) % ring.size();
+    ring_count--;
+    return pkt;
+}
+
+void EventRecorder::send(AVPacket* pkt) {
+    Item item;
+    item.pkt = pkt;
+    item.clip = recording_clip;
+    if (truncated || !pending.push(item, writer_running)) {
+        // Writer is behind. A gap would corrupt the H.264 stream, so the
+        // clip ends here.
+        if (!truncated) {
+            cerr << "[Recorder] Writer falling behind, clip truncated" << endl;
+            truncated = true;
+        }
+        recycle(pkt);
+    }
+}
+
+void EventRecorder::close_clip(int32_t clip) {
+    // If the queue is full this is retried with the next packet. The writer
+    // also closes a clip on its own when packets for the next one arrive.
+    Item item;
+    item.clip = clip;
+    closing_clip = clip;
+    close_pending = !pending.push(item, writer_running);
+}
+
+void EventRecorder::stop() {
+    if (!writer.joinable()) return;
+    if (recording_clip != 0) {
+        close_clip(recording_clip);
+        recording_clip = 0;
+    } else if (close_pending) {
+        close_clip(closing_clip);
+    }
+    writer_running = false;
+    writer.join();
+
+    AVPacket* pkt;
+    while ((pkt = ring_pop()) != nullptr) recycle(pkt);
+    Item item;
+    while (pending.try_pop(item)) {
+        if (item.pkt) recycle(item.pkt);
+    }
+}
+
+// ============================================================================
+// Writer thread
+// ============================================================================
+void EventRecorder::writer_loop() {
+    Item item;
+    while (pending.pop(item, writer_running, [](const Item&) {})) {
+        if (!item.pkt) {
+            if (item.clip == open_clip) close_file();
+            continue;
+        }
+
+        if (item.clip != open_clip) {
+            close_file();
+            open_clip = item.clip;
+            waiting_for_key = true;
+            clip_failed = false;
+        }
+        if (waiting_for_key && !clip_failed && (item.pkt->flags & AV_PKT_FLAG_KEY)) {
+            clip_failed = !open_file(item.clip);
+            waiting_for_key = clip_failed;
+            clip_start_dts = item.pkt->dts;
+        }
+
+        if (out && !waiting_for_key) {
+            AVPacket* pkt = item.pkt;
+            pkt->pts -= clip_start_dts;
+            pkt->dts -= clip_start_dts;
+            pkt->stream_index = 0;
+            av_packet_rescale_ts(pkt, time_base, out->streams[0]->time_base);
+            if (av_write_frame(out, pkt) < 0) {
+                cerr << "[Recorder] Write failed, closing clip" << endl;
+                close_file();
+            }
+        }
+
+        av_packet_unref(item.pkt);
+        returned.try_push(item.pkt);
+    }
+    close_file();
+}
+
+bool EventRecorder::open_file(int32_t clip) {
+    string path = clip_path(clip);
+    if (avformat_alloc_output_context2(&out, nullptr, "mp4", path.c_str()) < 0 || !out) {
+        cerr << "[Recorder] Cannot create " << path << endl;
+        out = nullptr;
+        return false;
+    }
+
+    AVStream* stream = avformat_new_stream(out, nullptr);
+    if (!stream || avcodec_parameters_copy(stream->codecpar, codecpar) < 0) {
+        avformat_free_context(out);
+        out = nullptr;
+        return false;
+    }
+    stream->time_base = time_base;
+
+    AVDictionary* opts = nullptr;
+    if (config.fragmented) {
+        av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    if (avio_open(&out->pb, path.c_str(), AVIO_FLAG_WRITE) < 0 ||
+        avformat_write_header(out, &opts) < 0) {
+        cerr << "[Recorder] Cannot open " << path << endl;
+        av_dict_free(&opts);
+        if (out->pb) avio_closep(&out->pb);
+        avformat_free_context(out);
+        out = nullptr;
+        return false;
+    }
+    av_dict_free(&opts);
+    cout << "[Recorder] Recording " << path << endl;
+    return true;
+}
+
+void EventRecorder::close_file() {
+    if (!out) return;
+    av_write_trailer(out);
+    avio_closep(&out->pb);
+    avformat_free_context(out);
+    out = nullptr;
+    cout << "[Recorder] Clip saved: " << clip_path(open_clip) << endl;
+}
@@ -0,0 +1,118 @@
+//
+// Motion event clips: a pre-roll ring of encoded packets and a background
+// muxer that writes pre-roll + event + post-roll to MP4 without re-encoding.
+//
+#ifndef OPENSENTRY_EVENT_RECORDER_H
+#define OPENSENTRY_EVENT_RECORDER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pipeline.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+struct RecorderConfig {
+    std::string dir;            // Where clips go; empty disables recording
+    double preroll_sec = 5;     // Video kept from before motion started
+    double postroll_sec = 5;    // Video kept after motion ended
+    bool fragmented = false;    // Fragmented MP4 (playable while still being written)
+};
+
+// Clip boundaries are decided on the motion thread, one frame at a time,
+// and travel down the pipeline as a clip id on each FrameSlot. The encode
+// thread feeds every packet in together with that id, and a writer thread
+// does all file I/O. Nothing on the encode path waits on the disk: if the
+// writer falls behind, the clip is cut short instead.
+class EventRecorder {
+public:
+    // `codec` must be open; its parameters and time base are copied.
+    EventRecorder(const AVCodecContext* codec, const std::string& camera_id,
+                  const RecorderConfig& config);
+    ~EventRecorder();
+
+    EventRecorder(const EventRecorder&) = delete;
+    EventRecorder& operator=(const EventRecorder&) = delete;
+
+    bool enabled() const { return !config.dir.empty(); }
+
+    // Motion thread. Returns the clip the current frame belongs to, or 0.
+    // A clip opens on motion and stays open post-roll seconds after the
+    // last motion; motion within that window extends the same clip.
+    int32_t clip_for_frame(bool motion, std::chrono::steady_clock::time_point now);
+
+    // Any thread. File the given clip is (or will be) written to.
+    std::string clip_path(int32_t clip);
+
+    // Encode thread. `pkt` is still in the codec time base; it is
+    // referenced, not copied.
+    void on_packet(const AVPacket* pkt, int32_t clip);
+
+    // Finishes the open clip and stops the writer. Called once the
+    // encode thread has exited.
+    void stop();
+
+private:
+    // A packet for the writer, or a null packet meaning "close `clip`"
+    struct Item {
+        AVPacket* pkt = nullptr;
+        int32_t clip = 0;
+    };
+
+    AVPacket* take_packet();
+    void recycle(AVPacket* pkt);
+    void ring_add(AVPacket* pkt);
+    AVPacket* ring_pop();
+    void send(AVPacket* pkt);
+    void close_clip(int32_t clip);
+    void writer_loop();
+    bool open_file(int32_t clip);
+    void close_file();
+
+    RecorderConfig config;
+    std::string camera_id;
+    AVCodecParameters* codecpar;
+    AVRational time_base;
+    int64_t preroll_ticks;
+
+    // Motion thread state
+    int32_t motion_clip;
+    int32_t clip_counter;
+    std::chrono::steady_clock::time_point clip_until;
+    std::mutex path_mutex;
+    std::vector<std::string> paths;   // Indexed by clip id, modulo size
+
+    // Encode thread state
+    std::vector<AVPacket*> ring;      // Pre-roll, circular, always starts on a keyframe
+    size_t ring_head;
+    size_t ring_count;
+    std::vector<AVPacket*> spare;     // Free packets recycled by the encode thread
+    int32_t recording_clip;
+    bool truncated;                   // Writer queue overflowed; rest of clip dropped
+    bool close_pending;               // Close item for closing_clip still to be queued
+    int32_t closing_clip;
+
+    // Encode -> writer
+    StageQueue<Item> pending;
+    SpscRing<AVPacket*> returned;     // Writer -> encode, written packets
+    std::vector<AVPacket*> packet_storage;
+
+    // Writer thread state
+    std::atomic<bool> writer_running;
+    std::thread writer;
+    AVFormatContext* out;
+    int32_t open_clip;
+    int64_t clip_start_dts;
+    bool waiting_for_key;             // Packets before the clip's first keyframe are skipped
+    bool clip_failed;                 // Couldn't open the file; skip the rest of the clip
+};
+
+#endif // OPENSENTRY_EVENT_RECORDER_H
@@ -0,0 +1,99 @@
+//
+// Frame timing
+//
+#include "frame_clock.h"
+
+#include <algorithm>
+#include <iostream>
+
+extern "C" {
+#include <libavutil/mathematics.h>
+}
+
+using namespace std;
+
+chrono::steady_clock::time_point steadyFromTimeval(int64_t sec, int64_t usec) {
+    return chrono::steady_clock::time_point(
+        chrono::duration_cast<chrono::steady_clock::duration>(chrono::seconds(sec) + chrono::microseconds(usec)));
+}
+
+namespace {
+
+const AVRational kMicros = {1, 1000000};
+
+int64_t micros(chrono::steady_clock::duration d) {
+    return chrono::duration_cast<chrono::microseconds>(d).count();
+}
+
+}  // namespace
+
+const AVRational StreamClock::kTimeBase = {1, 90000};
+
+StreamClock::StreamClock(int fps)
+    : started(false), frame_ticks(kTimeBase.den / max(fps, 1)), last_pts(-1),
+      base_latency_us(0), latency_us(0), skew_ticks(0), warned(false) {}
+
+int64_t StreamClock::pts(chrono::steady_clock::time_point captured,
+                         chrono::steady_clock::time_point arrived) {
+    int64_t latency = micros(arrived - captured);
+    if (latency < -1000 || latency > 1000000) {
+        // Not on the monotonic clock, or stale; the arrival time is the
+        // best we have
+        if (!warned) {
+            cerr << "[Clock] Capture timestamps are " << latency / 1000
+                 << " ms off the system clock; using arrival times" << endl;
+            warned = true;
+        }
+        captured = arrived - chrono::microseconds(static_cast<int64_t>(latency_us));
+        latency = static_cast<int64_t>(latency_us);
+    }
+
+    if (!started) {
+        started = true;
+        origin = captured;
+        base_latency_us = latency_us = static_cast<double>(latency);
+    } else {
+        // Slow average, so scheduling jitter doesn't move PTS; only a
+        // steady trend between the two clocks does
+        latency_us += (latency - latency_us) / 128;
+        int64_t target = av_rescale_q(static_cast<int64_t>(latency_us - base_latency_us), kMicros, kTimeBase);
+        int64_t step = max<int64_t>(frame_ticks / 100, 1);
+        skew_ticks += min(max(target - skew_ticks, -step), step);
+    }
+    return to_pts(captured);
+}
+
+int64_t StreamClock::pts_now(chrono::steady_clock::time_point now) {
+    if (!started) {
+        return pts(now, now);
+    }
+    return to_pts(now - chrono::microseconds(static_cast<int64_t>(latency_us)));
+}
+
+int64_t StreamClock::to_pts(chrono::steady_clock::time_point captured) {
+    int64_t p = av_rescale_q(micros(captured - origin), kMicros, kTimeBase) + skew_ticks;
+    p = max(p, last_pts + 1);
+    last_pts = p;
+    return p;
+}
+
+FrameRateLimiter::FrameRateLimiter(int fps)
+    : interval(fps > 0 ? 1000000 / fps : 0), started(false) {}
+
+bool FrameRateLimiter::accept(chrono::steady_clock::time_point captured) {
+    if (interval.count() == 0) return true;
+    if (!started) {
+        started = true;
+        next_due = captured + interval;
+        return true;
+    }
+    if (captured < next_due - interval / 4) {
+        return false;
+    }
+    next_due += interval;
+    if (next_due <= captured) {
+        // Input paused or slower than the limit: restart from this frame
+        next_due = captured + interval;
+    }
+    return true;
+}
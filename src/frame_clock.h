@@ -0,0 +1,74 @@
+//
+// Frame timing: stream PTS from capture timestamps, and the configured
+// frame-rate limit applied at capture.
+//
+#ifndef OPENSENTRY_FRAME_CLOCK_H
+#define OPENSENTRY_FRAME_CLOCK_H
+
+#include <chrono>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/rational.h>
+}
+
+// Capture timestamps are steady_clock time points. libstdc++'s steady_clock
+// is CLOCK_MONOTONIC, the clock V4L2 drivers stamp buffers with, so driver
+// timestamps convert without an offset.
+std::chrono::steady_clock::time_point steadyFromTimeval(int64_t sec, int64_t usec);
+
+// Maps capture times to PTS in the stream time base (1/90000, as RTP uses).
+// Frames keep the spacing the camera actually delivered them at, whatever
+// the nominal frame rate. The capture-to-now latency is tracked as well:
+// if it drifts (a camera clock running fast or slow against the system
+// clock) PTS are slewed by at most 1% to follow the system clock, and
+// timestamps that can't be right (in the future, or over a second old) are
+// replaced by the arrival time.
+class StreamClock {
+public:
+    static const AVRational kTimeBase;
+
+    explicit StreamClock(int fps);
+
+    // PTS for a frame stamped `captured` by its source and read by the
+    // capture stage at `arrived`. Strictly increasing across calls.
+    int64_t pts(std::chrono::steady_clock::time_point captured,
+                std::chrono::steady_clock::time_point arrived);
+
+    // PTS for a frame with no capture time of its own (the frozen frame
+    // re-sent while paused), placed as if it had just been captured
+    int64_t pts_now(std::chrono::steady_clock::time_point now);
+
+    // Current clock correction in microseconds, for diagnostics
+    int64_t skew_us() const { return skew_ticks * 100 / 9; }
+
+private:
+    int64_t to_pts(std::chrono::steady_clock::time_point captured);
+
+    bool started;
+    std::chrono::steady_clock::time_point origin;
+    int64_t frame_ticks;        // Nominal frame interval
+    int64_t last_pts;
+    double base_latency_us;     // Latency when the clock started
+    double latency_us;          // Smoothed latency since
+    int64_t skew_ticks;         // Correction applied on top of capture time
+    bool warned;
+};
+
+// Drops frames arriving faster than `fps`, deciding on capture timestamps
+// only, so the same input always keeps the same frames. Cameras that
+// ignore the requested rate (or a 60 fps file) come out at the configured
+// one; jitter of up to a quarter interval never costs a frame.
+class FrameRateLimiter {
+public:
+    explicit FrameRateLimiter(int fps);  // 0 = no limit
+
+    bool accept(std::chrono::steady_clock::time_point captured);
+
+private:
+    std::chrono::microseconds interval;
+    std::chrono::steady_clock::time_point next_due;
+    bool started;
+};
+
+#endif // OPENSENTRY_FRAME_CLOCK_H
@@ -0,0 +1,356 @@
+//
+// Frame sources
+//
+#include "frame_source.h"
+
+#include <opencv2/videoio.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "v4l2_capture.h"
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+using namespace std;
+
+void FrameSource::set_pacing(int fps, bool unthrottled) {
+    interval = fps > 0 ? chrono::microseconds(1000000 / fps) : chrono::microseconds(0);
+    throttle = !unthrottled;
+    next_frame = chrono::steady_clock::now();
+}
+
+void FrameSource::pace() {
+    if (interval.count() == 0) return;
+    if (!throttle) {
+        due = next_frame;
+        next_frame += interval;
+        return;
+    }
+    auto now = chrono::steady_clock::now();
+    if (next_frame > now) {
+        this_thread::sleep_until(next_frame);
+        due = next_frame;
+        next_frame += interval;
+    } else {
+        // Fell behind (or first frame): restart the clock instead of bursting
+        due = now;
+        next_frame = now + interval;
+    }
+}
+
+void FrameSource::stamp(FrameSlot* slot) const {
+    auto now = chrono::steady_clock::now();
+    if (interval.count() == 0) {
+        slot->captured = slot->arrived = now;
+        return;
+    }
+    slot->captured = due;
+    slot->arrived = throttle ? now : due;
+}
+
+namespace {
+
+// ============================================================================
+// Native V4L2 camera
+// ============================================================================
+class V4L2Source : public FrameSource {
+public:
+    explicit V4L2Source(unique_ptr<V4L2Capture> capture) : cam(move(capture)) {}
+    int read(FrameSlot* slot, bool /*decode*/) override {
+        // A dropped frame still has to be dequeued; releasing the slot
+        // hands the buffer straight back to the driver
+        int r = cam->format() == V4L2Capture::Format::MJPEG
+            ? cam->read_jpeg(&slot->jpeg, slot->jpeg_size, 200, slot->captured)
+            : cam->read(slot->yuv, 200, slot->captured);
+        slot->arrived = chrono::steady_clock::now();
+        return r;
+    }
+
+    int width() const override { return cam->width(); }
+    int height() const override { return cam->height(); }
+    AVPixelFormat pixel_format() const override { return cam->output_format(); }
+    SlotStorage slot_storage() const override {
+        if (cam->format() == V4L2Capture::Format::MJPEG) return SlotStorage::Jpeg;
+        return cam->zero_copy() ? SlotStorage::DriverBuffer : SlotStorage::YuvOwned;
+    }
+    string description() const override { return "V4L2 " + string(cam->format_name()); }
+    void stop() override { cam->stop(); }
+
+private:
+    unique_ptr<V4L2Capture> cam;
+};
+
+// ============================================================================
+// OpenCV: cameras without a usable YUV format, and video files
+// ============================================================================
+class OpenCVSource : public FrameSource {
+public:
+    OpenCVSource() : w(0), h(0), sws(nullptr), converted(0) {}
+
+    bool open_device(int index) {
+        label = "OpenCV";
+        return cap.open(index) && init();
+    }
+
+    bool open_file(const string& path, bool replay) {
+        label = "file " + path;
+        if (!cap.open(path) || !init()) return false;
+        // Files would otherwise be read as fast as they decode
+        set_pacing(static_cast<int>(cap.get(cv::CAP_PROP_FPS) + 0.5), replay);
+        return true;
+    }
+
+    ~OpenCVSource() override {
+        sws_freeContext(sws);
+        cap.release();
+    }
+
+    int read(FrameSlot* slot, bool decode) override {
+        pace();
+        // grab() without retrieve() skips the decode for dropped frames
+        if (!cap.grab()) return -1;
+        stamp(slot);
+        if (!decode) return 1;
+        if (!cap.retrieve(slot->bgr) || slot->bgr.empty()) return -1;
+        const int stride[] = {static_cast<int>(slot->bgr.step[0])};
+        auto start = chrono::steady_clock::now();
+        sws_scale(sws, &slot->bgr.data, stride, 0, h, slot->yuv->data, slot->yuv->linesize);
+        converted = chrono::steady_clock::now() - start;
+        return 1;
+    }
+
+    int width() const override { return w; }
+    int height() const override { return h; }
+    SlotStorage slot_storage() const override { return SlotStorage::Bgr; }
+    string description() const override { return label; }
+    chrono::steady_clock::duration convert_time() const override { return converted; }
+
+private:
+    bool init() {
+        w = static_cast<int>(cap.get(cv::CAP_PROP_FRAME_WIDTH));
+        h = static_cast<int>(cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+        // Convert to the encoder's YUV420P right away so motion and encode
+        // share one Y plane
+        sws = sws_getContext(w, h, AV_PIX_FMT_BGR24, w, h, AV_PIX_FMT_YUV420P,
+                             SWS_BILINEAR, nullptr, nullptr, nullptr);
+        return w > 0 && h > 0 && sws;
+    }
+
+    cv::VideoCapture cap;
+    string label;
+    int w;
+    int h;
+    SwsContext* sws;
+    chrono::steady_clock::duration converted;
+};
+
+// ============================================================================
+// Raw YUV420P frames on stdin, e.g. from ffmpeg -f rawvideo -pix_fmt yuv420p -
+// ============================================================================
+class PipeSource : public FrameSource {
+public:
+    PipeSource(int width, int height) : w(width), h(height) {}
+
+    int read(FrameSlot* slot, bool /*decode*/) override {
+        pollfd pfd;
+        pfd.fd = STDIN_FILENO;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int r = poll(&pfd, 1, 200);
+        if (r == 0 || (r < 0 && errno == EINTR)) return 0;
+        if (r < 0) return -1;
+
+        // Once a frame has started arriving, read all of it
+        AVFrame* f = slot->yuv;
+        for (int plane = 0; plane < 3; plane++) {
+            int pw = plane ? w / 2 : w;
+            int ph = plane ? h / 2 : h;
+            for (int y = 0; y < ph; y++) {
+                if (!read_fully(f->data[plane] + static_cast<size_t>(y) * f->linesize[plane], pw)) {
+                    return -1;
+                }
+            }
+        }
+        stamp(slot);
+        return 1;
+    }
+
+    int width() const override { return w; }
+    int height() const override { return h; }
+    string description() const override {
+        return "YUV420P pipe " + to_string(w) + "x" + to_string(h);
+    }
+
+private:
+    static bool read_fully(uint8_t* dst, size_t n) {
+        while (n > 0) {
+            ssize_t got = ::read(STDIN_FILENO, dst, n);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return false;  // EOF or error
+            dst += got;
+            n -= static_cast<size_t>(got);
+        }
+        return true;
+    }
+
+    int w;
+    int h;
+};
+
+// ============================================================================
+// Synthetic scene: a fixed gradient with scripted rectangles moving over it.
+// Deterministic, so a run can be repeated frame for frame.
+// ============================================================================
+struct SceneObject {
+    int x, y, w, h;      // Position at frame 0
+    int vx, vy;          // Pixels per frame; bounces off the edges
+    int64_t first = 0;   // Visible from this frame...
+    int64_t last = -1;   // ...to this one (-1 = forever)
+};
+
+class SyntheticSource : public FrameSource {
+public:
+    SyntheticSource(const SourceConfig& config, const vector<SceneObject>& objects)
+        : w(config.width & ~1), h(config.height & ~1), limit(config.frame_limit),
+          frame_index(0), objects(objects), background(static_cast<size_t>(w) * h) {
+        set_pacing(config.fps, config.replay);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                background[static_cast<size_t>(y) * w + x] =
+                    static_cast<uint8_t>(40 + (x * 80) / w + (y * 40) / h);
+            }
+        }
+    }
+
+    int read(FrameSlot* slot, bool decode) override {
+        if (limit > 0 && frame_index >= limit) return -1;
+        pace();
+        stamp(slot);
+        int64_t n = frame_index++;
+        if (!decode) return 1;
+
+        AVFrame* f = slot->yuv;
+        for (int y = 0; y < h; y++) {
+            memcpy(f->data[0] + static_cast<size_t>(y) * f->linesize[0],
+                   background.data() + static_cast<size_t>(y) * w, w);
+        }
+        for (int plane = 1; plane < 3; plane++) {
+            for (int y = 0; y < h / 2; y++) {
+                memset(f->data[plane] + static_cast<size_t>(y) * f->linesize[plane], 128, w / 2);
+            }
+        }
+
+        for (const SceneObject& o : objects) {
+            if (n < o.first || (o.last >= 0 && n > o.last)) continue;
+            int64_t t = n - o.first;
+            int x = bounce(o.x + o.vx * t, w - o.w);
+            int y = bounce(o.y + o.vy * t, h - o.h);
+            for (int row = max(0, y); row < min(h, y + o.h); row++) {
+                uint8_t* p = f->data[0] + static_cast<size_t>(row) * f->linesize[0];
+                int x0 = max(0, x);
+                int x1 = min(w, x + o.w);
+                if (x1 > x0) memset(p + x0, 220, x1 - x0);
+            }
+        }
+        return 1;
+    }
+
+    int width() const override { return w; }
+    int height() const override { return h; }
+    string description() const override {
+        return "synthetic " + to_string(w) + "x" + to_string(h) + ", " +
+               to_string(objects.size()) + " objects";
+    }
+
+private:
+    // Position on a path that reflects between 0 and `span`
+    static int bounce(int64_t pos, int span) {
+        if (span <= 0) return 0;
+        int64_t period = 2 * static_cast<int64_t>(span);
+        int64_t p = ((pos % period) + period) % period;
+        return static_cast<int>(p <= span ? p : period - p);
+    }
+
+    int w;
+    int h;
+    int64_t limit;
+    int64_t frame_index;
+    vector<SceneObject> objects;
+    vector<uint8_t> background;
+};
+
+vector<SceneObject> parseObjects(const string& spec) {
+    vector<SceneObject> objects;
+    stringstream entries(spec);
+    string entry;
+    while (getline(entries, entry, ';')) {
+        if (entry.empty()) continue;
+        SceneObject o;
+        long long first = 0;
+        long long last = -1;
+        int fields = sscanf(entry.c_str(), "%d,%d,%d,%d,%d,%d,%lld,%lld",
+                            &o.x, &o.y, &o.w, &o.h, &o.vx, &o.vy, &first, &last);
+        if (fields < 6 || o.w <= 0 || o.h <= 0) {
+            cerr << "[Source] Ignoring malformed object '" << entry
+                 << "' (expected x,y,w,h,vx,vy[,first,last])" << endl;
+            continue;
+        }
+        o.first = first;
+        o.last = last;
+        objects.push_back(o);
+    }
+    return objects;
+}
+
+} // namespace
+
+unique_ptr<FrameSource> openFrameSource(const SourceConfig& config) {
+    if (config.kind == "synthetic") {
+        return unique_ptr<FrameSource>(new SyntheticSource(config, parseObjects(config.objects)));
+    }
+
+    if (config.kind == "pipe") {
+        if (config.width <= 0 || config.height <= 0 || (config.width & 1) || (config.height & 1)) {
+            cerr << "[Source] Pipe input needs an even SOURCE_SIZE" << endl;
+            return nullptr;
+        }
+        return unique_ptr<FrameSource>(new PipeSource(config.width, config.height));
+    }
+
+    if (config.kind == "file") {
+        unique_ptr<OpenCVSource> file(new OpenCVSource());
+        if (!file->open_file(config.path, config.replay)) {
+            cerr << "[Source] Cannot open video file " << config.path << endl;
+            return nullptr;
+        }
+        return file;
+    }
+
+    // Camera: prefer native V4L2 YUV capture so frames reach the encoder
+    // without a YUV->BGR->YUV round trip; fall back to OpenCV for anything else.
+    // "mjpeg" asks for the camera's MJPEG stream, decoded only where needed.
+    string device = "/dev/video" + to_string(config.device_index);
+    if (config.capture_backend != "opencv") {
+        bool mjpeg = config.capture_backend == "mjpeg";
+        unique_ptr<V4L2Capture> v4l2(new V4L2Capture(device));
+        if (v4l2->open(config.fps, config.v4l2_buffers, mjpeg) && v4l2->start()) {
+            return unique_ptr<FrameSource>(new V4L2Source(move(v4l2)));
+        }
+        cout << "[Camera] V4L2 " << (mjpeg ? "MJPEG" : "YUV") << " capture unavailable, using OpenCV" << endl;
+    }
+    unique_ptr<OpenCVSource> camera(new OpenCVSource());
+    if (!camera->open_device(config.device_index)) {
+        return nullptr;
+    }
+    return camera;
+}
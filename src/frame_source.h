@@ -0,0 +1,79 @@
+//
+// Frame sources: where the capture stage gets its frames. A camera (native
+// V4L2 or OpenCV), a video file, raw YUV420P on stdin, or a synthetic scene,
+// so the pipeline can be reproduced and profiled without hardware.
+//
+#ifndef OPENSENTRY_FRAME_SOURCE_H
+#define OPENSENTRY_FRAME_SOURCE_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+struct SourceConfig {
+    std::string kind = "camera";      // camera, file, pipe or synthetic
+    int device_index = 0;             // camera: /dev/videoN
+    std::string capture_backend = "auto";  // camera: auto (V4L2 first), mjpeg or opencv
+    unsigned v4l2_buffers = 4;        // camera: driver buffers to map
+    std::string path;                 // file: video to read
+    int width = 1280;                 // pipe, synthetic: frame size
+    int height = 720;
+    int fps = 30;                     // Capture rate, and pacing for file/synthetic
+    int64_t frame_limit = 0;          // synthetic: stop after this many frames (0 = never)
+    bool replay = false;              // Run file/synthetic input unthrottled
+    std::string objects;              // synthetic: "x,y,w,h,vx,vy[,first,last];..."
+};
+
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    // Fills `slot` with the next frame and its timestamps. With `decode`
+    // false the source only advances past the frame (the capture stage is
+    // dropping it).
+    // Returns 1 on a frame, 0 on timeout (call again), -1 at end of input
+    // or on error.
+    virtual int read(FrameSlot* slot, bool decode) = 0;
+
+    virtual int width() const = 0;
+    virtual int height() const = 0;
+    virtual AVPixelFormat pixel_format() const { return AV_PIX_FMT_YUV420P; }
+    virtual SlotStorage slot_storage() const { return SlotStorage::YuvOwned; }
+    virtual std::string description() const = 0;
+    virtual void stop() {}
+
+    // Time the last read() spent converting the frame to YUV, for sources
+    // that convert (zero otherwise)
+    virtual std::chrono::steady_clock::duration convert_time() const {
+        return std::chrono::steady_clock::duration::zero();
+    }
+
+protected:
+    // Holds file and synthetic input to `fps` unless replaying
+    void pace();
+    void set_pacing(int fps, bool unthrottled);
+
+    // Timestamps a frame just read: with pacing, the time pace() scheduled
+    // it for (when replaying also its arrival, so a replay keeps the
+    // recorded timing however fast it runs); otherwise now.
+    void stamp(FrameSlot* slot) const;
+
+private:
+    std::chrono::microseconds interval{0};
+    bool throttle = true;
+    std::chrono::steady_clock::time_point next_frame;
+    std::chrono::steady_clock::time_point due;
+};
+
+// Opens the configured source; prints why and returns null on failure.
+std::unique_ptr<FrameSource> openFrameSource(const SourceConfig& config);
+
+#endif // OPENSENTRY_FRAME_SOURCE_H
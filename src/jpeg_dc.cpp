@@ -0,0 +1,422 @@
+//
+// MJPEG DC extraction and prefilter
+//
+#include "jpeg_dc.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+// ITU T.81 Annex K.3 tables; UVC cameras send every frame without a DHT
+// segment and expect the decoder to use these
+const uint8_t kDcLumaCounts[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+const uint8_t kDcChromaCounts[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+const uint8_t kDcSymbols[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+const uint8_t kAcLumaCounts[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+const uint8_t kAcLumaSymbols[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+
+const uint8_t kAcChromaCounts[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+const uint8_t kAcChromaSymbols[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+
+int read16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+int ceilDiv(int a, int b) {
+    return (a + b - 1) / b;
+}
+
+} // namespace
+
+JpegDcReader::JpegDcReader()
+    : component_count(0), width(0), height(0), restart_interval(0) {
+    build(default_tables[0], kDcLumaCounts, kDcSymbols);
+    build(default_tables[1], kDcChromaCounts, kDcSymbols);
+    build(default_tables[2], kAcLumaCounts, kAcLumaSymbols);
+    build(default_tables[3], kAcChromaCounts, kAcChromaSymbols);
+}
+
+bool JpegDcReader::build(HuffmanTable& table, const uint8_t* counts, const uint8_t* symbols) {
+    table.defined = false;
+    memset(table.fast, 0, sizeof(table.fast));
+    memset(table.skip, 0, sizeof(table.skip));
+
+    // Canonical codes: each length continues from the last code of the
+    // previous length, shifted left one bit
+    int code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        int n = counts[len - 1];
+        if (k + n > 256) return false;
+        // Overfull: more codes than this length has room for. Checked before
+        // filling so a hostile table can't write past the lookup arrays.
+        if (code + n > (1 << len)) return false;
+        table.val_offset[len] = k - code;
+        for (int i = 0; i < n; i++, k++, code++) {
+            table.symbols[k] = symbols[k];
+            if (len <= HuffmanTable::kFastBits) {
+                int shift = HuffmanTable::kFastBits - len;
+                int size = symbols[k] & 15;
+                int covered = size ? (symbols[k] >> 4) + 1 : (symbols[k] == 0xF0 ? 16 : 0);
+                uint16_t entry = static_cast<uint16_t>((len << 8) | symbols[k]);
+                uint16_t skip = static_cast<uint16_t>(((len + size) << 8) | covered);
+                for (int fill = 0; fill < (1 << shift); fill++) {
+                    table.fast[(code << shift) | fill] = entry;
+                    table.skip[(code << shift) | fill] = skip;
+                }
+            }
+        }
+        table.max_code[len] = n ? code - 1 : -1;
+        code <<= 1;
+    }
+    table.max_code[17] = -1;
+    table.defined = true;
+    return true;
+}
+
+void JpegDcReader::fill(Bits& bits) {
+    while (bits.count <= 56) {
+        uint32_t byte = 0;
+        if (!bits.at_marker && bits.p < bits.end) {
+            byte = *bits.p;
+            if (byte == 0xFF) {
+                uint8_t next = bits.p + 1 < bits.end ? bits.p[1] : 0xD9;
+                if (next == 0x00) {
+                    bits.p += 2;  // Stuffed data byte
+                } else {
+                    bits.at_marker = true;
+                    byte = 0;
+                }
+            } else {
+                bits.p++;
+            }
+        }
+        bits.buffer |= static_cast<uint64_t>(byte) << (56 - bits.count);
+        bits.count += 8;
+    }
+}
+
+int JpegDcReader::decode(Bits& bits, const HuffmanTable& table) {
+    if (bits.count < 32) fill(bits);
+    uint16_t entry = table.fast[bits.buffer >> (64 - HuffmanTable::kFastBits)];
+    if (entry) {
+        int len = entry >> 8;
+        bits.buffer <<= len;
+        bits.count -= len;
+        return entry & 0xFF;
+    }
+    for (int len = HuffmanTable::kFastBits + 1; len <= 16; len++) {
+        int32_t code = static_cast<int32_t>(bits.buffer >> (64 - len));
+        if (code <= table.max_code[len]) {
+            bits.buffer <<= len;
+            bits.count -= len;
+            return table.symbols[code + table.val_offset[len]];
+        }
+    }
+    return -1;
+}
+
+int JpegDcReader::receive(Bits& bits, int size) {
+    if (size == 0) return 0;
+    int value = static_cast<int>(bits.buffer >> (64 - size));
+    bits.buffer <<= size;
+    bits.count -= size;
+    // Values below half the range are negative
+    if (value < (1 << (size - 1))) value -= (1 << size) - 1;
+    return value;
+}
+
+bool JpegDcReader::restart(Bits& bits) {
+    // Whatever is left in the buffer is padding up to the marker
+    bits.buffer = 0;
+    bits.count = 0;
+    while (bits.p + 1 < bits.end &&
+           !(bits.p[0] == 0xFF && bits.p[1] >= 0xD0 && bits.p[1] <= 0xD7)) {
+        bits.p++;
+    }
+    if (bits.p + 1 >= bits.end) return false;
+    bits.p += 2;
+    bits.at_marker = false;
+    return true;
+}
+
+bool JpegDcReader::read(const uint8_t* data, size_t size, Mat& dc) {
+    for (int i = 0; i < 4; i++) {
+        dc_tables[i].defined = false;
+        ac_tables[i].defined = false;
+        dc_quant[i] = 0;
+    }
+    component_count = 0;
+    width = height = 0;
+    restart_interval = 0;
+
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+    const uint8_t* end = data + size;
+    const uint8_t* p = data + 2;
+
+    while (p + 4 <= end) {
+        if (*p != 0xFF) return false;
+        while (p < end && *p == 0xFF) p++;  // Fill bytes
+        if (p + 3 > end) return false;
+        uint8_t marker = *p++;
+        size_t length = static_cast<size_t>(read16(p));
+        if (length < 2 || length > static_cast<size_t>(end - p)) return false;
+        const uint8_t* segment = p + 2;
+        size_t segment_length = length - 2;
+
+        switch (marker) {
+            case 0xC0:  // Baseline
+            case 0xC1:  // Extended sequential, Huffman
+                if (!parse_sof(segment, segment_length)) return false;
+                break;
+            case 0xC4:
+                if (!parse_dht(segment, segment_length)) return false;
+                break;
+            case 0xDB:
+                if (!parse_dqt(segment, segment_length)) return false;
+                break;
+            case 0xDD:
+                restart_interval = segment_length >= 2 ? read16(segment) : 0;
+                break;
+            case 0xDA:
+                return decode_scan(segment, segment_length, end, dc);
+            case 0xD9:  // EOI before any scan
+                return false;
+            default:
+                // Progressive, lossless and arithmetic frames need a real decoder
+                if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC8 && marker != 0xCC) return false;
+                break;  // APPn, COM, DAC and friends
+        }
+        p += length;
+    }
+    return false;
+}
+
+bool JpegDcReader::parse_sof(const uint8_t* p, size_t length) {
+    if (length < 6 || p[0] != 8) return false;
+    height = read16(p + 1);
+    width = read16(p + 3);
+    component_count = p[5];
+    // A zero height comes later in a DNL marker, which cameras don't use
+    if (width == 0 || height == 0 || component_count < 1 || component_count > 4 ||
+        length < 6 + 3 * static_cast<size_t>(component_count)) {
+        return false;
+    }
+    for (int i = 0; i < component_count; i++) {
+        const uint8_t* c = p + 6 + 3 * i;
+        Component& comp = components[i];
+        comp.id = c[0];
+        comp.h = c[1] >> 4;
+        comp.v = c[1] & 15;
+        comp.quant = c[2] & 3;
+        if (comp.h < 1 || comp.h > 4 || comp.v < 1 || comp.v > 4) return false;
+    }
+    return true;
+}
+
+bool JpegDcReader::parse_dht(const uint8_t* p, size_t length) {
+    while (length >= 17) {
+        int table_class = p[0] >> 4;
+        int id = p[0] & 3;
+        size_t total = 0;
+        for (int i = 1; i <= 16; i++) total += p[i];
+        if (table_class > 1 || total > 256 || 17 + total > length) return false;
+        HuffmanTable& table = table_class == 0 ? dc_tables[id] : ac_tables[id];
+        if (!build(table, p + 1, p + 17)) return false;
+        p += 17 + total;
+        length -= 17 + total;
+    }
+    return length == 0;
+}
+
+bool JpegDcReader::parse_dqt(const uint8_t* p, size_t length) {
+    while (length > 0) {
+        int precision = p[0] >> 4;
+        int id = p[0] & 3;
+        size_t entry = 1 + 64 * (precision ? 2 : 1);
+        if (precision > 1 || entry > length) return false;
+        // Only the DC step matters here; it comes first in zigzag order
+        dc_quant[id] = static_cast<uint16_t>(precision ? read16(p + 1) : p[1]);
+        p += entry;
+        length -= entry;
+    }
+    return true;
+}
+
+bool JpegDcReader::decode_scan(const uint8_t* p, size_t length, const uint8_t* data_end, Mat& dc) {
+    if (component_count == 0 || length < 1) return false;
+    int scan_count = p[0];
+    if (scan_count < 1 || scan_count > component_count || length < 4 + 2 * static_cast<size_t>(scan_count)) {
+        return false;
+    }
+
+    // Scan components in coding order, with their tables
+    Component* scan[4];
+    const HuffmanTable* dc_table[4];
+    const HuffmanTable* ac_table[4];
+    bool has_luma = false;
+    for (int i = 0; i < scan_count; i++) {
+        int id = p[1 + 2 * i];
+        int td = p[2 + 2 * i] >> 4;
+        int ta = p[2 + 2 * i] & 15;
+        scan[i] = nullptr;
+        for (int c = 0; c < component_count; c++) {
+            if (components[c].id == id) scan[i] = &components[c];
+        }
+        if (!scan[i] || td > 3 || ta > 3) return false;
+        dc_table[i] = dc_tables[td].defined ? &dc_tables[td] : &default_tables[td == 0 ? 0 : 1];
+        ac_table[i] = ac_tables[ta].defined ? &ac_tables[ta] : &default_tables[ta == 0 ? 2 : 3];
+        scan[i]->predictor = 0;
+        if (scan[i] == &components[0]) has_luma = true;
+    }
+    const uint8_t* tail = p + 1 + 2 * scan_count;
+    // Baseline: one pass over all 64 coefficients, no successive approximation
+    if (tail[0] != 0 || tail[1] != 63 || tail[2] != 0) return false;
+    // A camera puts luma in the first (usually only) scan
+    if (!has_luma) return false;
+
+    const Component& luma = components[0];
+    int quant = dc_quant[luma.quant];
+    if (quant == 0) return false;
+
+    int h_max = 1, v_max = 1;
+    for (int c = 0; c < component_count; c++) {
+        h_max = max(h_max, components[c].h);
+        v_max = max(v_max, components[c].v);
+    }
+    int cols = ceilDiv(ceilDiv(width * luma.h, h_max), 8);
+    int rows = ceilDiv(ceilDiv(height * luma.v, v_max), 8);
+    dc.create(rows, cols, CV_8UC1);
+
+    // Interleaved scans code MCUs of h x v blocks per component; a single
+    // component scan codes its blocks one at a time in raster order
+    int mcu_cols, mcu_rows;
+    if (scan_count > 1) {
+        mcu_cols = ceilDiv(width, 8 * h_max);
+        mcu_rows = ceilDiv(height, 8 * v_max);
+    } else {
+        mcu_cols = cols;
+        mcu_rows = rows;
+    }
+
+    Bits bits;
+    bits.p = p + length;
+    bits.end = data_end;
+    bits.buffer = 0;
+    bits.count = 0;
+    bits.at_marker = false;
+
+    int mcu = 0;
+    for (int my = 0; my < mcu_rows; my++) {
+        for (int mx = 0; mx < mcu_cols; mx++, mcu++) {
+            if (restart_interval && mcu > 0 && mcu % restart_interval == 0) {
+                if (!restart(bits)) return false;
+                for (int i = 0; i < scan_count; i++) scan[i]->predictor = 0;
+            }
+            for (int i = 0; i < scan_count; i++) {
+                Component& comp = *scan[i];
+                int bh = scan_count > 1 ? comp.h : 1;
+                int bv = scan_count > 1 ? comp.v : 1;
+                for (int by = 0; by < bv; by++) {
+                    for (int bx = 0; bx < bh; bx++) {
+                        int s = decode(bits, *dc_table[i]);
+                        if (s < 0 || s > 11) return false;
+                        comp.predictor += receive(bits, s);
+
+                        // AC terms are only decoded far enough to skip them;
+                        // short codes skip code and value bits in one go
+                        const HuffmanTable& ac = *ac_table[i];
+                        for (int k = 1; k < 64;) {
+                            if (bits.count < 32) fill(bits);
+                            uint16_t skip = ac.skip[bits.buffer >> (64 - HuffmanTable::kFastBits)];
+                            if (skip) {
+                                bits.buffer <<= skip >> 8;
+                                bits.count -= skip >> 8;
+                                if ((skip & 0xFF) == 0) break;  // End of block
+                                k += skip & 0xFF;
+                                continue;
+                            }
+                            int rs = decode(bits, ac);
+                            if (rs < 0) return false;
+                            int size = rs & 15;
+                            if (size) {
+                                k += (rs >> 4) + 1;
+                                bits.buffer <<= size;
+                                bits.count -= size;
+                            } else if (rs == 0xF0) {
+                                k += 16;
+                            } else {
+                                break;  // End of block
+                            }
+                        }
+
+                        if (&comp != &luma) continue;
+                        int y = my * bv + by;
+                        int x = mx * bh + bx;
+                        if (y < rows && x < cols) {
+                            // DC is 8x the block mean, level-shifted by 128
+                            int mean = 128 + ((comp.predictor * quant + 4) >> 3);
+                            dc.at<uchar>(y, x) = static_cast<uchar>(min(255, max(0, mean)));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+DcPrefilter::DcPrefilter(int threshold, int min_blocks)
+    : threshold(max(1, threshold)), min_blocks(max(1, min_blocks)), last_changed(0) {}
+
+bool DcPrefilter::changed(const Mat& dc) {
+    if (reference.size() != dc.size()) {
+        dc.convertTo(reference, CV_16U, 16);
+        last_changed = static_cast<int>(dc.total());
+        return true;
+    }
+
+    int count = 0;
+    int limit = threshold * 16;
+    for (int y = 0; y < dc.rows; y++) {
+        const uchar* cur = dc.ptr<uchar>(y);
+        ushort* ref = reference.ptr<ushort>(y);
+        for (int x = 0; x < dc.cols; x++) {
+            int diff = cur[x] * 16 - ref[x];
+            if (abs(diff) > limit) count++;
+            // The reference drifts 1/8 of the way each frame, so lighting
+            // changes fade out but anything moving keeps standing out
+            ref[x] = static_cast<ushort>(ref[x] + diff / 8);
+        }
+    }
+    last_changed = count;
+    return count >= min_blocks;
+}
@@ -0,0 +1,104 @@
+//
+// Compressed-domain look at MJPEG frames: entropy-decodes a baseline JPEG
+// far enough to get each 8x8 luma block's DC coefficient (its mean), with
+// no dequantisation of AC terms and no IDCT. The result is a 1/8-scale
+// luma image that is enough to tell whether anything changed, so a camera
+// streaming MJPEG only pays for a full decode when it matters.
+//
+#ifndef OPENSENTRY_JPEG_DC_H
+#define OPENSENTRY_JPEG_DC_H
+
+#include <opencv2/core.hpp>
+#include <cstddef>
+#include <cstdint>
+
+class JpegDcReader {
+public:
+    JpegDcReader();
+
+    // Reads the DC image of `size` bytes of JPEG into `dc` (CV_8UC1, one
+    // pixel per luma block, reallocated only when the frame size changes).
+    // Handles baseline Huffman JPEG with any sampling factors, restart
+    // markers, and the default tables UVC cameras leave out. Returns false
+    // for anything else (progressive, arithmetic, corrupt data).
+    bool read(const uint8_t* data, size_t size, cv::Mat& dc);
+
+private:
+    struct HuffmanTable {
+        static const int kFastBits = 10;
+        uint16_t fast[1 << kFastBits];  // (length << 8) | symbol, 0 = longer code
+        // AC use: (code + coefficient bits) << 8 | coefficients covered,
+        // with 0 covered meaning end of block; 0 = longer code
+        uint16_t skip[1 << kFastBits];
+        int32_t max_code[18];           // Largest code of each length, -1 if none
+        int32_t val_offset[17];         // Index of its first symbol minus its first code
+        uint8_t symbols[256];
+        bool defined = false;
+    };
+
+    struct Component {
+        int id;
+        int h;             // Sampling factors
+        int v;
+        int quant;         // Quantisation table index
+        int dc_table;      // Set per scan
+        int ac_table;
+        int predictor;
+    };
+
+    // Bit reader over the entropy-coded segment. Stuffed 0xFF00 bytes are
+    // unstuffed; reaching a marker feeds zeros until the next restart.
+    struct Bits {
+        const uint8_t* p;
+        const uint8_t* end;
+        uint64_t buffer;
+        int count;
+        bool at_marker;
+    };
+
+    static bool build(HuffmanTable& table, const uint8_t* counts, const uint8_t* symbols);
+    static void fill(Bits& bits);
+    static int decode(Bits& bits, const HuffmanTable& table);
+    static int receive(Bits& bits, int size);
+    static bool restart(Bits& bits);
+
+    bool parse_sof(const uint8_t* p, size_t length);
+    bool parse_dht(const uint8_t* p, size_t length);
+    bool parse_dqt(const uint8_t* p, size_t length);
+    bool decode_scan(const uint8_t* p, size_t length, const uint8_t* data_end, cv::Mat& dc);
+
+    HuffmanTable dc_tables[4];
+    HuffmanTable ac_tables[4];
+    HuffmanTable default_tables[4];  // Annex K: DC luma, DC chroma, AC luma, AC chroma
+    uint16_t dc_quant[4];            // First entry of each quantisation table
+    Component components[4];
+    int component_count;
+    int width;
+    int height;
+    int restart_interval;
+};
+
+// Cheap "did anything change" test on DC images: counts blocks whose mean
+// moved more than `threshold` away from a slowly adapting reference.
+class DcPrefilter {
+public:
+    // `min_blocks` changed blocks make a frame worth a full analysis
+    DcPrefilter(int threshold, int min_blocks);
+
+    // Compares `dc` with the reference and folds it in. The first frame,
+    // and any frame of a new size, counts as changed.
+    bool changed(const cv::Mat& dc);
+
+    int changed_blocks() const { return last_changed; }
+
+    // Forgets the reference; the next frame starts a new one
+    void reset() { reference = cv::Mat(); }
+
+private:
+    int threshold;
+    int min_blocks;
+    int last_changed;
+    cv::Mat reference;  // CV_16UC1, block means in 1/16 steps
+};
+
+#endif // OPENSENTRY_JPEG_DC_H
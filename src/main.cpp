@@ -2,13 +2,18 @@
 // Created by sbussiso on 1/5/26.
 //
 #include <opencv2/opencv.hpp>
+#include <algorithm>
 #include <iostream>
 #include <thread>
 #include <atomic>
 #include <chrono>
 #include <sstream>
 #include <iomanip>
+#include <cmath>
 #include <set>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 // mDNS includes (Avahi)
 #include <avahi-client/client.h>
@@ -30,26 +35,37 @@ extern "C" {
 #include "mqtt/async_client.h"
 #include <openssl/sha.h>
 
+#include "pipeline.h"
+#include "activity_grid.h"
+#include "frame_source.h"
+#include "frame_clock.h"
+#include "detection_scheduler.h"
+#include "jpeg_dc.h"
+#include "mjpeg_decoder.h"
+#include "yuv_utils.h"
+#include "motion_detector.h"
+#include "encode_profile.h"
+#include "quality_controller.h"
+#include "event_recorder.h"
+#include "event_publisher.h"
+#include "snapshot.h"
+#include "stage_metrics.h"
+#include "stream_output.h"
+#include "substream.h"
+#include "worker_pool.h"
+#include "alloc_trace.h"
+
 using namespace cv;
 using namespace std;
 
 // Global variables
-atomic<bool> running(true);
-atomic<bool> streaming(true);  // Start streaming immediately
-Mat lastFrame;                  // Store the last frame for pause state
-atomic<bool> motion_active(false);  // Track motion state
-atomic<time_t> motion_start_time(0); // Track when motion started
-
-// Helper function to create JSON status message
-string create_status_json(const string& status) {
-    time_t now = time(nullptr);
-    string json = "{"
-        "\"status\": \"" + status + "\","
-        "\"node_type\": \"motion\","
-        "\"capabilities\": [\"streaming\", \"motion_detection\"],"
-        "\"timestamp\": " + to_string(now) +
-        "}";
-    return json;
+atomic<bool> running(true);  // Process-wide; each camera also has its own flag
+
+// Startup milestones (and the time-to-first-packet metric) count from here
+const chrono::steady_clock::time_point process_start = chrono::steady_clock::now();
+
+long long millisSinceStart() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - process_start).count();
 }
 
 // Configuration - read from environment variables with defaults
@@ -77,117 +93,164 @@ string MQTT_SERVER;
 string MQTT_USERNAME;
 string MQTT_PASSWORD;
 string CLIENT_ID;
-string CAMERA_ID;
-string CAMERA_NAME;
-int CAMERA_DEVICE_INDEX;
+
+// Per-camera control state, shared by the camera's session, the MQTT
+// command handler and the heartbeat. One per configured camera, created
+// before MQTT connects and never moved.
+struct CameraControl {
+    string id;
+    string name;
+    int device_index = 0;
+    int index = 0;                 // This camera's events in the EventPublisher
+    atomic<bool> running{true};    // Cleared by "shutdown" or when the session ends
+    atomic<bool> streaming{true};  // Start streaming immediately
+};
+
+// Parses CAMERAS="id:device[:name];..." where device is /dev/videoN or N
+vector<unique_ptr<CameraControl>> parseCameras(const string& spec) {
+    vector<unique_ptr<CameraControl>> cameras;
+    stringstream entries(spec);
+    string entry;
+    while (getline(entries, entry, ';')) {
+        if (entry.empty()) continue;
+        size_t first = entry.find(':');
+        if (first == string::npos || first == 0) {
+            cerr << "[Config] Ignoring camera '" << entry << "' (expected id:device[:name])" << endl;
+            continue;
+        }
+        size_t second = entry.find(':', first + 1);
+        string device = entry.substr(first + 1, second == string::npos ? string::npos : second - first - 1);
+        if (device.find("/dev/video") == 0) device = device.substr(10);
+
+        unique_ptr<CameraControl> camera(new CameraControl());
+        camera->id = entry.substr(0, first);
+        camera->name = second == string::npos ? camera->id : entry.substr(second + 1);
+        try {
+            camera->device_index = stoi(device);
+        } catch (const exception&) {
+            cerr << "[Config] Ignoring camera '" << entry << "' (bad device)" << endl;
+            continue;
+        }
+        cameras.push_back(move(camera));
+    }
+    return cameras;
+}
 
 // ============================================================================
 // mDNS Service Broadcaster for Camera Node
 // ============================================================================
+// One Avahi client for the whole process, with one entry group (service)
+// per camera so each camera's status can change on its own.
 class CameraMDNSBroadcaster {
 private:
+    struct Service {
+        CameraMDNSBroadcaster* owner;
+        AvahiEntryGroup* group;
+        string service_name;
+        string camera_id;
+        string rtsp_path;
+        string substream_path;     // Empty without a substream
+        string substream_size;     // WxH
+        int substream_fps;
+        string current_status;
+    };
+
     AvahiThreadedPoll* threaded_poll;
     AvahiClient* client;
-    AvahiEntryGroup* group;
-    string service_name;
-    string camera_id;
     int rtsp_port;
-    string rtsp_path;
-    string current_status;
-    
+    vector<unique_ptr<Service>> services;
+    // start() runs on its own thread while the cameras open; status updates
+    // wait for it, then take the poll lock like any other
+    mutex setup_mutex;
+
     static void entry_group_callback(AvahiEntryGroup* g, AvahiEntryGroupState state, void* userdata) {
-        CameraMDNSBroadcaster* broadcaster = static_cast<CameraMDNSBroadcaster*>(userdata);
-        
+        Service* service = static_cast<Service*>(userdata);
+
         switch(state) {
             case AVAHI_ENTRY_GROUP_ESTABLISHED:
-                cout << "[mDNS] Service '" << broadcaster->service_name 
+                cout << "[mDNS] Service '" << service->service_name
                      << "' successfully established" << endl;
                 break;
-                
+
             case AVAHI_ENTRY_GROUP_COLLISION: {
-                char* alt_name = avahi_alternative_service_name(broadcaster->service_name.c_str());
-                broadcaster->service_name = alt_name;
+                char* alt_name = avahi_alternative_service_name(service->service_name.c_str());
+                service->service_name = alt_name;
                 avahi_free(alt_name);
-                cout << "[mDNS] Service name collision, renaming to '" 
-                     << broadcaster->service_name << "'" << endl;
-                broadcaster->create_services();
+                cout << "[mDNS] Service name collision, renaming to '"
+                     << service->service_name << "'" << endl;
+                service->owner->create_service(*service);
                 break;
             }
-                
+
             case AVAHI_ENTRY_GROUP_FAILURE:
                 cerr << "[mDNS] Entry group failure" << endl;
                 break;
-                
+
             case AVAHI_ENTRY_GROUP_UNCOMMITED:
             case AVAHI_ENTRY_GROUP_REGISTERING:
                 break;
         }
     }
-    
+
     static void client_callback(AvahiClient* c, AvahiClientState state, void* userdata) {
         CameraMDNSBroadcaster* broadcaster = static_cast<CameraMDNSBroadcaster*>(userdata);
-        
+
         // Store the client pointer - callback fires before avahi_client_new() returns
         broadcaster->client = c;
-        
+
         switch(state) {
             case AVAHI_CLIENT_S_RUNNING:
-                cout << "[mDNS] Client running, registering service..." << endl;
-                broadcaster->create_services();
+                cout << "[mDNS] Client running, registering services..." << endl;
+                for (auto& service : broadcaster->services) {
+                    broadcaster->create_service(*service);
+                }
                 break;
-                
+
             case AVAHI_CLIENT_FAILURE:
                 cerr << "[mDNS] Client failure: " << avahi_strerror(avahi_client_errno(c)) << endl;
                 break;
-                
+
             case AVAHI_CLIENT_S_COLLISION:
             case AVAHI_CLIENT_S_REGISTERING:
-                if(broadcaster->group)
-                    avahi_entry_group_reset(broadcaster->group);
+                for (auto& service : broadcaster->services) {
+                    if(service->group)
+                        avahi_entry_group_reset(service->group);
+                }
                 break;
-                
+
             case AVAHI_CLIENT_CONNECTING:
                 cout << "[mDNS] Connecting to Avahi daemon..." << endl;
                 break;
         }
     }
-    
-    void create_services() {
+
+    void create_service(Service& service) {
         if(!client) {
             return;  // Client not ready yet
         }
-        
+
         if(avahi_client_get_state(client) != AVAHI_CLIENT_S_RUNNING) {
             return;  // Client not running
         }
-            
-        if(!group) {
-            group = avahi_entry_group_new(client, entry_group_callback, this);
-            if(!group) {
+
+        if(!service.group) {
+            service.group = avahi_entry_group_new(client, entry_group_callback, &service);
+            if(!service.group) {
                 cerr << "[mDNS] Failed to create entry group: " << avahi_strerror(avahi_client_errno(client)) << endl;
                 return;
             }
         }
-        
-        if(avahi_entry_group_is_empty(group)) {
+
+        if(avahi_entry_group_is_empty(service.group)) {
             // Build TXT records - store in persistent strings
-            string txt_camera_id = "camera_id=" + camera_id;
-            string txt_name = "name=" + service_name;
+            string txt_camera_id = "camera_id=" + service.camera_id;
+            string txt_name = "name=" + service.service_name;
             string txt_rtsps_port = "rtsps_port=" + to_string(rtsp_port);
-            string txt_rtsp_path = "rtsp_path=" + rtsp_path;
-            string txt_status = "status=" + current_status;
+            string txt_rtsp_path = "rtsp_path=" + service.rtsp_path;
+            string txt_status = "status=" + service.current_status;
             string txt_mqtt_port = "mqtt_port=8883";
-            
-            int ret = avahi_entry_group_add_service(
-                group,
-                AVAHI_IF_UNSPEC,
-                AVAHI_PROTO_UNSPEC,
-                static_cast<AvahiPublishFlags>(0),
-                service_name.c_str(),
-                "_opensentry._tcp",        // Service type for OpenSentry cameras
-                nullptr,                   // domain
-                nullptr,                   // host
-                rtsp_port,
+
+            AvahiStringList* txt = avahi_string_list_new(
                 txt_camera_id.c_str(),
                 txt_name.c_str(),
                 txt_rtsps_port.c_str(),
@@ -201,38 +264,70 @@ private:
                 "mqtt_tls=true",
                 nullptr
             );
-            
+            // Low-resolution sibling stream for grid views, when there is one
+            if(!service.substream_path.empty()) {
+                txt = avahi_string_list_add_pair(txt, "substream_path", service.substream_path.c_str());
+                txt = avahi_string_list_add_pair(txt, "substream_size", service.substream_size.c_str());
+                txt = avahi_string_list_add_pair(txt, "substream_fps", to_string(service.substream_fps).c_str());
+            }
+
+            int ret = avahi_entry_group_add_service_strlst(
+                service.group,
+                AVAHI_IF_UNSPEC,
+                AVAHI_PROTO_UNSPEC,
+                static_cast<AvahiPublishFlags>(0),
+                service.service_name.c_str(),
+                "_opensentry._tcp",        // Service type for OpenSentry cameras
+                nullptr,                   // domain
+                nullptr,                   // host
+                rtsp_port,
+                txt
+            );
+            avahi_string_list_free(txt);
+
             if(ret < 0) {
                 cerr << "[mDNS] Failed to add service: " << avahi_strerror(ret) << endl;
                 return;
             }
-            
-            ret = avahi_entry_group_commit(group);
+
+            ret = avahi_entry_group_commit(service.group);
             if(ret < 0) {
                 cerr << "[mDNS] Failed to commit entry group: " << avahi_strerror(ret) << endl;
             }
         }
     }
-    
+
 public:
-    CameraMDNSBroadcaster(const string& cam_id, const string& name, int port, const string& path)
-        : threaded_poll(nullptr), client(nullptr), group(nullptr),
-          service_name(name), camera_id(cam_id), rtsp_port(port), 
-          rtsp_path(path), current_status("online") {}
-    
+    explicit CameraMDNSBroadcaster(int port)
+        : threaded_poll(nullptr), client(nullptr), rtsp_port(port) {}
+
     ~CameraMDNSBroadcaster() {
         stop();
     }
-    
+
+    // Adds a camera's service; call before start()
+    void add_camera(const string& cam_id, const string& name, const string& path) {
+        unique_ptr<Service> service(new Service());
+        service->owner = this;
+        service->group = nullptr;
+        service->service_name = name;
+        service->camera_id = cam_id;
+        service->rtsp_path = path;
+        service->substream_fps = 0;
+        service->current_status = "online";
+        services.push_back(move(service));
+    }
+
     bool start() {
+        lock_guard<mutex> setup(setup_mutex);
         int error;
-        
+
         threaded_poll = avahi_threaded_poll_new();
         if(!threaded_poll) {
             cerr << "[mDNS] Failed to create threaded poll" << endl;
             return false;
         }
-        
+
         client = avahi_client_new(
             avahi_threaded_poll_get(threaded_poll),
             static_cast<AvahiClientFlags>(0),
@@ -240,58 +335,83 @@ public:
             this,
             &error
         );
-        
+
         if(!client) {
             cerr << "[mDNS] Failed to create client: " << avahi_strerror(error) << endl;
             return false;
         }
-        
+
         avahi_threaded_poll_start(threaded_poll);
-        
-        cout << "[mDNS] Broadcaster started for camera: " << camera_id << endl;
-        cout << "[mDNS]   Service: " << service_name << endl;
+
+        cout << "[mDNS] Broadcaster started for " << services.size() << " camera(s)" << endl;
+        for (auto& service : services) {
+            cout << "[mDNS]   Service: " << service->service_name << " (" << service->camera_id << ")" << endl;
+        }
         cout << "[mDNS]   Type: _opensentry._tcp" << endl;
         cout << "[mDNS]   Node Type: motion" << endl;
         cout << "[mDNS]   Capabilities: streaming, motion_detection" << endl;
         cout << "[mDNS]   RTSPS Port: " << rtsp_port << " (encrypted)" << endl;
-        
+
         return true;
     }
-    
-    void update_status(const string& status) {
-        if(status == current_status)
-            return;
-            
-        current_status = status;
-        
-        // Only update if mDNS is fully initialized
-        if(group && client && threaded_poll) {
-            avahi_threaded_poll_lock(threaded_poll);
-            if(avahi_client_get_state(client) == AVAHI_CLIENT_S_RUNNING) {
-                avahi_entry_group_reset(group);
-                create_services();
-                cout << "[mDNS] Status updated to: " << status << endl;
+
+    void update_status(const string& camera_id, const string& status) {
+        // Only touched under the poll lock once the client is up
+        lock_guard<mutex> setup(setup_mutex);
+        if(threaded_poll) avahi_threaded_poll_lock(threaded_poll);
+        for (auto& service : services) {
+            if(service->camera_id != camera_id || service->current_status == status)
+                continue;
+            service->current_status = status;
+
+            // Only update if mDNS is fully initialized
+            if(service->group && client && avahi_client_get_state(client) == AVAHI_CLIENT_S_RUNNING) {
+                avahi_entry_group_reset(service->group);
+                create_service(*service);
+                cout << "[mDNS] " << camera_id << " status updated to: " << status << endl;
             }
-            avahi_threaded_poll_unlock(threaded_poll);
+            // Silently skip if mDNS not ready - status will be set when service registers
         }
-        // Silently skip if mDNS not ready - status will be set when service registers
+        if(threaded_poll) avahi_threaded_poll_unlock(threaded_poll);
     }
-    
+
+    // Advertises a camera's substream once it is streaming
+    void set_substream(const string& camera_id, const string& path, int width, int height, int fps) {
+        lock_guard<mutex> setup(setup_mutex);
+        if(threaded_poll) avahi_threaded_poll_lock(threaded_poll);
+        for (auto& service : services) {
+            if(service->camera_id != camera_id) continue;
+            service->substream_path = path;
+            service->substream_size = to_string(width) + "x" + to_string(height);
+            service->substream_fps = fps;
+
+            if(service->group && client && avahi_client_get_state(client) == AVAHI_CLIENT_S_RUNNING) {
+                avahi_entry_group_reset(service->group);
+                create_service(*service);
+            }
+        }
+        if(threaded_poll) avahi_threaded_poll_unlock(threaded_poll);
+    }
+
     void stop() {
         if(threaded_poll) {
             avahi_threaded_poll_stop(threaded_poll);
         }
-        
+
         if(client) {
+            // Frees the entry groups too
             avahi_client_free(client);
             client = nullptr;
+            for (auto& service : services) {
+                service->group = nullptr;
+            }
         }
-        
+
         if(threaded_poll) {
             avahi_threaded_poll_free(threaded_poll);
             threaded_poll = nullptr;
         }
-        
+
         cout << "[mDNS] Broadcaster stopped" << endl;
     }
 };
@@ -303,14 +423,41 @@ CameraMDNSBroadcaster* g_mdns_broadcaster = nullptr;
 // MQTT Callback Handler
 // ============================================================================
 // Valid commands whitelist for security
-const set<string> VALID_COMMANDS = {"start", "stop", "shutdown"};
+const set<string> VALID_COMMANDS = {"start", "stop", "shutdown", "snapshot"};
 
 class MQTTCallback : public virtual mqtt::callback {
 public:
+    MQTTCallback(const vector<unique_ptr<CameraControl>>& cams, EventPublisher& publisher)
+        : cameras(cams), events(publisher) {}
+
     void message_arrived(mqtt::const_message_ptr msg) override {
         string topic = msg->get_topic();
         string payload = msg->to_string();
 
+        for (const auto& camera : cameras) {
+            string prefix = "opensentry/" + camera->id + "/";
+            if (topic == prefix + "command") {
+                command(*camera, topic, payload);
+                return;
+            }
+            if (topic == prefix + "events/query") {
+                query(*camera, payload);
+                return;
+            }
+        }
+    }
+
+    void connection_lost(const string& cause) override {
+        cerr << "[MQTT] Connection lost: " << cause << endl;
+        cerr << "[MQTT] Will attempt to reconnect..." << endl;
+    }
+
+    void connected(const string& cause) override {
+        cout << "[MQTT] Reconnected" << endl;
+    }
+
+private:
+    void command(CameraControl& camera, const string& topic, const string& payload) {
         // Input validation: limit payload size to prevent buffer attacks
         if (payload.length() > 64) {
             cerr << "[MQTT] SECURITY: Rejected oversized payload (" << payload.length() << " bytes)" << endl;
@@ -327,284 +474,1020 @@ public:
 
         cout << "[MQTT] Received: " << topic << " = " << payload << endl;
 
-        if (topic == "opensentry/" + CAMERA_ID + "/command") {
-            // Validate command against whitelist
-            if (VALID_COMMANDS.find(payload) == VALID_COMMANDS.end()) {
-                cerr << "[MQTT] SECURITY: Rejected unknown command: " << payload << endl;
+        // Validate command against whitelist
+        if (VALID_COMMANDS.find(payload) == VALID_COMMANDS.end()) {
+            cerr << "[MQTT] SECURITY: Rejected unknown command: " << payload << endl;
+            return;
+        }
+
+        if (payload == "start") {
+            camera.streaming = true;
+            cout << "[MQTT] Starting stream " << camera.id << endl;
+            if(g_mdns_broadcaster) g_mdns_broadcaster->update_status(camera.id, "streaming");
+        } else if (payload == "stop") {
+            camera.streaming = false;
+            cout << "[MQTT] Stopping stream " << camera.id << " (paused)" << endl;
+            if(g_mdns_broadcaster) g_mdns_broadcaster->update_status(camera.id, "idle");
+        } else if (payload == "shutdown") {
+            // Ends this camera's session; the process exits with the last one
+            camera.running = false;
+            cout << "[MQTT] Shutting down " << camera.id << endl;
+            if(g_mdns_broadcaster) g_mdns_broadcaster->update_status(camera.id, "offline");
+        } else if (payload == "snapshot") {
+            // Re-sends the recent motion snapshots, e.g. for a dashboard that just connected
+            events.resend_snapshots(camera.index);
+        }
+    }
+
+    // Event log queries: a small JSON object, checked before it is parsed
+    void query(CameraControl& camera, const string& payload) {
+        if (payload.length() > 256) {
+            cerr << "[MQTT] SECURITY: Rejected oversized event query (" << payload.length() << " bytes)" << endl;
+            return;
+        }
+        for (char c : payload) {
+            if (c < 0x20 || c > 0x7e) {
+                cerr << "[MQTT] SECURITY: Rejected event query with invalid characters" << endl;
                 return;
             }
-            
-            if (payload == "start") {
-                streaming = true;
-                cout << "[MQTT] Starting stream" << endl;
-                if(g_mdns_broadcaster) g_mdns_broadcaster->update_status("streaming");
-            } else if (payload == "stop") {
-                streaming = false;
-                cout << "[MQTT] Stopping stream (paused)" << endl;
-                if(g_mdns_broadcaster) g_mdns_broadcaster->update_status("idle");
-            } else if (payload == "shutdown") {
-                running = false;
-                cout << "[MQTT] Shutting down" << endl;
-                if(g_mdns_broadcaster) g_mdns_broadcaster->update_status("offline");
-            }
         }
+        EventQuery request;
+        if (!parseEventQuery(payload, request)) {
+            cerr << "[MQTT] Ignoring malformed event query for " << camera.id << ": " << payload << endl;
+            return;
+        }
+        events.query(camera.index, request);
     }
 
-    void connection_lost(const string& cause) override {
-        cerr << "[MQTT] Connection lost: " << cause << endl;
-        cerr << "[MQTT] Will attempt to reconnect..." << endl;
+    const vector<unique_ptr<CameraControl>>& cameras;
+    EventPublisher& events;
+};
+
+// Connects to the broker and subscribes to each camera's command topic, and
+// its event query topic if it keeps an event log. Throws mqtt::exception if
+// the broker can't be reached.
+void connectBroker(mqtt::async_client& client, const mqtt::connect_options& options,
+                   const vector<unique_ptr<CameraControl>>& cameras, const EventPublisher& events) {
+    client.connect(options)->wait();
+    for (const auto& camera : cameras) {
+        client.subscribe("opensentry/" + camera->id + "/command", 1)->wait();
+        if (events.logging(camera->index)) {
+            client.subscribe("opensentry/" + camera->id + "/events/query", 1)->wait();
+        }
     }
-    
-    void connected(const string& cause) override {
-        cout << "[MQTT] Reconnected" << endl;
+}
+
+// Connects to the broker off the startup path, so an unreachable one never
+// holds up the cameras, and retries every 10 s until it answers (Paho only
+// reconnects a client that connected once). Meanwhile the publisher holds
+// the latest status and spools or logs motion events as configured.
+void mqtt_connect_thread(mqtt::async_client& client, mqtt::connect_options options,
+                         const vector<unique_ptr<CameraControl>>& cameras, const EventPublisher& events,
+                         bool store_and_forward) {
+    cout << "[MQTT] Connecting to broker in the background..." << endl;
+    bool warned = false;
+    while (running) {
+        try {
+            connectBroker(client, options, cameras, events);
+            cout << "[MQTT] Connected and subscribed to commands at " << millisSinceStart() << " ms"
+                 << (warned && store_and_forward ? ", sending logged events" : "") << endl;
+            return;
+        } catch (const mqtt::exception& exc) {
+            if (!warned) {
+                cerr << "[MQTT] Warning: " << exc.what() << endl;
+                if (store_and_forward) {
+                    cerr << "[MQTT] Logging motion events until the broker can be reached" << endl;
+                } else {
+                    cerr << "[MQTT] Streaming without remote control until the broker can be reached" << endl;
+                }
+                warned = true;
+            }
+        }
+        for (int i = 0; i < 100 && running; i++) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
     }
-};
+}
 
-void mqtt_heartbeat_thread(mqtt::async_client& mqtt_client) {
+void mqtt_heartbeat_thread(EventPublisher& events, const vector<unique_ptr<CameraControl>>& cameras) {
     while (running) {
-        if (mqtt_client.is_connected()) {
-            string status = streaming ? "streaming" : "idle";
-            string json_status = create_status_json(status);
-            mqtt_client.publish("opensentry/" + CAMERA_ID + "/status", json_status, 0, false);
+        for (const auto& camera : cameras) {
+            if (!camera->running) continue;
+            events.status(camera->index, camera->streaming ? "streaming" : "idle");
         }
         this_thread::sleep_for(chrono::seconds(5));
     }
 }
 
-int main()
-{
-    // Initialize configuration from environment variables
-    CAMERA_ID = getEnvOrDefault("CAMERA_ID", "camera1");
-    CAMERA_NAME = getEnvOrDefault("CAMERA_NAME", "OpenSentry Camera 1");
-    MQTT_SERVER = getEnvOrDefault("MQTT_SERVER", "tcp://localhost:1883");
-    
-    // Convert tls:// to ssl:// for MQTT library compatibility
-    if (MQTT_SERVER.find("tls://") == 0) {
-        MQTT_SERVER = "ssl://" + MQTT_SERVER.substr(6);
-        cout << "[Config] Converting TLS URL to SSL for MQTT library" << endl;
+// ============================================================================
+// Capture -> Motion -> Encode -> Network pipeline
+// ============================================================================
+// Frame interval for an fps setting given as a string; 0 or less means no limit
+chrono::microseconds intervalForFps(const string& fps) {
+    double value = stod(fps);
+    if (value <= 0) return chrono::microseconds(0);
+    return chrono::microseconds(static_cast<int64_t>(1000000.0 / value));
+}
+
+// Frame slots one camera's pipeline can have in flight: both frame queues
+// full (including entries evicted but not yet discarded) plus one held by
+// each stage
+size_t framesInFlight(size_t depth, DropPolicy policy) {
+    return 2 * StageQueue<FrameSlot*>::max_held(depth, policy) + 3;
+}
+
+class MotionWorker;
+class EncodeWorker;
+
+// Where one encoded stream goes: the queue its encoder fills, the muxer the
+// stream's write thread drains it into, and the metrics the writes count
+// towards
+struct StreamSink {
+    const char* label;                    // For logs
+    bool main;                            // Its connection state is the camera's status
+    AVCodecContext* codec;
+    OutputQueue& queue;
+    StreamOutput& output;
+    Stage write_stage;
+    atomic<uint64_t>& written;
+};
+
+// One camera's stages. Capture and network writes block on I/O and get a
+// thread each; motion and encode are CPU work and run as strands on the
+// shared worker pool. Stages hand frames on through bounded SPSC queues of
+// preallocated slots, so throughput is set by the slowest stage instead of
+// the sum of all of them.
+struct StreamPipeline {
+    CameraControl& camera;
+    FrameSource& source;
+    WorkerPool& pool;
+    int width;
+    int height;
+    int fps;                              // Configured rate; capture drops anything faster
+    AVCodecContext* codecCtx;
+    StreamOutput& output;                 // Only the write stage touches it
+    EventPublisher& events;               // Stages post MQTT events here, never to Paho
+    bool display_enabled;
+    MotionConfig motion_config;
+    EncodeProfileConfig encode_profile;
+    QualityControlConfig quality_config;
+
+    // Paused mode: how often a frozen frame is re-sent to keep the RTSP
+    // session alive, and how often frames are still analysed for motion
+    chrono::microseconds paused_keepalive_interval;
+    chrono::microseconds paused_analysis_interval;
+
+    EventRecorder recorder;               // Pre-roll ring and event clips
+    SnapshotMaker snapshots;              // JPEG of each motion start, encoded on snapshot_strand
+    PipelineMetrics metrics;              // Stage latencies and frame counters
+
+    StageQueue<FrameSlot*> captured;      // capture -> motion
+    StageQueue<FrameSlot*> analysed;      // motion -> encode
+    FramePool frames;                     // framesInFlight() slots
+    // encode -> write. Never blocks the encoder; a backed-up network sheds
+    // whole GOPs so the H.264 stream stays decodable
+    OutputQueue encoded;
+
+    // Low-resolution second stream, fed by the encode stage and encoded on
+    // substream_strand. Null when not configured or it failed to open;
+    // the session sets substream_output before starting.
+    unique_ptr<Substream> substream;
+    StreamOutput* substream_output = nullptr;
+
+    // Pool stages never block a worker on a full queue: motion returns and
+    // sets motion_waiting, and encode reschedules it once it makes room
+    unique_ptr<MotionWorker> motion;
+    unique_ptr<EncodeWorker> encoder;
+    Strand motion_strand;
+    Strand encode_strand;
+    Strand snapshot_strand;
+    Strand substream_strand;
+    atomic<bool> motion_waiting{false};   // motion -> encode queue was full
+
+    mutex preview_mutex;
+    Mat preview;                          // Last encoded frame for the GUI window
+
+    StreamPipeline(CameraControl& cam, FrameSource& src, WorkerPool& workers,
+                   int w, int h, int rate, AVCodecContext* codec, StreamOutput& out,
+                   EventPublisher& publisher, bool display,
+                   const MotionConfig& motion, const EncodeProfileConfig& profile,
+                   const QualityControlConfig& quality, const RecorderConfig& clips,
+                   const SnapshotConfig& snapshot, const SubstreamConfig& sub,
+                   size_t depth, DropPolicy policy);
+    ~StreamPipeline();
+
+    StreamSink main_sink() {
+        return {"stream", true, codecCtx, encoded, output, Stage::Write, metrics.packets_written};
     }
-    
-    CLIENT_ID = "opensentry_node_" + CAMERA_ID;
-    
-    // Credential derivation: use OPENSENTRY_SECRET if set, otherwise fall back to individual credentials
-    string opensentry_secret = getEnvOrDefault("OPENSENTRY_SECRET", "");
-    if (!opensentry_secret.empty()) {
-        cout << "[Config] Using derived credentials from OPENSENTRY_SECRET" << endl;
-        MQTT_USERNAME = "opensentry";
-        MQTT_PASSWORD = deriveCredential(opensentry_secret, "mqtt");
-    } else {
-        MQTT_USERNAME = getEnvOrDefault("MQTT_USERNAME", "opensentry");
-        MQTT_PASSWORD = getEnvOrDefault("MQTT_PASSWORD", "opensentry");
+    StreamSink substream_sink() {
+        return {"substream", false, substream->codec(), substream->output_queue(), *substream_output,
+                Stage::SubstreamWrite, metrics.substream_written};
     }
-    
-    // Parse camera device - extract index from /dev/video0 format or use directly
-    string cameraDeviceStr = getEnvOrDefault("CAMERA_DEVICE", "/dev/video0");
-    if (cameraDeviceStr.find("/dev/video") == 0) {
-        CAMERA_DEVICE_INDEX = stoi(cameraDeviceStr.substr(10));
-    } else {
-        CAMERA_DEVICE_INDEX = stoi(cameraDeviceStr);
+
+    // The queues keep their indices on separate cache lines; C++14 new
+    // doesn't honour that alignment on its own
+    static void* operator new(size_t size) {
+        void* mem;
+        if (posix_memalign(&mem, alignof(StreamPipeline), size) != 0) throw bad_alloc();
+        return mem;
     }
-    
-    cout << "========================================" << endl;
-    cout << "  OpenSentry Camera Node - " << CAMERA_ID << endl;
-    cout << "========================================" << endl;
-    cout << "  Name: " << CAMERA_NAME << endl;
-    cout << "  MQTT: " << MQTT_SERVER << endl;
-    cout << "  Camera: /dev/video" << CAMERA_DEVICE_INDEX << endl;
-    cout << "========================================" << endl;
-    
-    // Initialize mDNS broadcaster
-    CameraMDNSBroadcaster mdns_broadcaster(
-        CAMERA_ID,                    // Camera ID
-        CAMERA_NAME,                  // Service name (friendly name)
-        8322,                         // RTSPS port (encrypted)
-        CAMERA_ID                     // RTSP path
-    );
-    g_mdns_broadcaster = &mdns_broadcaster;
-    
-    bool mdns_available = mdns_broadcaster.start();
-    if(!mdns_available) {
-        cerr << "[WARNING] mDNS broadcaster failed to start - continuing without discovery" << endl;
-        cerr << "[WARNING] Camera will still stream but won't be auto-discovered" << endl;
+    static void operator delete(void* mem) { free(mem); }
+};
+
+void capture_stage(StreamPipeline& p) {
+    int64_t index = 0;
+    StageAllocProbe allocs("capture");
+
+    // While paused only every paused_analysis_interval'th frame goes on to
+    // motion detection; the rest are read and dropped on the spot
+    auto next_paused_frame = chrono::steady_clock::now();
+    FrameRateLimiter limiter(p.fps);
+
+    while (p.camera.running) {
+        // Every slot still downstream is only possible transiently
+        FrameSlot* slot = p.frames.acquire_wait(p.camera.running);
+        if (!slot) break;
+
+        allocs.begin();
+        auto read_start = chrono::steady_clock::now();
+        bool skip = !p.camera.streaming && read_start < next_paused_frame;
+        int r = 0;
+        while (p.camera.running && (r = p.source.read(slot, !skip)) == 0) {}
+        if (r == 0) {  // Stopping
+            p.frames.release(slot);
+            break;
+        }
+
+        if (r < 0) {
+            cerr << "[ERROR] " << p.camera.id << ": Empty frame (end of input or capture failure)" << endl;
+            p.frames.release(slot);
+            p.camera.running = false;
+            break;
+        }
+
+        if (skip || !limiter.accept(slot->captured)) {
+            p.frames.release(slot);
+            allocs.end();
+            continue;
+        }
+        if (!p.camera.streaming) {
+            next_paused_frame = chrono::steady_clock::now() + p.paused_analysis_interval;
+        }
+
+        auto convert = p.source.convert_time();
+        p.metrics[Stage::CaptureWait].record(chrono::steady_clock::now() - read_start - convert);
+        if (convert.count() > 0) p.metrics[Stage::Convert].record(convert);
+        p.metrics.frames_captured.fetch_add(1, memory_order_relaxed);
+
+        slot->index = index++;
+        allocs.end();
+        if (p.captured.push(slot, p.camera.running)) {
+            p.pool.schedule(p.motion_strand);
+        } else {
+            p.frames.release(slot);
+        }
     }
-    
-    // Setup MQTT
-    mqtt::async_client mqtt_client(MQTT_SERVER, CLIENT_ID);
-    MQTTCallback callback;
-    mqtt_client.set_callback(callback);
+}
 
-    mqtt::connect_options connOpts;
-    connOpts.set_keep_alive_interval(20);
-    connOpts.set_clean_session(true);
-    connOpts.set_automatic_reconnect(true);  // Auto-reconnect on connection loss
-    connOpts.set_automatic_reconnect(1, 30); // Min 1s, max 30s backoff
-    connOpts.set_user_name(MQTT_USERNAME);
-    connOpts.set_password(MQTT_PASSWORD);
-    
-    // Configure TLS if using tls:// or ssl:// protocol
-    if (MQTT_SERVER.find("tls://") == 0 || MQTT_SERVER.find("ssl://") == 0) {
-        cout << "[MQTT] Configuring TLS connection" << endl;
-        mqtt::ssl_options sslopts;
-        sslopts.set_verify(0); // Don't verify the server certificate
-        sslopts.set_enable_server_cert_auth(false);
-        connOpts.set_ssl(sslopts);
+// Frames a strand handles before going to the back of the pool's queue
+const int STRAND_BATCH = 4;
+
+class MotionWorker {
+public:
+    explicit MotionWorker(StreamPipeline& pipeline)
+        : p(pipeline), detector(p.width, p.height, p.motion_config),
+          activity(detector.kernel().tiles_x(), detector.kernel().tiles_y(), detector.kernel().tile_size(),
+                   detector.analysis_size().width, detector.analysis_size().height,
+                   detector.zones().tile_zones(), p.motion_config.activity_frames),
+          // A quarter of the minimum area in 8x8 blocks: the prefilter only
+          // has to avoid missing what the detector would report
+          prefilter(p.motion_config.prefilter_threshold, p.motion_config.min_area / 256),
+          scheduler(p.motion_config.idle_fps, p.motion_config.idle_after_ms),
+          allocs("motion"), motion_active(false), motion_start_time(0), last_clip(0), event_zones(0) {
+        cout << "[Motion] " << p.camera.id << ": analysis resolution " << detector.analysis_size().width
+             << "x" << detector.analysis_size().height
+             << (activity.enabled() ? ", activity grid " + to_string(activity.columns()) + "x" + to_string(activity.rows()) : "")
+             << (scheduler.enabled() ? ", idle analysis at " + to_string(p.motion_config.idle_fps) + " fps" : "")
+             << (p.frames.slot_storage() == SlotStorage::Jpeg && p.motion_config.prefilter_threshold > 0
+                 ? ", MJPEG DC prefilter" : "")
+             << ", kernel: " << MotionKernel::isa_name()
+             << ", mode: " << motionModeName(p.motion_config.mode) << endl;
+        p.metrics.detection_idle.store(scheduler.idle(), memory_order_relaxed);
     }
 
-    bool mqtt_connected = false;
-    try {
-        cout << "[MQTT] Connecting to broker..." << endl;
-        mqtt_client.connect(connOpts)->wait();
-        cout << "[MQTT] Connected!" << endl;
+    void run() {
+        for (int n = 0; n < STRAND_BATCH; n++) {
+            if (!p.camera.running) return;
+            if (p.analysed.would_block()) {
+                // Encode reschedules us when it takes a frame; check again
+                // in case it already did
+                p.motion_waiting = true;
+                if (p.analysed.would_block()) return;
+                p.motion_waiting = false;
+            }
+            FrameSlot* slot;
+            if (!p.captured.poll(slot, [this](FrameSlot* s) { p.frames.release(s); })) return;
+
+            process(slot);
+            if (p.analysed.push(slot, p.camera.running)) {
+                p.pool.schedule(p.encode_strand);
+            } else {
+                p.frames.release(slot);
+            }
+        }
+        if (p.captured.depth() > 0) p.pool.schedule(p.motion_strand);
+    }
 
-        // Subscribe to command topic
-        mqtt_client.subscribe("opensentry/" + CAMERA_ID + "/command", 1)->wait();
-        cout << "[MQTT] Subscribed to commands" << endl;
+private:
+    void process(FrameSlot* slot) {
+        allocs.begin();
 
-        // Announce online
-        mqtt_client.publish("opensentry/" + CAMERA_ID + "/status", create_status_json("online"), 0, false);
-        if(mdns_available) mdns_broadcaster.update_status("online");
-        mqtt_connected = true;
+        //Motion Detection
+        // Runs on a zero-copy view of the encoder's Y plane. Frames the
+        // scheduler passes over count as frames without motion; a frame that
+        // can't be analysed during an event (corrupt MJPEG) leaves it as is.
+        Rect combined_rect;
+        bool motion_detected = false;
+        bool analysed = prepare_analysis(slot);
+        bool holding = !analysed && motion_active;
+        if (analysed) {
+            motion_detected = detector.process(lumaPlane(slot->yuv), combined_rect);
+            p.metrics[Stage::MotionPrepare].record(detector.prepare_time());
+            p.metrics[Stage::MotionDetect].record(detector.detect_time());
+            p.metrics.frames_analysed.fetch_add(1, memory_order_relaxed);
+            event_zones |= detector.active_zones();
+            update_cadence(motion_detected || detector.saw_change(), slot->captured);
+
+            // Frames the scheduler or prefilter skipped have no tile counts
+            // of their own, so they stay out of the grid's average
+            if (activity.enabled()) {
+                int64_t now_ms = chrono::duration_cast<chrono::milliseconds>(
+                    chrono::system_clock::now().time_since_epoch()).count();
+                if (activity.add(detector.kernel().tile_counts(), motion_detected, now_ms, activity_frame) &&
+                    !p.events.activity(p.camera.index, activity_frame)) {
+                    activity.lost();
+                }
+            }
+        }
+        slot->motion = motion_detected;
+        slot->motion_rect = combined_rect;
+        slot->clip = p.recorder.clip_for_frame(motion_detected || holding, chrono::steady_clock::now());
+        if (slot->clip) last_clip = slot->clip;
+
+        if (motion_detected)
+        {
+            // Handle motion start event
+            if (!motion_active)
+            {
+                motion_active = true;
+                event_zones = detector.active_zones();
+                motion_start_time = time(nullptr);
+
+                // Copied before the box is drawn; the JPEG is made on a worker
+                uint32_t snapshot = p.snapshots.capture(slot->yuv, combined_rect, motion_start_time);
+                if (snapshot) p.pool.schedule(p.snapshot_strand);
+
+                // Published by the event thread; this only queues it
+                p.events.motion_start(p.camera.index, combined_rect.x, combined_rect.y,
+                                      combined_rect.width, combined_rect.height, event_zones, snapshot);
+                cout << "[Motion] " << p.camera.id << ": detected - published start event" << endl;
+            }
 
-    } catch (const mqtt::exception& exc) {
-        cerr << "[MQTT] Warning: " << exc.what() << endl;
-        cerr << "[MQTT] Continuing without MQTT - no remote control available" << endl;
-        if(mdns_available) mdns_broadcaster.update_status("streaming");
+            drawRectYuv(slot->yuv, combined_rect, 2);
+        }
+        else if (motion_active && !holding)
+        {
+            // No motion detected but was previously active - motion ended
+            motion_active = false;
+            int duration = time(nullptr) - motion_start_time;
+
+            // Clip is finished post-roll seconds after this event
+            p.events.motion_end(p.camera.index, duration, event_zones,
+                                last_clip ? p.recorder.clip_path(last_clip) : string());
+            cout << "[Motion] " << p.camera.id << ": ended after " << duration << " seconds" << endl;
+        }
+
+        allocs.end();
     }
 
-    // Start heartbeat thread only if MQTT is connected
-    thread heartbeat;
-    if(mqtt_connected) {
-        heartbeat = thread(mqtt_heartbeat_thread, ref(mqtt_client));
+    // Whether the frame gets a detailed look: every frame during an event
+    // or while the scheduler is active, otherwise on its idle cadence.
+    // MJPEG frames in between go through the DC prefilter, which pulls in
+    // any that changed, and are decoded if they are to be analysed.
+    bool prepare_analysis(FrameSlot* slot) {
+        bool wanted = motion_active || scheduler.due(slot->captured);
+        if (!slot->jpeg) return wanted;
+
+        if (!wanted && p.motion_config.prefilter_threshold > 0) {
+            // Frames the DC reader can't handle are always decoded
+            auto start = chrono::steady_clock::now();
+            wanted = !dc_reader.read(slot->jpeg->data, slot->jpeg_size, dc) || prefilter.changed(dc);
+            p.metrics[Stage::Prefilter].record_since(start);
+        }
+        if (!wanted) return false;
+
+        bool ok = decoder.decode(slot->jpeg->data, slot->jpeg_size, slot->yuv);
+        p.metrics[Stage::DecodeMotion].record(decoder.decode_time());
+        if (!ok) return false;  // Left for the encoder to skip
+        av_buffer_unref(&slot->jpeg);
+        return true;
     }
 
-    // Open camera
-    cout << "[Camera] Opening camera device /dev/video" << CAMERA_DEVICE_INDEX << "..." << endl;
-    VideoCapture camera(CAMERA_DEVICE_INDEX);
+    void update_cadence(bool change, chrono::steady_clock::time_point captured) {
+        bool was_idle = scheduler.idle();
+        scheduler.analysed(change, captured);
+        if (scheduler.idle() == was_idle) return;
+        p.metrics.detection_idle.store(scheduler.idle(), memory_order_relaxed);
+        p.metrics.cadence_changes.store(scheduler.transitions(), memory_order_relaxed);
+        // The prefilter skipped the busy stretch; compare against the scene as it is now
+        if (scheduler.idle()) prefilter.reset();
+    }
 
-    if (!camera.isOpened()) {
-        cerr << endl;
-        cerr << "========================================" << endl;
-        cerr << "  ERROR: Camera not found!" << endl;
-        cerr << "========================================" << endl;
-        cerr << "  Could not open /dev/video" << CAMERA_DEVICE_INDEX << endl;
-        cerr << endl;
-        cerr << "  Please check:" << endl;
-        cerr << "    1. Is your USB camera plugged in?" << endl;
-        cerr << "    2. Run: ls /dev/video*" << endl;
-        cerr << "    3. Check permissions: sudo usermod -aG video $USER" << endl;
-        cerr << endl;
-        cerr << "========================================" << endl;
-        cerr << endl;
-        if(mqtt_connected) mqtt_client.publish("opensentry/" + CAMERA_ID + "/status", create_status_json("error_no_camera"), 0, false);
-        if(mdns_available) mdns_broadcaster.update_status("error_no_camera");
-        
-        // Clean shutdown
-        running = false;
-        if(mqtt_connected) {
-            mqtt_client.disconnect()->wait();
-            heartbeat.join();
+    StreamPipeline& p;
+    MotionDetector detector;
+    ActivityGrid activity;        // Heatmap for opensentry/<id>/activity
+    ActivityFrame activity_frame;
+    // MJPEG capture: prefilter and the decoder for frames that pass it
+    JpegDcReader dc_reader;
+    DcPrefilter prefilter;
+    Mat dc;                       // 1/8-scale luma of the last frame read
+    MjpegDecoder decoder;
+    DetectionScheduler scheduler; // Idle or every-frame analysis
+    StageAllocProbe allocs;
+    bool motion_active;         // Track motion state
+    time_t motion_start_time;   // Track when motion started
+    int32_t last_clip;          // Clip of the current/last event, for motion_end
+    uint32_t event_zones;       // Every zone that saw motion during the event
+};
+
+class EncodeWorker {
+public:
+    explicit EncodeWorker(StreamPipeline& pipeline)
+        : p(pipeline), frame(av_frame_alloc()), have_paused_frame(false), previewCtx(nullptr),
+          pkt(av_packet_alloc()), clock(p.fps), allocs("encode"),
+          profile(p.codecCtx, p.encode_profile), quality(p.quality_config) {
+        // Frozen image re-encoded while paused. Only filled when a pause
+        // starts, so live streaming never copies frames.
+        frame->format = p.codecCtx->pix_fmt;
+        frame->width = p.codecCtx->width;
+        frame->height = p.codecCtx->height;
+        av_frame_get_buffer(frame, 0);
+    }
+
+    ~EncodeWorker() {
+        av_packet_free(&pkt);
+        av_frame_free(&frame);
+        sws_freeContext(previewCtx);
+    }
+
+    void run() {
+        for (int n = 0; n < STRAND_BATCH; n++) {
+            if (!p.camera.running) return;
+            FrameSlot* slot;
+            if (!p.analysed.poll(slot, [this](FrameSlot* s) { p.frames.release(s); })) return;
+            if (p.motion_waiting.exchange(false)) p.pool.schedule(p.motion_strand);
+
+            if (!encode(slot)) {
+                p.camera.running = false;
+                return;
+            }
         }
-        return -1;
+        if (p.analysed.depth() > 0) p.pool.schedule(p.encode_strand);
     }
 
-    // Get camera properties
-    int width = static_cast<int>(camera.get(CAP_PROP_FRAME_WIDTH));
-    int height = static_cast<int>(camera.get(CAP_PROP_FRAME_HEIGHT));
-    int fps = 30;
+private:
+    bool encode(FrameSlot* slot) {
+        allocs.begin();
+        bool live = p.camera.streaming;
+        AVFrame* toEncode = nullptr;
+
+        // Always encode and send frames to keep RTSP connection alive
+        // When paused, send the frame captured as the pause began (frozen image)
+        bool force_keyframe = false;
+        auto now = chrono::steady_clock::now();
+        if (live) {
+            have_paused_frame = false;
+            bool decoded = true;
+            if (profile.prepare(slot->yuv, slot->motion, slot->motion_rect)) {
+                decoded = decode_for_encode(slot);
+                if (decoded) {
+                    toEncode = slot->yuv;
+                    toEncode->pts = clock.pts(slot->captured, slot->arrived);
+                } else {
+                    profile.finish(slot->yuv);  // A corrupt MJPEG frame is skipped
+                }
+            }
+            // The substream keeps its own rate, whatever the idle profile skips
+            if (decoded && p.substream && p.substream->due(slot->captured) && decode_for_encode(slot) &&
+                p.substream->capture(slot->yuv, slot->captured, slot->arrived)) {
+                p.pool.schedule(p.substream_strand);
+            }
+        } else {
+            if (!have_paused_frame && decode_for_encode(slot)) {
+                av_frame_make_writable(frame);
+                av_frame_copy(frame, slot->yuv);
+                have_paused_frame = true;
+                force_keyframe = true;
+                next_keepalive = now;
+            }
+            if (now >= next_keepalive) {
+                toEncode = frame;
+                toEncode->pts = clock.pts_now(now);
+                next_keepalive = now + p.paused_keepalive_interval;
+                if (p.substream && p.substream->capture_frozen(frame, now, force_keyframe)) {
+                    p.pool.schedule(p.substream_strand);
+                }
+            }
+        }
 
-    cout << "[Camera] Opened: " << width << "x" << height << endl;
+        bool ok = true;
 
-    // Initialize FFmpeg
-    avformat_network_init();
+        if (toEncode) {
+            // The output queue wants an IDR after dropping a GOP or reconnecting
+            if (p.encoded.take_keyframe_request()) force_keyframe = true;
+            toEncode->pict_type = force_keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
 
-    // Create output format context for RTSP
-    AVFormatContext *outFormatCtx = nullptr;
-    string rtspURLStr = "rtsp://localhost:8554/" + CAMERA_ID;
-    const char *rtspURL = rtspURLStr.c_str();
+            // Only the codec calls are timed, not the hand-off to the writer
+            auto encode_start = chrono::steady_clock::now();
+            int ret = avcodec_send_frame(p.codecCtx, toEncode);
+            profile.finish(toEncode);
+            auto encode_time = chrono::steady_clock::now() - encode_start;
+            p.metrics.frames_encoded.fetch_add(1, memory_order_relaxed);
+            if (ret < 0) {
+                cerr << "[ERROR] Error sending frame" << endl;
+                ok = false;
+            }
 
-    avformat_alloc_output_context2(&outFormatCtx, nullptr, "rtsp", rtspURL);
-    if (!outFormatCtx) {
-        cerr << "[ERROR] Could not create output context" << endl;
-        return -1;
+            while (ok && ret >= 0) {
+                auto receive_start = chrono::steady_clock::now();
+                ret = avcodec_receive_packet(p.codecCtx, pkt);
+                encode_time += chrono::steady_clock::now() - receive_start;
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    break;
+                } else if (ret < 0) {
+                    cerr << "[ERROR] Error encoding" << endl;
+                    ok = false;
+                    break;
+                }
+
+                p.metrics.packets_encoded.fetch_add(1, memory_order_relaxed);
+                p.recorder.on_packet(pkt, slot->clip);
+                p.encoded.push(pkt);
+            }
+            p.metrics[Stage::Encode].record(encode_time);
+        }
+
+        // Undecoded MJPEG frames aren't worth decoding just for the window
+        if (p.display_enabled && !slot->jpeg) {
+            lock_guard<mutex> lock(p.preview_mutex);
+            AVFrame* src = slot->yuv;
+            previewCtx = sws_getCachedContext(previewCtx,
+                p.width, p.height, static_cast<AVPixelFormat>(src->format),
+                p.width, p.height, AV_PIX_FMT_BGR24,
+                SWS_BILINEAR, nullptr, nullptr, nullptr);
+            p.preview.create(p.height, p.width, CV_8UC3);
+            uint8_t* dst[] = {p.preview.data};
+            const int dstStride[] = {static_cast<int>(p.preview.step[0])};
+            sws_scale(previewCtx, src->data, src->linesize, 0, p.height, dst, dstStride);
+        }
+
+        p.frames.release(slot);
+        update_quality(now);
+        allocs.end();
+        return ok;
     }
 
-    // Find H.264 encoder
-    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
-    if (!codec) {
-        cerr << "[ERROR] H.264 codec not found" << endl;
-        return -1;
+    // MJPEG capture: decodes a frame motion didn't need in full. Returns
+    // false if it doesn't decode.
+    bool decode_for_encode(FrameSlot* slot) {
+        if (!slot->jpeg) return true;
+        bool ok = decoder.decode(slot->jpeg->data, slot->jpeg_size, slot->yuv);
+        p.metrics[Stage::DecodeEncode].record(decoder.decode_time());
+        if (ok) av_buffer_unref(&slot->jpeg);
+        return ok;
     }
 
-    // Create video stream
-    AVStream *outStream = avformat_new_stream(outFormatCtx, nullptr);
-    if (!outStream) {
-        cerr << "[ERROR] Failed to create stream" << endl;
-        return -1;
+    // Feeds the quality controller and applies a new rung. Runs on the
+    // encode strand, between frames, which is the only safe place to
+    // touch the codec settings.
+    void update_quality(chrono::steady_clock::time_point now) {
+        PressureSample sample;
+        sample.encode_us = p.metrics[Stage::Encode].total_us();
+        sample.frames_encoded = p.metrics.frames_encoded.load(memory_order_relaxed);
+        sample.write_us = p.metrics[Stage::Write].total_us();
+        sample.packets_written = p.metrics.packets_written.load(memory_order_relaxed);
+        sample.dropped = p.captured.dropped_count() + p.analysed.dropped_count();
+        sample.shed = p.encoded.dropped_count();
+        sample.backlog = p.encoded.depth();
+        sample.backlog_capacity = p.encoded.capacity();
+        if (!quality.update(sample, now)) return;
+
+        const QualityRung& rung = quality.rung();
+        quality.apply_bitrate(p.codecCtx);
+        profile.set_limits(rung.fps, rung.crf_offset);
+        cout << "[Quality] " << p.camera.id << ": rung " << quality.rung_index() + 1 << "/" << quality.rung_count()
+             << " (" << rung.fps << " fps, " << rung.max_kbps << " kbps) - " << quality.reason() << endl;
+        p.events.quality(p.camera.index, quality.report());
     }
 
-    // Create codec context
-    AVCodecContext *codecCtx = avcodec_alloc_context3(codec);
-    codecCtx->width = width;
-    codecCtx->height = height;
-    codecCtx->time_base = {1, fps};
-    codecCtx->framerate = {fps, 1};
-    codecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
-    codecCtx->codec_type = AVMEDIA_TYPE_VIDEO;
+    StreamPipeline& p;
+    AVFrame* frame;
+    bool have_paused_frame;
+    SwsContext* previewCtx;  // YUV -> BGR for the GUI window only
+    MjpegDecoder decoder;    // MJPEG capture only
+    AVPacket* pkt;
+    StreamClock clock;       // Capture timestamps -> PTS
+    StageAllocProbe allocs;
+    EncodeProfile profile;
+    QualityController quality;
+
+    // Paused mode state. The frozen frame goes out once as an IDR, then is
+    // re-encoded every paused_keepalive_interval; x264 turns those repeats
+    // into near-empty skip frames. Their PTS come from the wall clock so
+    // the sparse frames keep correct timing.
+    chrono::steady_clock::time_point next_keepalive;
+};
 
-    av_opt_set(codecCtx->priv_data, "preset", "ultrafast", 0);
-    av_opt_set(codecCtx->priv_data, "tune", "zerolatency", 0);
+StreamPipeline::StreamPipeline(CameraControl& cam, FrameSource& src, WorkerPool& workers,
+                               int w, int h, int rate, AVCodecContext* codec, StreamOutput& out,
+                               EventPublisher& publisher, bool display,
+                               const MotionConfig& motion_cfg, const EncodeProfileConfig& profile,
+                               const QualityControlConfig& quality, const RecorderConfig& clips,
+                               const SnapshotConfig& snapshot, const SubstreamConfig& sub,
+                               size_t depth, DropPolicy policy)
+    : camera(cam), source(src), pool(workers), width(w), height(h), fps(rate), codecCtx(codec),
+      output(out), events(publisher), display_enabled(display), motion_config(motion_cfg),
+      encode_profile(profile), quality_config(quality),
+      paused_keepalive_interval(intervalForFps(getEnvOrDefault("PAUSED_KEEPALIVE_FPS", "1"))),
+      paused_analysis_interval(intervalForFps(getEnvOrDefault("PAUSED_ANALYSIS_FPS", "5"))),
+      recorder(codec, cam.id, clips),
+      snapshots(snapshot, w, h, codec->pix_fmt),
+      captured(depth, policy), analysed(depth, policy),
+      frames(framesInFlight(depth, policy), w, h, src.slot_storage()),
+      encoded(2 * depth),
+      substream(sub.width > 0 ? new Substream(sub, w, h, codec->pix_fmt, 2 * depth, metrics) : nullptr),
+      motion(new MotionWorker(*this)), encoder(new EncodeWorker(*this)),
+      motion_strand([this] { motion->run(); }),
+      encode_strand([this] { encoder->run(); }),
+      snapshot_strand([this] {
+          snapshots.encode_pending([this](shared_ptr<const Snapshot> s) { events.snapshot(camera.index, move(s)); });
+      }),
+      substream_strand([this] {
+          if (!substream->encode_pending()) camera.running = false;
+      }) {}
+
+// Out of line: the workers are incomplete types in the declaration
+StreamPipeline::~StreamPipeline() {}
+
+// Connects an RTSP output that isn't reachable, retrying with backoff until
+// it works or the camera stops. The encoder keeps running meanwhile and the
+// output queue sheds what can't be sent. Once connected, stale packets are
+// dropped and the encoder is asked for an IDR, so the new session starts
+// on a keyframe straight away.
+bool retry_output(StreamPipeline& p, StreamSink& sink) {
+    auto backoff = chrono::milliseconds(500);
+    int attempts = 0;
+    while (p.camera.running) {
+        attempts++;
+        if (sink.output.reset() && sink.output.connect(sink.codec) == StreamOutput::Status::Ok) {
+            sink.queue.restart();
+            cout << "[Stream] " << p.camera.id << ": Connected " << sink.label << " after " << attempts << " attempt(s)" << endl;
+            if (sink.main) p.events.status(p.camera.index, "streaming");
+            return true;
+        }
+        auto until = chrono::steady_clock::now() + backoff;
+        while (p.camera.running && chrono::steady_clock::now() < until) {
+            this_thread::sleep_for(chrono::milliseconds(50));
+        }
+        backoff = min(backoff * 2, chrono::milliseconds(10000));
+    }
+    return false;
+}
+
+// Re-establishes a dropped RTSP session
+bool reconnect_output(StreamPipeline& p, StreamSink& sink) {
+    cerr << "[Stream] " << p.camera.id << ": Lost connection to " << sink.output.url() << ", reconnecting" << endl;
+    if (sink.main) p.events.status(p.camera.index, "reconnecting");
+    return retry_output(p, sink);
+}
 
-    if (outFormatCtx->oformat->flags & AVFMT_GLOBALHEADER) {
-        codecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+// One per encoded stream: the main stream and, if configured, the substream
+void write_stage(StreamPipeline& p, StreamSink sink) {
+    AVPacket* pkt;
+    StageAllocProbe allocs(sink.main ? "write" : "substream_write");
+    bool first_packet = sink.main;
+    while (sink.queue.pop(pkt, p.camera.running)) {
+        allocs.begin();
+        auto write_start = chrono::steady_clock::now();
+        int ret = sink.output.write(pkt);
+        p.metrics[sink.write_stage].record_since(write_start);
+        if (ret >= 0) sink.written.fetch_add(1, memory_order_relaxed);
+        sink.queue.recycle(pkt);
+        allocs.end();
+
+        if (ret >= 0 && first_packet) {
+            long long ms = millisSinceStart();
+            p.metrics.first_packet_ms.store(ms, memory_order_relaxed);
+            cout << "[Startup] " << p.camera.id << ": First packet sent at " << ms << " ms" << endl;
+            first_packet = false;
+        }
+        if (ret < 0) {
+            if (!p.camera.running) break;
+            if (sink.output.reconnectable() && reconnect_output(p, sink)) continue;
+            cerr << "[ERROR] " << p.camera.id << ": Error writing " << sink.label << " frame" << endl;
+            p.camera.running = false;
+            break;
+        }
     }
+}
 
-    if (avcodec_open2(codecCtx, codec, nullptr) < 0) {
-        cerr << "[ERROR] Could not open codec" << endl;
-        return -1;
+// ============================================================================
+// Camera sessions
+// ============================================================================
+// Settings shared by every camera, read once from the environment
+struct NodeConfig {
+    int fps = 30;
+    SourceConfig source;
+    size_t queue_depth = 4;
+    DropPolicy drop_policy = DropPolicy::DropOldest;
+    bool display_enabled = false;
+    MotionConfig motion;
+    EncodeProfileConfig encode_profile;
+    QualityControlConfig quality;
+    RecorderConfig clips;
+    SnapshotConfig snapshot;
+    string stream_output = "rtsp";
+    chrono::milliseconds output_timeout{5000};  // Longest a connect or write may block
+    int encoder_threads = 0;  // x264 threads per camera (0 = x264 decides)
+    SubstreamConfig substream;
+};
+
+// Where a camera's stream goes for a STREAM_OUTPUT setting: RTSP to
+// MediaMTX at the camera id plus `suffix` ("" for the main stream), or a
+// file / the null muxer when profiling. Sets `format` to the muxer (null to
+// guess it from the file extension).
+string outputTarget(const string& stream_output, const string& camera_id, const string& suffix,
+                    const char*& format) {
+    if (stream_output == "null") {
+        format = "null";
+        return "null";
     }
+    if (stream_output.compare(0, 5, "file:") == 0) {
+        string file = stream_output.substr(5);
+        size_t id_at = file.find("{id}");
+        if (id_at != string::npos) {
+            file.replace(id_at, 4, camera_id + suffix);
+        } else if (!suffix.empty()) {
+            // Keeps the substream out of the main stream's file: name_sub.mp4
+            size_t dot = file.rfind('.');
+            size_t slash = file.rfind('/');
+            bool extension = dot != string::npos && (slash == string::npos || dot > slash);
+            file.insert(extension ? dot : file.size(), suffix);
+        }
+        format = nullptr;
+        return file;
+    }
+    format = "rtsp";
+    return "rtsp://localhost:8554/" + camera_id + suffix;
+}
 
-    avcodec_parameters_from_context(outStream->codecpar, codecCtx);
-    outStream->time_base = codecCtx->time_base;
+// Process-wide services the sessions share. The broadcaster may still be
+// starting; it takes status updates either way.
+struct NodeServices {
+    EventPublisher& events;
+    CameraMDNSBroadcaster& mdns_broadcaster;
+    WorkerPool& pool;
+};
 
-    if (!(outFormatCtx->oformat->flags & AVFMT_NOFILE)) {
-        int ret = avio_open(&outFormatCtx->pb, rtspURL, AVIO_FLAG_WRITE);
-        if (ret < 0) {
+// RTSP path suffix of a camera's substream
+const char* const SUBSTREAM_SUFFIX = "_sub";
+
+// One camera: its frame source, encoder, output and pipeline
+struct CameraSession {
+    CameraControl& camera;
+    const NodeConfig& node;
+    NodeServices& services;
+
+    unique_ptr<FrameSource> source;
+    AVCodecContext* codecCtx = nullptr;
+    unique_ptr<StreamOutput> output;
+    unique_ptr<StreamOutput> substream_output;
+    unique_ptr<StreamPipeline> pipeline;
+    thread capture_thread;
+    thread write_thread;
+    thread substream_write_thread;
+
+    CameraSession(CameraControl& cam, const NodeConfig& config, NodeServices& shared)
+        : camera(cam), node(config), services(shared) {}
+
+    ~CameraSession() {
+        pipeline.reset();
+        output.reset();  // Writes the trailer
+        substream_output.reset();
+        avcodec_free_context(&codecCtx);
+        if (source) source->stop();
+    }
+
+    void report_status(const char* mqtt_status, const string& mdns_status) {
+        services.events.status(camera.index, mqtt_status);
+        services.mdns_broadcaster.update_status(camera.id, mdns_status);
+    }
+
+    // Opens the source and encoder and creates the output; the output
+    // connects once the stages run (see stream_main_output()). On failure the
+    // error is reported as the camera's status and the session is left
+    // unused.
+    bool open() {
+        SourceConfig source_config = node.source;
+        source_config.device_index = camera.device_index;
+
+        // Open frame source
+        if (source_config.kind == "camera") {
+            cout << "[Camera] " << camera.id << ": Opening camera device /dev/video" << camera.device_index << "..." << endl;
+        }
+        source = openFrameSource(source_config);
+
+        if (!source && source_config.kind == "camera") {
             cerr << endl;
             cerr << "========================================" << endl;
-            cerr << "  ERROR: Cannot connect to RTSP server!" << endl;
+            cerr << "  ERROR: Camera not found!" << endl;
             cerr << "========================================" << endl;
-            cerr << "  Could not connect to: " << rtspURL << endl;
+            cerr << "  Could not open /dev/video" << camera.device_index << endl;
             cerr << endl;
             cerr << "  Please check:" << endl;
-            cerr << "    1. Is MediaMTX running?" << endl;
-            cerr << "       Start it with: ./mediamtx" << endl;
-            cerr << "    2. Is port 8554 available?" << endl;
-            cerr << "       Check with: netstat -tlnp | grep 8554" << endl;
+            cerr << "    1. Is your USB camera plugged in?" << endl;
+            cerr << "    2. Run: ls /dev/video*" << endl;
+            cerr << "    3. Check permissions: sudo usermod -aG video $USER" << endl;
             cerr << endl;
             cerr << "========================================" << endl;
             cerr << endl;
-            
-            // Clean shutdown
-            if(mqtt_connected) mqtt_client.publish("opensentry/" + CAMERA_ID + "/status", create_status_json("error_no_rtsp_server"), 0, false);
-            if(mdns_available) mdns_broadcaster.update_status("error");
-            running = false;
-            if(mqtt_connected) heartbeat.join();
-            camera.release();
-            avcodec_free_context(&codecCtx);
-            avformat_free_context(outFormatCtx);
-            if(mqtt_connected) mqtt_client.disconnect()->wait();
-            if(mdns_available) mdns_broadcaster.stop();
-            return -1;
         }
+        if (!source) {
+            report_status("error_no_camera", "error_no_camera");
+            return false;
+        }
+
+        // Get source properties
+        int width = source->width();
+        int height = source->height();
+
+        cout << "[Source] " << camera.id << ": Opened " << width << "x" << height << " (" << source->description() << ")"
+             << (source_config.replay ? ", replay" : "") << endl;
+        cout << "[Startup] " << camera.id << ": Source ready at " << millisSinceStart() << " ms" << endl;
+
+        // Create output format context: RTSP to MediaMTX, or a file / the null
+        // muxer when profiling
+        const char *outputFormat;
+        string rtspURLStr = outputTarget(node.stream_output, camera.id, "", outputFormat);
+
+        output.reset(new StreamOutput(rtspURLStr, outputFormat, node.output_timeout, camera.running));
+        if (!output->create()) {
+            cerr << "[ERROR] Could not create output context" << endl;
+            return false;
+        }
+
+        // Find H.264 encoder
+        const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+        if (!codec) {
+            cerr << "[ERROR] H.264 codec not found" << endl;
+            return false;
+        }
+
+        // Create codec context
+        codecCtx = avcodec_alloc_context3(codec);
+        codecCtx->width = width;
+        codecCtx->height = height;
+        // PTS come from capture timestamps, so the time base is fine-grained
+        // and the frame rate is only nominal
+        codecCtx->time_base = StreamClock::kTimeBase;
+        codecCtx->framerate = {node.fps, 1};
+        // NV12 cameras feed x264 directly; everything else is encoded as YUV420P
+        codecCtx->pix_fmt = source->pixel_format();
+        codecCtx->codec_type = AVMEDIA_TYPE_VIDEO;
+        codecCtx->thread_count = node.encoder_threads;
+
+        av_opt_set(codecCtx->priv_data, "preset", "ultrafast", 0);
+        av_opt_set(codecCtx->priv_data, "tune", "zerolatency", 0);
+        // Forced keyframes (pause start) are real IDRs, decodable on their own
+        av_opt_set(codecCtx->priv_data, "forced-idr", "1", 0);
+        av_opt_set(codecCtx->priv_data, "crf", to_string(node.encode_profile.active_crf).c_str(), 0);
+        // x264 ignores ROI side data unless adaptive quantisation is on, which
+        // the ultrafast preset turns off
+        if (node.encode_profile.roi_qoffset != 0) {
+            av_opt_set(codecCtx->priv_data, "aq-mode", "variance", 0);
+        }
+        QualityController(node.quality).configure_codec(codecCtx);
+
+        if (output->needs_global_header()) {
+            codecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+
+        if (avcodec_open2(codecCtx, codec, nullptr) < 0) {
+            cerr << "[ERROR] Could not open codec" << endl;
+            return false;
+        }
+
+        cout << "[Startup] " << camera.id << ": Encoder ready at " << millisSinceStart() << " ms" << endl;
+
+        pipeline.reset(new StreamPipeline(camera, *source, services.pool, width, height, node.fps,
+                                          codecCtx, *output,
+                                          services.events,
+                                          node.display_enabled, node.motion, node.encode_profile,
+                                          node.quality, node.clips, node.snapshot, node.substream,
+                                          node.queue_depth, node.drop_policy));
+        if (pipeline->substream && !open_substream()) {
+            // Carry on with the main stream alone
+            pipeline->substream.reset();
+        }
+        return true;
     }
 
-    int headerRet = avformat_write_header(outFormatCtx, nullptr);
-    if (headerRet < 0) {
+    // Opens the substream's encoder and creates its output, which connects
+    // on the substream's write thread. Failures are logged; the camera
+    // keeps streaming without it.
+    bool open_substream() {
+        Substream& sub = *pipeline->substream;
+        const char* format;
+        string url = outputTarget(node.stream_output, camera.id, SUBSTREAM_SUFFIX, format);
+        substream_output.reset(new StreamOutput(url, format, node.output_timeout, camera.running));
+        // One x264 thread: a few hundred thousand pixels per frame at a low
+        // rate never needs more, and it keeps the substream off the
+        // main encoder's cores
+        if (!substream_output->create() || !sub.open(substream_output->needs_global_header(), 1)) {
+            cerr << "[Substream] " << camera.id << ": Cannot set up the substream" << endl;
+            substream_output.reset();
+            return false;
+        }
+        pipeline->substream_output = substream_output.get();
+        return true;
+    }
+
+    // Capture and encoding start straight away; each write thread connects
+    // its output first, so the camera and encoder warm up while MediaMTX
+    // answers (or comes up)
+    void start() {
+        capture_thread = thread(capture_stage, ref(*pipeline));
+        write_thread = thread(&CameraSession::stream_main_output, this);
+        if (pipeline->substream) {
+            substream_write_thread = thread(&CameraSession::stream_substream_output, this);
+        }
+    }
+
+    // Main stream write thread. An RTSP server that isn't up yet is retried
+    // like a dropped connection, without stopping capture; an output that
+    // can't be reconnected (a file) ends the camera.
+    void stream_main_output() {
+        StreamSink sink = pipeline->main_sink();
+        StreamOutput::Status status = output->connect(codecCtx);
+        if (status != StreamOutput::Status::Ok) {
+            report_connect_error(status);
+            if (status == StreamOutput::Status::NoMuxer || !output->reconnectable() ||
+                !retry_output(*pipeline, sink)) {
+                camera.running = false;
+                return;
+            }
+        }
+        cout << "[Stream] " << camera.id << ": Streaming to " << output->url() << endl;
+        cout << "[Startup] " << camera.id << ": Output connected at " << millisSinceStart() << " ms" << endl;
+        report_status("streaming", "streaming");
+        write_stage(*pipeline, sink);
+    }
+
+    void report_connect_error(StreamOutput::Status status) {
+        const string& url = output->url();
+        if (status == StreamOutput::Status::NoMuxer) {
+            cerr << "[ERROR] Failed to create stream" << endl;
+            return;
+        }
+        if (status == StreamOutput::Status::CannotOpen) {
+            if (node.stream_output != "rtsp") {
+                cerr << "[ERROR] Cannot open output file " << url << endl;
+            } else {
+                cerr << endl;
+                cerr << "========================================" << endl;
+                cerr << "  ERROR: Cannot connect to RTSP server!" << endl;
+                cerr << "========================================" << endl;
+                cerr << "  Could not connect to: " << url << endl;
+                cerr << endl;
+                cerr << "  Please check:" << endl;
+                cerr << "    1. Is MediaMTX running?" << endl;
+                cerr << "       Start it with: ./mediamtx" << endl;
+                cerr << "    2. Is port 8554 available?" << endl;
+                cerr << "       Check with: netstat -tlnp | grep 8554" << endl;
+                cerr << endl;
+                cerr << "  Capture keeps running; retrying..." << endl;
+                cerr << "========================================" << endl;
+                cerr << endl;
+            }
+
+            report_status("error_no_rtsp_server", "error");
+            return;
+        }
         cerr << endl;
         cerr << "========================================" << endl;
         cerr << "  ERROR: Failed to initialize stream!" << endl;
         cerr << "========================================" << endl;
-        cerr << "  Could not write RTSP header to: " << rtspURL << endl;
+        cerr << "  Could not write RTSP header to: " << url << endl;
         cerr << endl;
         cerr << "  This usually means MediaMTX rejected" << endl;
         cerr << "  the connection or isn't running." << endl;
@@ -614,207 +1497,423 @@ int main()
         cerr << endl;
         cerr << "========================================" << endl;
         cerr << endl;
-        
-        // Clean shutdown
-        if(mqtt_connected) mqtt_client.publish("opensentry/" + CAMERA_ID + "/status", create_status_json("error_stream_init"), 0, false);
-        if(mdns_available) mdns_broadcaster.update_status("error");
-        running = false;
-        if(mqtt_connected) heartbeat.join();
-        camera.release();
-        avcodec_free_context(&codecCtx);
-        if (outFormatCtx->pb) avio_closep(&outFormatCtx->pb);
-        avformat_free_context(outFormatCtx);
-        if(mqtt_connected) mqtt_client.disconnect()->wait();
-        if(mdns_available) mdns_broadcaster.stop();
-        return -1;
+
+        report_status("error_stream_init", "error");
     }
 
-    cout << "[Stream] Streaming to: " << rtspURL << endl;
-    if(mqtt_connected) mqtt_client.publish("opensentry/" + CAMERA_ID + "/status", create_status_json("streaming"), 0, false);
-    if(mdns_available) mdns_broadcaster.update_status("streaming");
+    // Substream write thread: retries like the main stream, but gives up
+    // quietly on an output that can't be reconnected
+    void stream_substream_output() {
+        Substream& sub = *pipeline->substream;
+        StreamSink sink = pipeline->substream_sink();
+        const string& url = substream_output->url();
+        if (substream_output->connect(sub.codec()) != StreamOutput::Status::Ok) {
+            cerr << "[Substream] " << camera.id << ": Cannot connect to " << url
+                 << (substream_output->reconnectable() ? ", retrying" : ", no substream") << endl;
+            if (!substream_output->reconnectable() || !retry_output(*pipeline, sink)) return;
+        }
 
-    AVFrame *frame = av_frame_alloc();
-    frame->format = codecCtx->pix_fmt;
-    frame->width = codecCtx->width;
-    frame->height = codecCtx->height;
-    av_frame_get_buffer(frame, 0);
+        cout << "[Substream] " << camera.id << ": " << sub.width() << "x" << sub.height() << " at "
+             << sub.fps() << " fps to " << url << endl;
+        services.mdns_broadcaster.set_substream(camera.id, camera.id + SUBSTREAM_SUFFIX,
+                                                sub.width(), sub.height(), sub.fps());
+        write_stage(*pipeline, sink);
+    }
 
-    SwsContext *swsCtx = sws_getContext(
-        width, height, AV_PIX_FMT_BGR24,
-        width, height, AV_PIX_FMT_YUV420P,
-        SWS_BILINEAR, nullptr, nullptr, nullptr
-    );
+    // Stops the stages once camera.running is false and reports offline
+    void join() {
+        capture_thread.join();
+        write_thread.join();
+        if (substream_write_thread.joinable()) substream_write_thread.join();
+        // Nothing schedules the strands any more; let queued runs finish
+        while (!pipeline->motion_strand.idle() || !pipeline->encode_strand.idle() ||
+               !pipeline->snapshot_strand.idle() || !pipeline->substream_strand.idle()) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        pipeline->recorder.stop();
+
+        cout << "[Pipeline] " << camera.id << ": Dropped frames: capture->motion " << pipeline->captured.dropped_count()
+             << ", motion->encode " << pipeline->analysed.dropped_count()
+             << "; packets encode->write " << pipeline->encoded.dropped_count()
+             << " (" << pipeline->encoded.dropped_gops() << " GOP drops)" << endl;
+        if (pipeline->substream) {
+            cout << "[Pipeline] " << camera.id << ": Substream: " << pipeline->substream->skipped_count()
+                 << " frames skipped (encoder busy), packets dropped "
+                 << pipeline->substream->output_queue().dropped_count() << endl;
+        }
+        report_status("offline", "offline");
+    }
+};
 
-    AVPacket *pkt = av_packet_alloc();
-    Mat cvFrame;
-    Mat lastFrame;  // Store last frame for pause state
-    int64_t frameNum = 0;
-    Mat prev_gray;  // Store previous grayscale frame for motion detection
-    bool first_frame = true;  // Flag for first frame initialization
+// Publishes stage latencies, effective fps, drops and queue depths of every
+// camera each interval, and refreshes the Prometheus text file if one is
+// configured
+void metrics_thread_main(const vector<StreamPipeline*>& pipelines, chrono::seconds interval,
+                         mqtt::async_client* mqtt_client, const string& prometheus_path) {
+    vector<unique_ptr<MetricsReporter>> reporters;
+    vector<const MetricsReporter*> all;
+    for (StreamPipeline* p : pipelines) {
+        reporters.emplace_back(new MetricsReporter(p->metrics, p->camera.id));
+        all.push_back(reporters.back().get());
+    }
 
+    auto next_report = chrono::steady_clock::now() + interval;
     while (running) {
-        camera >> cvFrame;
+        // Short sleeps so shutdown isn't held up by a long interval
+        this_thread::sleep_for(chrono::milliseconds(200));
+        if (chrono::steady_clock::now() < next_report) continue;
+        next_report += interval;
+
+        for (size_t i = 0; i < pipelines.size(); i++) {
+            StreamPipeline& p = *pipelines[i];
+            vector<QueueStats> queues = {
+                {"capture_motion", p.captured.depth(), p.captured.capacity(), p.captured.dropped_count()},
+                {"motion_encode", p.analysed.depth(), p.analysed.capacity(), p.analysed.dropped_count()},
+                {"encode_write", p.encoded.depth(), p.encoded.capacity(), p.encoded.dropped_count()},
+            };
+            if (p.substream) {
+                const OutputQueue& q = p.substream->output_queue();
+                queues.push_back({"substream_write", q.depth(), q.capacity(), q.dropped_count()});
+            }
+            reporters[i]->sample(queues);
+            if (mqtt_client && mqtt_client->is_connected()) {
+                mqtt_client->publish("opensentry/" + p.camera.id + "/metrics", reporters[i]->json(), 0, false);
+            }
+        }
+        if (!prometheus_path.empty() && !MetricsReporter::write_prometheus(prometheus_path, all)) {
+            cerr << "[Metrics] Cannot write " << prometheus_path << endl;
+        }
+    }
+}
 
-        if (cvFrame.empty()) {
-            cerr << "[ERROR] Empty frame" << endl;
-            break;
+int main()
+{
+    // Initialize configuration from environment variables
+    MQTT_SERVER = getEnvOrDefault("MQTT_SERVER", "tcp://localhost:1883");
+
+    // Convert tls:// to ssl:// for MQTT library compatibility
+    if (MQTT_SERVER.find("tls://") == 0) {
+        MQTT_SERVER = "ssl://" + MQTT_SERVER.substr(6);
+        cout << "[Config] Converting TLS URL to SSL for MQTT library" << endl;
+    }
+
+    // Cameras: CAMERAS lists several as id:device[:name]; otherwise one
+    // camera from CAMERA_ID / CAMERA_NAME / CAMERA_DEVICE
+    vector<unique_ptr<CameraControl>> cameras = parseCameras(getEnvOrDefault("CAMERAS", ""));
+    if (cameras.empty()) {
+        unique_ptr<CameraControl> camera(new CameraControl());
+        camera->id = getEnvOrDefault("CAMERA_ID", "camera1");
+        camera->name = getEnvOrDefault("CAMERA_NAME", "OpenSentry Camera 1");
+
+        // Parse camera device - extract index from /dev/video0 format or use directly
+        string cameraDeviceStr = getEnvOrDefault("CAMERA_DEVICE", "/dev/video0");
+        if (cameraDeviceStr.find("/dev/video") == 0) {
+            camera->device_index = stoi(cameraDeviceStr.substr(10));
+        } else {
+            camera->device_index = stoi(cameraDeviceStr);
         }
+        cameras.push_back(move(camera));
+    }
 
-        //Motion Detection
-        Mat gray, frame_diff, thresh;
-        cvtColor(cvFrame, gray, COLOR_BGR2GRAY);
-        GaussianBlur(gray, gray, Size(21, 21), 0);
+    CLIENT_ID = "opensentry_node_" + cameras[0]->id;
 
-        if (!first_frame)
-        {
-            absdiff(prev_gray, gray, frame_diff);
-            threshold(frame_diff, thresh, 25, 255, THRESH_BINARY);
-            dilate(thresh, thresh, Mat(), Point(-1, -1), 2);
+    // Credential derivation: use OPENSENTRY_SECRET if set, otherwise fall back to individual credentials
+    string opensentry_secret = getEnvOrDefault("OPENSENTRY_SECRET", "");
+    if (!opensentry_secret.empty()) {
+        cout << "[Config] Using derived credentials from OPENSENTRY_SECRET" << endl;
+        MQTT_USERNAME = "opensentry";
+        MQTT_PASSWORD = deriveCredential(opensentry_secret, "mqtt");
+    } else {
+        MQTT_USERNAME = getEnvOrDefault("MQTT_USERNAME", "opensentry");
+        MQTT_PASSWORD = getEnvOrDefault("MQTT_PASSWORD", "opensentry");
+    }
 
-            vector<vector<Point>> contours;
-            findContours(thresh, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+    cout << "========================================" << endl;
+    cout << "  OpenSentry Camera Node - " << cameras[0]->id
+         << (cameras.size() > 1 ? " (+" + to_string(cameras.size() - 1) + " more)" : "") << endl;
+    cout << "========================================" << endl;
+    for (const auto& camera : cameras) {
+        cout << "  Camera: " << camera->id << " \"" << camera->name << "\" on /dev/video" << camera->device_index << endl;
+    }
+    cout << "  MQTT: " << MQTT_SERVER << endl;
+    cout << "========================================" << endl;
 
-            bool motion_detected = false;
-            vector<Point> all_points;
-            for (const auto& c: contours)
-            {
-                if (contourArea(c) >= 500)
-                {
-                    motion_detected = true;
-                    all_points.insert(all_points.end(), c.begin(), c.end());
-                }
-            }
-            if (motion_detected)
-            {
-                Rect combined_rect = boundingRect(all_points);
-                rectangle(cvFrame, combined_rect, Scalar(0, 0, 255), 2);
-
-                // Handle motion start event
-                if (!motion_active)
-                {
-                    motion_active = true;
-                    motion_start_time = time(nullptr);
-                    
-                    // Publish motion start event with metadata
-                    if (mqtt_connected)
-                    {
-                        // Create JSON payload with motion details
-                        string motion_payload = "{"
-                            "\"event\": \"motion_start\","
-                            "\"timestamp\": " + to_string(motion_start_time) + ","
-                            "\"area_x\": " + to_string(combined_rect.x) + ","
-                            "\"area_y\": " + to_string(combined_rect.y) + ","
-                            "\"area_width\": " + to_string(combined_rect.width) + ","
-                            "\"area_height\": " + to_string(combined_rect.height) + ""
-                            "}";
-                        mqtt_client.publish("opensentry/" + CAMERA_ID + "/motion", motion_payload, 0, false);
-                        cout << "[Motion] Detected - published start event" << endl;
-                    }
-                }
-            }
-            else if (motion_active)
-            {
-                // No motion detected but was previously active - motion ended
-                motion_active = false;
-                time_t motion_end_time = time(nullptr);
-                int duration = motion_end_time - motion_start_time;
-                
-                // Publish motion end event
-                if (mqtt_connected)
-                {
-                    string motion_payload = "{"
-                        "\"event\": \"motion_end\","
-                        "\"timestamp\": " + to_string(motion_end_time) + ","
-                        "\"duration\": " + to_string(duration) + ""
-                        "}";
-                    mqtt_client.publish("opensentry/" + CAMERA_ID + "/motion", motion_payload, 0, false);
-                    cout << "[Motion] Ended after " << duration << " seconds" << endl;
-                }
-            }
-        }
-        prev_gray = gray.clone();
-        if (first_frame) first_frame = false;
+    // Initialize mDNS broadcaster: one service per camera
+    CameraMDNSBroadcaster mdns_broadcaster(8322);  // RTSPS port (encrypted)
+    for (const auto& camera : cameras) {
+        mdns_broadcaster.add_camera(camera->id, camera->name, camera->id);
+    }
+    g_mdns_broadcaster = &mdns_broadcaster;
 
-        // Store the current frame for pause state
-        if (streaming) {
-            lastFrame = cvFrame.clone();
+    // Avahi comes up in the background while the cameras open; discovery
+    // isn't needed for the first frame
+    thread mdns_start([&mdns_broadcaster] {
+        if(!mdns_broadcaster.start()) {
+            cerr << "[WARNING] mDNS broadcaster failed to start - continuing without discovery" << endl;
+            cerr << "[WARNING] Camera will still stream but won't be auto-discovered" << endl;
+        } else {
+            cout << "[Startup] mDNS started at " << millisSinceStart() << " ms" << endl;
         }
+    });
 
-        // Always encode and send frames to keep RTSP connection alive
-        // When paused, send the last captured frame (frozen image)
-        Mat& frameToSend = streaming ? cvFrame : lastFrame;
-        
-        if (!frameToSend.empty()) {
-            const int stride[] = {static_cast<int>(frameToSend.step[0])};
-            sws_scale(swsCtx, &frameToSend.data, stride, 0, height, frame->data, frame->linesize);
+    // Setup MQTT: one connection for every camera
+    mqtt::async_client mqtt_client(MQTT_SERVER, CLIENT_ID);
 
-            frame->pts = frameNum++;
+    // Camera events (status, motion, quality) go through one publisher
+    // thread, so no stage ever waits on the broker
+    PublisherConfig publisher_config;
+    publisher_config.coalesce = chrono::milliseconds(static_cast<int64_t>(stod(getEnvOrDefault("MQTT_COALESCE", "1")) * 1000));
+    publisher_config.spool_path = getEnvOrDefault("MQTT_SPOOL", "");
+    publisher_config.spool_max_bytes = static_cast<size_t>(stoul(getEnvOrDefault("MQTT_SPOOL_MAX_KB", "1024"))) * 1024;
+    publisher_config.snapshot_cache = static_cast<size_t>(max(1, stoi(getEnvOrDefault("SNAPSHOT_CACHE", "8"))));
+    // Per-camera motion event logs: store-and-forward and time-window queries
+    publisher_config.log_dir = getEnvOrDefault("EVENT_LOG_DIR", "");
+    publisher_config.log_max_bytes = static_cast<size_t>(stoul(getEnvOrDefault("EVENT_LOG_MAX_KB", "1024"))) * 1024;
+    EventPublisher events(mqtt_client, publisher_config);
+    vector<ZoneSpec> motion_zones = parseZones(getEnvOrDefault("MOTION_ZONES", ""));
+    for (const auto& camera : cameras) {
+        camera->index = events.add_camera(camera->id, zoneNames(motion_zones));
+    }
+    MQTTCallback callback(cameras, events);
+    mqtt_client.set_callback(callback);
 
-            int ret = avcodec_send_frame(codecCtx, frame);
-            if (ret < 0) {
-                cerr << "[ERROR] Error sending frame" << endl;
-                break;
-            }
+    mqtt::connect_options connOpts;
+    connOpts.set_keep_alive_interval(20);
+    connOpts.set_clean_session(true);
+    connOpts.set_automatic_reconnect(true);  // Auto-reconnect on connection loss
+    connOpts.set_automatic_reconnect(1, 30); // Min 1s, max 30s backoff
+    connOpts.set_user_name(MQTT_USERNAME);
+    connOpts.set_password(MQTT_PASSWORD);
 
-            while (ret >= 0) {
-                ret = avcodec_receive_packet(codecCtx, pkt);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    cerr << "[ERROR] Error encoding" << endl;
-                    goto cleanup;
-                }
+    // Configure TLS if using tls:// or ssl:// protocol
+    if (MQTT_SERVER.find("tls://") == 0 || MQTT_SERVER.find("ssl://") == 0) {
+        cout << "[MQTT] Configuring TLS connection" << endl;
+        mqtt::ssl_options sslopts;
+        sslopts.set_verify(0); // Don't verify the server certificate
+        sslopts.set_enable_server_cert_auth(false);
+        connOpts.set_ssl(sslopts);
+    }
 
-                av_packet_rescale_ts(pkt, codecCtx->time_base, outStream->time_base);
-                pkt->stream_index = outStream->index;
+    // Bounds each connect attempt, so shutdown never waits out Paho's
+    // default 30 s on an unreachable broker
+    connOpts.set_connect_timeout(5);
+
+    // The publisher runs from the start and the broker connects in the
+    // background: until it answers, motion events are logged or spooled
+    // if configured and the latest status waits to be sent
+    bool store_and_forward = !publisher_config.log_dir.empty();
+    events.start();
+    for (const auto& camera : cameras) {
+        events.status(camera->index, "online");
+    }
+    thread heartbeat(mqtt_heartbeat_thread, ref(events), cref(cameras));
+    thread broker(mqtt_connect_thread, ref(mqtt_client), connOpts, cref(cameras), cref(events),
+                  store_and_forward);
+
+    NodeConfig node;
+
+    // Cameras are asked for this rate; anything delivering faster is thinned
+    // to it at capture
+    node.fps = max(1, stoi(getEnvOrDefault("STREAM_FPS", "30")));
+
+    // Frame source: the camera, or file/pipe/synthetic input for
+    // reproducing and profiling without hardware
+    node.source.kind = getEnvOrDefault("SOURCE", "camera");
+    node.source.capture_backend = getEnvOrDefault("CAPTURE_BACKEND", "auto");
+    node.source.path = getEnvOrDefault("SOURCE_PATH", "");
+    sscanf(getEnvOrDefault("SOURCE_SIZE", "1280x720").c_str(), "%dx%d",
+           &node.source.width, &node.source.height);
+    node.source.fps = node.fps;
+    node.source.frame_limit = stoll(getEnvOrDefault("SOURCE_FRAMES", "0"));
+    node.source.replay = getEnvOrDefault("REPLAY", "0") == "1";
+    node.source.objects = getEnvOrDefault("SYNTHETIC_OBJECTS", "40,40,96,96,3,2;0,300,160,80,1,0,150,600");
+
+    // Pipeline configuration
+    node.queue_depth = static_cast<size_t>(max(1, stoi(getEnvOrDefault("PIPELINE_QUEUE_DEPTH", "4"))));
+    // Replays process every frame so runs are repeatable
+    node.drop_policy = parseDropPolicy(getEnvOrDefault("PIPELINE_DROP_POLICY",
+                                                       node.source.replay ? "block" : "drop_oldest"));
+    node.display_enabled = getenv("DISPLAY") != nullptr;
+    // Zero-copy slots hold driver buffers, so the driver needs one for every
+    // frame the pipeline can hold plus two of its own to keep capturing into
+    node.source.v4l2_buffers = static_cast<unsigned>(framesInFlight(node.queue_depth, node.drop_policy) + 2);
+
+    // Motion detection configuration
+    node.motion.analysis_width = stoi(getEnvOrDefault("MOTION_ANALYSIS_WIDTH", "320"));
+    node.motion.threshold = stoi(getEnvOrDefault("MOTION_THRESHOLD", "25"));
+    node.motion.min_area = stoi(getEnvOrDefault("MOTION_MIN_AREA", "500"));
+    node.motion.mode = parseMotionMode(getEnvOrDefault("MOTION_MODE", "diff"));
+    // Learning rate as a fraction per frame, rounded to a power of two
+    double learning_rate = stod(getEnvOrDefault("MOTION_LEARNING_RATE", "0.02"));
+    if (learning_rate > 0) {
+        node.motion.learning_shift = static_cast<int>(lround(-log2(learning_rate)));
+    }
+    node.motion.sigma_k = stod(getEnvOrDefault("MOTION_SIGMA", "2.5"));
+    node.motion.zones = motion_zones;
+    node.motion.activity_frames = stoi(getEnvOrDefault("ACTIVITY_FRAMES", "0"));
+    node.motion.idle_fps = stoi(getEnvOrDefault("MOTION_IDLE_FPS", "5"));
+    node.motion.idle_after_ms = static_cast<int>(stod(getEnvOrDefault("MOTION_IDLE_AFTER", "3")) * 1000);
+    node.motion.prefilter_threshold = stoi(getEnvOrDefault("MJPEG_PREFILTER_THRESHOLD", "6"));
+
+    // Motion-adaptive encoding
+    node.encode_profile.active_crf = stoi(getEnvOrDefault("ENCODE_ACTIVE_CRF", "23"));
+    node.encode_profile.idle_crf = stoi(getEnvOrDefault("ENCODE_IDLE_CRF", "30"));
+    node.encode_profile.idle_fps = stoi(getEnvOrDefault("ENCODE_IDLE_FPS", "5"));
+    node.encode_profile.idle_after_ms = static_cast<int>(stod(getEnvOrDefault("ENCODE_IDLE_AFTER", "3")) * 1000);
+    node.encode_profile.roi_qoffset = stod(getEnvOrDefault("ENCODE_ROI_QOFFSET", "-0.3"));
+
+    // Quality ladder for CPU and network pressure ("off" disables it)
+    string ladder = getEnvOrDefault("QUALITY_LADDER", defaultQualityLadder(node.fps));
+    if (ladder != "off") {
+        node.quality.ladder = parseQualityLadder(ladder, node.fps);
+    }
+    node.quality.window_sec = stod(getEnvOrDefault("QUALITY_WINDOW", "2"));
+    node.quality.recover_sec = stod(getEnvOrDefault("QUALITY_RECOVER", "15"));
+
+    // Event clips
+    node.clips.dir = getEnvOrDefault("CLIP_DIR", "");
+    node.clips.preroll_sec = stod(getEnvOrDefault("CLIP_PREROLL_SEC", "5"));
+    node.clips.postroll_sec = stod(getEnvOrDefault("CLIP_POSTROLL_SEC", "5"));
+    node.clips.fragmented = getEnvOrDefault("CLIP_FORMAT", "mp4") == "fmp4";
+
+    // Motion snapshots
+    node.snapshot.width = stoi(getEnvOrDefault("SNAPSHOT_WIDTH", "320"));
+    node.snapshot.crop = getEnvOrDefault("SNAPSHOT_CROP", "0") == "1";
+    node.snapshot.quality = stoi(getEnvOrDefault("SNAPSHOT_QUALITY", "80"));
+
+    node.stream_output = getEnvOrDefault("STREAM_OUTPUT", "rtsp");
+    node.output_timeout = chrono::milliseconds(static_cast<int64_t>(stod(getEnvOrDefault("STREAM_TIMEOUT", "5")) * 1000));
+
+    // Low-resolution substream for grid views, on <id>_sub next to the main stream
+    string substream_size = getEnvOrDefault("SUBSTREAM_SIZE", "off");
+    if (!parseSubstreamSize(substream_size, node.substream)) {
+        cerr << "[Config] Ignoring SUBSTREAM_SIZE '" << substream_size << "' (expected WxH, W or off)" << endl;
+    }
+    node.substream.fps = max(1, stoi(getEnvOrDefault("SUBSTREAM_FPS", "10")));
+    node.substream.crf = stoi(getEnvOrDefault("SUBSTREAM_CRF", "28"));
+
+    // Motion and encode for every camera share one pool sized to the
+    // machine. With several cameras each x264 gets a share of the cores
+    // instead of a thread per core, so encoders don't oversubscribe.
+    int cores = max(1, static_cast<int>(thread::hardware_concurrency()));
+    int worker_count = stoi(getEnvOrDefault("WORKER_THREADS", to_string(cores)));
+    if (cameras.size() > 1) {
+        node.encoder_threads = max(1, cores / static_cast<int>(cameras.size()));
+    }
+    WorkerPool pool(max(1, worker_count));
+    cout << "[Pipeline] Worker threads: " << pool.size() << endl;
 
-                ret = av_interleaved_write_frame(outFormatCtx, pkt);
-                av_packet_unref(pkt);
+    // Initialize FFmpeg
+    avformat_network_init();
 
-                if (ret < 0) {
-                    cerr << "[ERROR] Error writing frame" << endl;
-                    goto cleanup;
-                }
-            }
+    NodeServices services{events, mdns_broadcaster, pool};
+    vector<unique_ptr<CameraSession>> sessions;
+    for (const auto& camera : cameras) {
+        if (node.source.kind == "pipe" && !sessions.empty()) {
+            cerr << "[Source] stdin can feed only one camera, skipping " << camera->id << endl;
+            camera->running = false;
+            continue;
         }
+        sessions.emplace_back(new CameraSession(*camera, node, services));
+    }
 
-        // GUI display only if DISPLAY environment variable is set (not in Docker/headless)
-        if (getenv("DISPLAY") != nullptr) {
-            imshow("OpenSentry Camera Node", cvFrame);
-            if (waitKey(1) == 'q') {
-                running = false;
-                break;
+    // Cameras open in parallel, each starting as soon as it is ready:
+    // device setup and encoder init are mostly waiting, and one slow or
+    // missing camera doesn't hold up the others
+    vector<thread> openers;
+    for (auto& session : sessions) {
+        openers.emplace_back([&node](CameraSession* s) {
+            if (!s->open()) {
+                s->camera.running = false;
+                return;
             }
-        } else {
-            // Small delay in headless mode to prevent CPU spinning
-            this_thread::sleep_for(chrono::milliseconds(1));
-        }
+            cout << "[Pipeline] " << s->camera.id << ": Queue depth: " << node.queue_depth
+                 << ", drop policy: " << dropPolicyName(node.drop_policy)
+                 << ", frame slots: " << s->pipeline->frames.size() << endl;
+            s->start();
+        }, session.get());
     }
+    for (auto& opener : openers) {
+        opener.join();
+    }
+    sessions.erase(remove_if(sessions.begin(), sessions.end(),
+                             [](const unique_ptr<CameraSession>& s) { return !s->pipeline; }),
+                   sessions.end());
 
-cleanup:
-    // Update status to offline
-    if(mdns_available) mdns_broadcaster.update_status("offline");
-    if(mqtt_connected) {
-        mqtt_client.publish("opensentry/" + CAMERA_ID + "/status", create_status_json("offline"), 0, false);
-        mqtt_client.disconnect()->wait();
+    if (sessions.empty()) {
+        // Clean shutdown
+        running = false;
+        broker.join();
+        events.stop();
+        if (mqtt_client.is_connected()) mqtt_client.disconnect()->wait();
         heartbeat.join();
+        mdns_start.join();
+        return -1;
     }
 
-    av_write_trailer(outFormatCtx);
-    av_packet_free(&pkt);
-    av_frame_free(&frame);
-    sws_freeContext(swsCtx);
-    avcodec_free_context(&codecCtx);
+    vector<StreamPipeline*> pipelines;
+    for (auto& session : sessions) {
+        pipelines.push_back(session->pipeline.get());
+    }
 
-    if (!(outFormatCtx->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&outFormatCtx->pb);
+    int metrics_interval = stoi(getEnvOrDefault("METRICS_INTERVAL", "10"));
+    string metrics_file = getEnvOrDefault("METRICS_FILE", "");
+    thread metrics_thread;
+    if (metrics_interval > 0) {
+        metrics_thread = thread(metrics_thread_main, cref(pipelines), chrono::seconds(metrics_interval),
+                                &mqtt_client, metrics_file);
+        cout << "[Metrics] Reporting every " << metrics_interval << "s"
+             << (metrics_file.empty() ? "" : " to " + metrics_file) << endl;
     }
 
-    avformat_free_context(outFormatCtx);
-    camera.release();
+    // The main thread only services the optional preview windows and
+    // watches for the last camera to stop; the stages do all the work.
+    while (running) {
+        bool any_running = false;
+        for (auto& session : sessions) {
+            if (session->camera.running) any_running = true;
+        }
+        if (!any_running) {
+            running = false;
+            break;
+        }
+
+        // GUI display only if DISPLAY environment variable is set (not in Docker/headless)
+        if (node.display_enabled) {
+            for (auto& session : sessions) {
+                StreamPipeline& p = *session->pipeline;
+                lock_guard<mutex> lock(p.preview_mutex);
+                if (!p.preview.empty()) {
+                    imshow("OpenSentry - " + p.camera.name, p.preview);
+                }
+            }
+            if (waitKey(10) == 'q') {
+                for (auto& camera : cameras) camera->running = false;
+            }
+        } else {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+    }
+
+    for (auto& session : sessions) {
+        session->join();
+    }
+    if (metrics_thread.joinable()) metrics_thread.join();
+    pool.stop();
+
+    broker.join();
+    // Offline statuses and held motion ends go out (or into the event log)
+    // before disconnecting
+    events.stop();
+    if (mqtt_client.is_connected()) mqtt_client.disconnect()->wait();
+    heartbeat.join();
+    mdns_start.join();
+
+    // Trailers, encoders and outputs are closed as the sessions go
+    sessions.clear();
     destroyAllWindows();
 
     cout << "[System] Streaming stopped" << endl;
 
     return 0;
-}
\ No newline at end of file
+}
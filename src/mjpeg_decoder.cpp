@@ -0,0 +1,75 @@
+//
+// MJPEG frame decoder
+//
+#include "mjpeg_decoder.h"
+
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+using namespace std;
+
+MjpegDecoder::MjpegDecoder()
+    : ctx(nullptr), pkt(av_packet_alloc()), picture(av_frame_alloc()), sws(nullptr),
+      elapsed(chrono::steady_clock::duration::zero()) {
+    const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+    if (!codec) {
+        cerr << "[MJPEG] No MJPEG decoder in this libavcodec" << endl;
+        return;
+    }
+    ctx = avcodec_alloc_context3(codec);
+    // One frame in, one frame out: frame threading would only add latency
+    ctx->thread_count = 1;
+    if (avcodec_open2(ctx, codec, nullptr) < 0) {
+        cerr << "[MJPEG] Cannot open the MJPEG decoder" << endl;
+        avcodec_free_context(&ctx);
+    }
+}
+
+MjpegDecoder::~MjpegDecoder() {
+    avcodec_free_context(&ctx);
+    av_packet_free(&pkt);
+    av_frame_free(&picture);
+    sws_freeContext(sws);
+}
+
+bool MjpegDecoder::decode(const uint8_t* data, size_t size, AVFrame* dst) {
+    auto start = chrono::steady_clock::now();
+    if (!ctx) return false;
+
+    // Driver buffers end right after the JPEG; the bitstream reader needs
+    // zeroed padding behind it
+    if (input.size() < size + AV_INPUT_BUFFER_PADDING_SIZE) {
+        input.resize(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    }
+    memcpy(input.data(), data, size);
+    memset(input.data() + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    pkt->data = input.data();
+    pkt->size = static_cast<int>(size);
+
+    int ret = avcodec_send_packet(ctx, pkt);
+    if (ret >= 0) ret = avcodec_receive_frame(ctx, picture);
+    if (ret < 0) {
+        cerr << "[MJPEG] Frame did not decode (" << size << " bytes)" << endl;
+        elapsed = chrono::steady_clock::now() - start;
+        return false;
+    }
+
+    // Cameras send full-range 4:2:2 or 4:2:0; the encoder takes YUV420P
+    sws = sws_getCachedContext(sws, picture->width, picture->height, static_cast<AVPixelFormat>(picture->format),
+                               dst->width, dst->height, AV_PIX_FMT_YUV420P,
+                               SWS_BILINEAR, nullptr, nullptr, nullptr);
+    bool ok = sws != nullptr;
+    if (ok) {
+        sws_scale(sws, picture->data, picture->linesize, 0, picture->height, dst->data, dst->linesize);
+    } else {
+        cerr << "[MJPEG] Cannot convert " << picture->width << "x" << picture->height << " "
+             << av_get_pix_fmt_name(static_cast<AVPixelFormat>(picture->format)) << " to YUV420P" << endl;
+    }
+    av_frame_unref(picture);
+    elapsed = chrono::steady_clock::now() - start;
+    return ok;
+}
@@ -0,0 +1,44 @@
+//
+// Full decode of one MJPEG frame into the pipeline's YUV420P planes, for
+// the frames that are analysed in detail or encoded. Every JPEG stands
+// alone, so each pipeline stage that decodes keeps its own decoder.
+//
+#ifndef OPENSENTRY_MJPEG_DECODER_H
+#define OPENSENTRY_MJPEG_DECODER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+class MjpegDecoder {
+public:
+    MjpegDecoder();
+    ~MjpegDecoder();
+
+    MjpegDecoder(const MjpegDecoder&) = delete;
+    MjpegDecoder& operator=(const MjpegDecoder&) = delete;
+
+    // Decodes `size` bytes of JPEG into `dst`, which has its own YUV420P
+    // buffers of the camera's size. Returns false (and leaves `dst` as it
+    // was) if the frame doesn't decode.
+    bool decode(const uint8_t* data, size_t size, AVFrame* dst);
+
+    // Time the last decode() took
+    std::chrono::steady_clock::duration decode_time() const { return elapsed; }
+
+private:
+    AVCodecContext* ctx;
+    AVPacket* pkt;
+    AVFrame* picture;
+    SwsContext* sws;
+    std::vector<uint8_t> input;   // Packet copy with the padding libavcodec reads past the end
+    std::chrono::steady_clock::duration elapsed;
+};
+
+#endif // OPENSENTRY_MJPEG_DECODER_H
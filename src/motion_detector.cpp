@@ -0,0 +1,114 @@
+//
+// Motion detector working on a decimated luma plane, reporting per zone
+//
+#include "motion_detector.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+namespace {
+// Nearest odd kernel size, at least 3
+int oddKernel(double size) {
+    int k = static_cast<int>(lround(size));
+    if (k < 3) return 3;
+    return (k % 2 == 0) ? k + 1 : k;
+}
+}
+
+MotionDetector::MotionDetector(int frame_width, int frame_height, const MotionConfig& config)
+    : frame(frame_width, frame_height), zone_mask(0), active_pixels(0), first_frame(true),
+      prepare_elapsed(0), detect_elapsed(0) {
+    // Never upsample; keep the aspect ratio and even dimensions
+    int aw = min(frame_width, max(16, config.analysis_width));
+    int ah = static_cast<int>(lround(static_cast<double>(aw) * frame_height / frame_width));
+    analysis = Size(aw & ~1, max(2, ah & ~1));
+
+    scale_x = static_cast<double>(analysis.width) / frame_width;
+    scale_y = static_cast<double>(analysis.height) / frame_height;
+
+    blur_kernel = Size(oddKernel(config.blur_size * scale_x), oddKernel(config.blur_size * scale_y));
+    min_area = config.min_area * scale_x * scale_y;
+    dilate_iterations = max(1, static_cast<int>(lround(config.dilate_iterations * scale_x)));
+    threshold_value = config.threshold;
+
+    fused.reset(new MotionKernel(analysis.width, analysis.height, dilate_iterations, config.tile_size));
+    zone_map.reset(new ZoneMap(config.zones, fused->tiles_x(), fused->tiles_y(),
+                               fused->tile_size(), analysis.width, analysis.height));
+    if (config.mode != MotionMode::FrameDiff) {
+        background.reset(new BackgroundModel(analysis.width, analysis.height, config.mode,
+                                             config.learning_shift, config.sigma_k,
+                                             static_cast<uint8_t>(threshold_value)));
+    }
+}
+
+bool MotionDetector::process(const Mat& luma, Rect& region) {
+    auto start = chrono::steady_clock::now();
+    if (analysis == frame) {
+        GaussianBlur(luma, gray, blur_kernel, 0);
+    } else {
+        resize(luma, small, analysis, 0, 0, INTER_AREA);
+        GaussianBlur(small, gray, blur_kernel, 0);
+    }
+    auto prepared = chrono::steady_clock::now();
+    prepare_elapsed = prepared - start;
+
+    bool motion_detected = false;
+
+    if (first_frame && background)
+    {
+        background->reset(gray.data, static_cast<int>(gray.step[0]));
+    }
+    else if (!first_frame)
+    {
+        // One fused pass replaces absdiff + threshold + dilate; with a
+        // background model it also updates the model
+        uint32_t active = background
+            ? fused->run(gray.data, static_cast<int>(gray.step[0]), *background)
+            : fused->run(prev_gray.data, static_cast<int>(prev_gray.step[0]),
+                         gray.data, static_cast<int>(gray.step[0]),
+                         static_cast<uint8_t>(threshold_value));
+
+        // Change for the scheduler only counts inside the zones, so traffic
+        // on an excluded road doesn't keep every frame analysed
+        active_pixels = 0;
+        if (active) {
+            const vector<uint32_t>& counts = fused->tile_counts();
+            const vector<uint32_t>& tile_zones = zone_map->tile_zones();
+            for (size_t t = 0; t < counts.size() && t < tile_zones.size(); t++) {
+                if (tile_zones[t]) active_pixels += counts[t];
+            }
+        }
+
+        // Active pixels are already counted per tile; a zone sees motion
+        // when its tiles add up to min_area. No contour tracing needed.
+        zone_mask = 0;
+        int bounds[4];
+        if (active >= min_area)
+        {
+            zone_mask = zone_map->evaluate(fused->tile_counts(), static_cast<uint32_t>(ceil(min_area)), bounds);
+        }
+
+        if (zone_mask)
+        {
+            motion_detected = true;
+            // Tile box back to full-frame coordinates
+            int tile = fused->tile_size();
+            int x0 = static_cast<int>(bounds[0] * tile / scale_x);
+            int y0 = static_cast<int>(bounds[1] * tile / scale_y);
+            int x1 = min(frame.width, static_cast<int>(ceil(min(analysis.width, (bounds[2] + 1) * tile) / scale_x)));
+            int y1 = min(frame.height, static_cast<int>(ceil(min(analysis.height, (bounds[3] + 1) * tile) / scale_y)));
+            region = Rect(x0, y0, x1 - x0, y1 - y0);
+        }
+    }
+
+    detect_elapsed = chrono::steady_clock::now() - prepared;
+
+    // Swap instead of cloning: next frame's blur overwrites the old buffer
+    if (!background) swap(prev_gray, gray);
+    first_frame = false;
+    return motion_detected;
+}
@@ -0,0 +1,92 @@
+//
+// Motion detector working on a decimated luma plane, reporting per zone
+//
+#ifndef OPENSENTRY_MOTION_DETECTOR_H
+#define OPENSENTRY_MOTION_DETECTOR_H
+
+#include <opencv2/core.hpp>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "background_model.h"
+#include "motion_kernel.h"
+#include "motion_zones.h"
+
+// Detection parameters, expressed at full capture resolution. The detector
+// scales the spatial ones to its analysis resolution.
+struct MotionConfig {
+    int analysis_width = 320;  // Width motion runs at (height keeps the aspect ratio)
+    int threshold = 25;        // Per-pixel luma difference that counts as change
+    int min_area = 500;        // Active area a zone needs, in full-resolution pixels
+    int blur_size = 21;        // Gaussian kernel, in full-resolution pixels
+    int dilate_iterations = 2; // 3x3 dilations, at full resolution
+    int tile_size = 16;        // Activity tile side, in analysis pixels
+    MotionMode mode = MotionMode::FrameDiff;  // What each frame is compared against
+    int learning_shift = 6;    // Background models learn at 1/2^shift per frame
+    double sigma_k = 2.5;      // Variance mode: standard deviations that count as motion
+    std::vector<ZoneSpec> zones;  // Include/exclude areas; empty = whole frame
+    int activity_frames = 0;   // Frames per activity grid message (0 = no grid)
+    int idle_fps = 5;          // Analysis rate while nothing changes (0 = every frame)
+    int idle_after_ms = 3000;  // Quiet time before dropping back to idle_fps
+    int prefilter_threshold = 6;  // MJPEG capture: block mean change that wakes detection (0 = no prefilter)
+};
+
+class MotionDetector {
+public:
+    MotionDetector(int frame_width, int frame_height, const MotionConfig& config);
+
+    // Analyses one frame given as a view of its Y plane. Returns true if
+    // any zone saw motion; `region` is then the bounding box of the active
+    // tiles in full-frame coordinates. The first frame only primes the
+    // detector.
+    bool process(const cv::Mat& luma, cv::Rect& region);
+
+    // Zones that saw motion in the last frame, as a bitmask into zones()
+    uint32_t active_zones() const { return zone_mask; }
+
+    // The last frame had at least a quarter of the minimum area active
+    // inside the zones: not motion yet, but worth watching every frame
+    bool saw_change() const { return active_pixels * 4.0 >= min_area; }
+    const ZoneMap& zones() const { return *zone_map; }
+
+    cv::Size analysis_size() const { return analysis; }
+
+    // Parameters derived for the analysis resolution, for tools that run
+    // the stages one by one (motion_bench)
+    cv::Size blur_size() const { return blur_kernel; }
+    int dilate_radius() const { return dilate_iterations; }
+    double min_area_pixels() const { return min_area; }
+
+    // Time the last process() spent decimating/blurring, and in the fused
+    // kernel plus zone evaluation
+    std::chrono::steady_clock::duration prepare_time() const { return prepare_elapsed; }
+    std::chrono::steady_clock::duration detect_time() const { return detect_elapsed; }
+
+    // Per-frame results of the fused kernel (analysis resolution)
+    const MotionKernel& kernel() const { return *fused; }
+
+private:
+    cv::Size frame;
+    cv::Size analysis;
+    double scale_x;
+    double scale_y;
+    cv::Size blur_kernel;
+    double min_area;
+    int dilate_iterations;
+    int threshold_value;
+
+    cv::Mat small;      // Decimated luma
+    cv::Mat gray;       // Blurred analysis image
+    cv::Mat prev_gray;  // Previous blurred analysis image
+    std::unique_ptr<MotionKernel> fused;  // absdiff + threshold + dilate + counts
+    std::unique_ptr<BackgroundModel> background;  // Null in FrameDiff mode
+    std::unique_ptr<ZoneMap> zone_map;   // Zone bits per kernel tile
+    uint32_t zone_mask;
+    uint32_t active_pixels;  // Inside the zones, last process()
+    bool first_frame;
+    std::chrono::steady_clock::duration prepare_elapsed;
+    std::chrono::steady_clock::duration detect_elapsed;
+};
+
+#endif // OPENSENTRY_MOTION_DETECTOR_H
@@ -0,0 +1,363 @@
+//
+// Fused motion kernel: absdiff + threshold + dilate + active-pixel counting
+//
+// Rows stream through once: each input row is differenced and thresholded,
+// dilated horizontally into a small ring of 2r+1 rows, and every output row
+// is the OR of the ring rows around it. The ring and scratch rows stay in L1,
+// and rows with nothing set skip the dilation work entirely, so an idle scene
+// costs a single read of both images.
+//
+#include "motion_kernel.h"
+#include "background_model.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MOTION_KERNEL_X86 1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define MOTION_KERNEL_NEON 1
+#endif
+
+using namespace std;
+
+namespace {
+
+// ============================================================================
+// Scalar reference
+// ============================================================================
+uint32_t threshold_row_scalar(const uint8_t* a, const uint8_t* b, uint8_t* out, int n, uint8_t thr) {
+    uint32_t count = 0;
+    for (int x = 0; x < n; x++) {
+        int d = a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+        uint8_t m = d > thr ? 0xFF : 0;
+        out[x] = m;
+        count += m & 1;
+    }
+    return count;
+}
+
+// `in` points at pixel 0 of a row padded with `r` zero bytes each side
+void hdilate_scalar(const uint8_t* in, uint8_t* out, int n, int r) {
+    for (int x = 0; x < n; x++) {
+        uint8_t m = in[x];
+        for (int d = 1; d <= r; d++) {
+            m |= in[x - d] | in[x + d];
+        }
+        out[x] = m;
+    }
+}
+
+void or_into_scalar(uint8_t* dst, const uint8_t* src, int n) {
+    for (int x = 0; x < n; x++) dst[x] |= src[x];
+}
+
+uint32_t count_set_scalar(const uint8_t* p, int n) {
+    uint32_t count = 0;
+    for (int x = 0; x < n; x++) count += p[x] & 1;
+    return count;
+}
+
+// ============================================================================
+// SSE2 / AVX2
+// ============================================================================
+#ifdef MOTION_KERNEL_X86
+uint32_t threshold_row_sse2(const uint8_t* a, const uint8_t* b, uint8_t* out, int n, uint8_t thr) {
+    const __m128i vthr = _mm_set1_epi8(static_cast<char>(thr));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i sum = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        // diff > thr  <=>  saturating (diff - thr) != 0
+        __m128i over = _mm_subs_epu8(diff, vthr);
+        __m128i m = _mm_andnot_si128(_mm_cmpeq_epi8(over, zero), _mm_set1_epi8(-1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), m);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_and_si128(m, one), zero));
+    }
+    uint32_t count = static_cast<uint32_t>(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+    return count + threshold_row_scalar(a + x, b + x, out + x, n - x, thr);
+}
+
+void hdilate_sse2(const uint8_t* in, uint8_t* out, int n, int r) {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + x));
+        for (int d = 1; d <= r; d++) {
+            m = _mm_or_si128(m, _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + x - d)));
+            m = _mm_or_si128(m, _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + x + d)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), m);
+    }
+    hdilate_scalar(in + x, out + x, n - x, r);
+}
+
+void or_into_sse2(uint8_t* dst, const uint8_t* src, int n) {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + x));
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_or_si128(d, s));
+    }
+    or_into_scalar(dst + x, src + x, n - x);
+}
+
+uint32_t count_set_sse2(const uint8_t* p, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i sum = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + x));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_and_si128(m, one), zero));
+    }
+    uint32_t count = static_cast<uint32_t>(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+    return count + count_set_scalar(p + x, n - x);
+}
+
+__attribute__((target("avx2")))
+uint32_t threshold_row_avx2(const uint8_t* a, const uint8_t* b, uint8_t* out, int n, uint8_t thr) {
+    const __m256i vthr = _mm256_set1_epi8(static_cast<char>(thr));
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i ones = _mm256_set1_epi8(-1);
+    __m256i sum = _mm256_setzero_si256();
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + x));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + x));
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        __m256i over = _mm256_subs_epu8(diff, vthr);
+        __m256i m = _mm256_andnot_si256(_mm256_cmpeq_epi8(over, zero), ones);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), m);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_and_si256(m, one), zero));
+    }
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    uint32_t count = static_cast<uint32_t>(_mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8)));
+    return count + threshold_row_sse2(a + x, b + x, out + x, n - x, thr);
+}
+
+__attribute__((target("avx2")))
+void hdilate_avx2(const uint8_t* in, uint8_t* out, int n, int r) {
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + x));
+        for (int d = 1; d <= r; d++) {
+            m = _mm256_or_si256(m, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + x - d)));
+            m = _mm256_or_si256(m, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + x + d)));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), m);
+    }
+    hdilate_sse2(in + x, out + x, n - x, r);
+}
+
+__attribute__((target("avx2")))
+void or_into_avx2(uint8_t* dst, const uint8_t* src, int n) {
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + x));
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), _mm256_or_si256(d, s));
+    }
+    or_into_sse2(dst + x, src + x, n - x);
+}
+#endif
+
+// ============================================================================
+// NEON
+// ============================================================================
+#ifdef MOTION_KERNEL_NEON
+uint32_t threshold_row_neon(const uint8_t* a, const uint8_t* b, uint8_t* out, int n, uint8_t thr) {
+    const uint8x16_t vthr = vdupq_n_u8(thr);
+    uint32x4_t sum = vdupq_n_u32(0);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        uint8x16_t m = vcgtq_u8(vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x)), vthr);
+        vst1q_u8(out + x, m);
+        sum = vpadalq_u16(sum, vpaddlq_u8(vshrq_n_u8(m, 7)));
+    }
+    uint32_t count = vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) +
+                     vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+    return count + threshold_row_scalar(a + x, b + x, out + x, n - x, thr);
+}
+
+void hdilate_neon(const uint8_t* in, uint8_t* out, int n, int r) {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        uint8x16_t m = vld1q_u8(in + x);
+        for (int d = 1; d <= r; d++) {
+            m = vorrq_u8(m, vorrq_u8(vld1q_u8(in + x - d), vld1q_u8(in + x + d)));
+        }
+        vst1q_u8(out + x, m);
+    }
+    hdilate_scalar(in + x, out + x, n - x, r);
+}
+
+void or_into_neon(uint8_t* dst, const uint8_t* src, int n) {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        vst1q_u8(dst + x, vorrq_u8(vld1q_u8(dst + x), vld1q_u8(src + x)));
+    }
+    or_into_scalar(dst + x, src + x, n - x);
+}
+
+uint32_t count_set_neon(const uint8_t* p, int n) {
+    uint32x4_t sum = vdupq_n_u32(0);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        sum = vpadalq_u16(sum, vpaddlq_u8(vshrq_n_u8(vld1q_u8(p + x), 7)));
+    }
+    uint32_t count = vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) +
+                     vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+    return count + count_set_scalar(p + x, n - x);
+}
+#endif
+
+// ============================================================================
+// Runtime dispatch
+// ============================================================================
+struct KernelOps {
+    const char* name;
+    uint32_t (*threshold_row)(const uint8_t*, const uint8_t*, uint8_t*, int, uint8_t);
+    void (*hdilate)(const uint8_t*, uint8_t*, int, int);
+    void (*or_into)(uint8_t*, const uint8_t*, int);
+    uint32_t (*count_set)(const uint8_t*, int);
+};
+
+KernelOps select_ops() {
+#ifdef MOTION_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", threshold_row_avx2, hdilate_avx2, or_into_avx2, count_set_sse2};
+    }
+    return {"sse2", threshold_row_sse2, hdilate_sse2, or_into_sse2, count_set_sse2};
+#elif defined(MOTION_KERNEL_NEON)
+    return {"neon", threshold_row_neon, hdilate_neon, or_into_neon, count_set_neon};
+#else
+    return {"scalar", threshold_row_scalar, hdilate_scalar, or_into_scalar, count_set_scalar};
+#endif
+}
+
+const KernelOps& ops() {
+    static const KernelOps selected = select_ops();
+    return selected;
+}
+
+} // namespace
+
+// ============================================================================
+// MotionKernel
+// ============================================================================
+MotionKernel::MotionKernel(int width, int height, int dilate_radius, int tile_size)
+    : w(width), h(height), radius(max(0, dilate_radius)), tile(max(1, tile_size)),
+      tx((width + tile - 1) / tile), ty((height + tile - 1) / tile),
+      padded(width + 2 * radius), raw_total(0),
+      thresh_row(padded, 0),
+      hrows(static_cast<size_t>(2 * radius + 1) * width, 0),
+      hrow_active(2 * radius + 1, 0),
+      mask_buf(static_cast<size_t>(width) * height, 0),
+      mask_dirty(height, 0),
+      rows(height, 0),
+      tiles(static_cast<size_t>(tx) * ty, 0) {}
+
+const char* MotionKernel::isa_name() {
+    return ops().name;
+}
+
+uint32_t MotionKernel::run(const uint8_t* prev, int prev_stride,
+                           const uint8_t* cur, int cur_stride, uint8_t threshold) {
+    const KernelOps& k = ops();
+    return run_rows([&](int y, uint8_t* out) {
+        return k.threshold_row(prev + static_cast<size_t>(y) * prev_stride,
+                               cur + static_cast<size_t>(y) * cur_stride,
+                               out, w, threshold);
+    });
+}
+
+uint32_t MotionKernel::run(const uint8_t* cur, int cur_stride, BackgroundModel& model) {
+    return run_rows([&](int y, uint8_t* out) {
+        return model.update_row(y, cur + static_cast<size_t>(y) * cur_stride, out);
+    });
+}
+
+template <typename ThresholdRow>
+uint32_t MotionKernel::run_rows(ThresholdRow threshold_row) {
+    const KernelOps& k = ops();
+    const int ring = 2 * radius + 1;
+    uint8_t* trow = thresh_row.data() + radius;  // Zero padding stays untouched
+
+    fill(tiles.begin(), tiles.end(), 0);
+    raw_total = 0;
+    uint32_t total = 0;
+
+    for (int y = 0; y < h; y++) {
+        uint32_t raw = threshold_row(y, trow);
+        raw_total += raw;
+
+        int slot = y % ring;
+        hrow_active[slot] = raw > 0;
+        if (raw > 0) {
+            k.hdilate(trow, hrows.data() + static_cast<size_t>(slot) * w, w, radius);
+        }
+
+        if (y >= radius) {
+            dilate_row(y - radius);
+            total += rows[y - radius];
+        }
+    }
+    for (int y = max(0, h - radius); y < h; y++) {
+        dilate_row(y);
+        total += rows[y];
+    }
+    return total;
+}
+
+// Vertical pass for one output row: OR of the horizontally dilated rows
+// within `radius`, then per-row and per-tile counts.
+void MotionKernel::dilate_row(int out_y) {
+    const KernelOps& k = ops();
+    const int ring = 2 * radius + 1;
+    const int lo = max(0, out_y - radius);
+    const int hi = min(h - 1, out_y + radius);
+    uint8_t* out = mask_buf.data() + static_cast<size_t>(out_y) * w;
+
+    bool any = false;
+    for (int y = lo; y <= hi; y++) {
+        int slot = y % ring;
+        if (!hrow_active[slot]) continue;
+        const uint8_t* src = hrows.data() + static_cast<size_t>(slot) * w;
+        if (!any) {
+            memcpy(out, src, w);
+            any = true;
+        } else {
+            k.or_into(out, src, w);
+        }
+    }
+
+    if (!any) {
+        // Idle row: only touch the mask if an earlier frame left pixels set
+        if (mask_dirty[out_y]) {
+            memset(out, 0, w);
+            mask_dirty[out_y] = 0;
+        }
+        rows[out_y] = 0;
+        return;
+    }
+
+    mask_dirty[out_y] = 1;
+    uint32_t row_total = 0;
+    uint32_t* tile_row = tiles.data() + static_cast<size_t>(out_y / tile) * tx;
+    for (int t = 0; t < tx; t++) {
+        int x0 = t * tile;
+        int x1 = min(w, x0 + tile);
+        uint32_t c = k.count_set(out + x0, x1 - x0);
+        tile_row[t] += c;
+        row_total += c;
+    }
+    rows[out_y] = row_total;
+}
@@ -0,0 +1,76 @@
+//
+// Fused motion kernel: absdiff + threshold + dilate + active-pixel counting
+// in a single cache-blocked pass over two 8-bit images.
+//
+#ifndef OPENSENTRY_MOTION_KERNEL_H
+#define OPENSENTRY_MOTION_KERNEL_H
+
+#include <cstdint>
+#include <vector>
+
+class BackgroundModel;
+
+class MotionKernel {
+public:
+    // `dilate_radius` matches OpenCV's 3x3 dilate applied that many times
+    // (a (2r+1)x(2r+1) square). `tile_size` is the side of the square tiles
+    // active pixels are also counted in.
+    MotionKernel(int width, int height, int dilate_radius, int tile_size);
+
+    // Computes mask = dilate(|prev - cur| > threshold) into mask(), fills
+    // row_counts() and tile_counts() with dilated active pixels, and returns
+    // the total. A return of 0 means no motion at all; rows with nothing
+    // active cost only the diff/threshold pass.
+    uint32_t run(const uint8_t* prev, int prev_stride,
+                 const uint8_t* cur, int cur_stride, uint8_t threshold);
+
+    // Same, but thresholds `cur` against a background model instead of the
+    // previous frame, updating the model in the same pass.
+    uint32_t run(const uint8_t* cur, int cur_stride, BackgroundModel& model);
+
+    // Active pixels before dilation from the last run()
+    uint32_t raw_count() const { return raw_total; }
+
+    // 0/255 mask from the last run(), `width()` bytes per row, contiguous.
+    // Only meaningful when run() returned non-zero.
+    const uint8_t* mask() const { return mask_buf.data(); }
+    uint8_t* mask() { return mask_buf.data(); }
+
+    const std::vector<uint32_t>& row_counts() const { return rows; }
+    const std::vector<uint32_t>& tile_counts() const { return tiles; }
+
+    int width() const { return w; }
+    int height() const { return h; }
+    int tiles_x() const { return tx; }
+    int tiles_y() const { return ty; }
+    int tile_size() const { return tile; }
+
+    // Name of the SIMD variant selected at runtime ("avx2", "sse2", "neon", "scalar")
+    static const char* isa_name();
+
+private:
+    // Shared row loop; `threshold_row(y, out)` fills one thresholded row
+    // and returns its active pixel count
+    template <typename ThresholdRow>
+    uint32_t run_rows(ThresholdRow threshold_row);
+    void dilate_row(int out_y);
+
+    int w;
+    int h;
+    int radius;
+    int tile;
+    int tx;
+    int ty;
+    int padded;                     // Row pitch of the scratch rows
+    uint32_t raw_total;
+
+    std::vector<uint8_t> thresh_row;    // Thresholded row, zero-padded by `radius` each side
+    std::vector<uint8_t> hrows;         // Ring of 2r+1 horizontally dilated rows
+    std::vector<uint8_t> hrow_active;   // Whether each ring row has any set pixel
+    std::vector<uint8_t> mask_buf;
+    std::vector<uint8_t> mask_dirty;    // Mask row holds set pixels from an earlier run
+    std::vector<uint32_t> rows;
+    std::vector<uint32_t> tiles;
+};
+
+#endif // OPENSENTRY_MOTION_KERNEL_H
@@ -0,0 +1,134 @@
+//
+// Motion zones
+//
+#include "motion_zones.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+vector<ZoneSpec> parseZones(const string& spec) {
+    vector<ZoneSpec> zones;
+    stringstream entries(spec);
+    string entry;
+    while (getline(entries, entry, ';')) {
+        if (entry.empty()) continue;
+
+        ZoneSpec zone;
+        if (entry[0] == '!') {
+            zone.exclude = true;
+            entry.erase(0, 1);
+        }
+        size_t colon = entry.find(':');
+        char tail;
+        if (colon == string::npos || colon == 0 ||
+            sscanf(entry.c_str() + colon + 1, "%lf,%lf,%lf,%lf%c",
+                   &zone.x, &zone.y, &zone.width, &zone.height, &tail) != 4 ||
+            zone.width <= 0 || zone.height <= 0) {
+            cerr << "[Motion] Ignoring malformed zone '" << entry
+                 << "' (expected name:x,y,width,height)" << endl;
+            continue;
+        }
+        zone.name = entry.substr(0, colon);
+        if (zone.name.find_first_of("\"\\") != string::npos) {
+            cerr << "[Motion] Ignoring zone with quote in its name: " << zone.name << endl;
+            continue;
+        }
+        zones.push_back(zone);
+    }
+    return zones;
+}
+
+vector<string> zoneNames(const vector<ZoneSpec>& specs) {
+    vector<string> names;
+    for (const ZoneSpec& z : specs) {
+        if (!z.exclude && static_cast<int>(names.size()) < ZoneMap::kMaxZones) {
+            names.push_back(z.name);
+        }
+    }
+    if (names.empty()) {
+        names.push_back("frame");
+    }
+    return names;
+}
+
+ZoneMap::ZoneMap(const vector<ZoneSpec>& specs, int tiles_x, int tiles_y,
+                 int tile_size, int width, int height)
+    : tx(tiles_x), ty(tiles_y), tile_mask(static_cast<size_t>(tiles_x) * tiles_y, 0) {
+    vector<uint32_t> excluded(tile_mask.size(), 0);
+
+    auto inside = [&](const ZoneSpec& z, int tile_x, int tile_y) {
+        // Edge tiles are clipped to the image before taking the centre
+        int x0 = tile_x * tile_size;
+        int y0 = tile_y * tile_size;
+        double cx = (x0 + min(width, x0 + tile_size)) * 0.5 / width;
+        double cy = (y0 + min(height, y0 + tile_size)) * 0.5 / height;
+        return cx >= z.x && cx < z.x + z.width && cy >= z.y && cy < z.y + z.height;
+    };
+
+    for (const ZoneSpec& z : specs) {
+        if (!z.exclude && static_cast<int>(names.size()) == kMaxZones) {
+            cerr << "[Motion] More than " << kMaxZones << " zones, ignoring '" << z.name << "'" << endl;
+            continue;
+        }
+        uint32_t bit = z.exclude ? 1u : 1u << names.size();
+        for (int y = 0; y < ty; y++) {
+            for (int x = 0; x < tx; x++) {
+                if (!inside(z, x, y)) continue;
+                (z.exclude ? excluded : tile_mask)[static_cast<size_t>(y) * tx + x] |= bit;
+            }
+        }
+        if (!z.exclude) names.push_back(z.name);
+    }
+
+    if (names.empty()) {
+        names.push_back("frame");
+        fill(tile_mask.begin(), tile_mask.end(), 1u);
+    }
+    for (size_t t = 0; t < tile_mask.size(); t++) {
+        if (excluded[t]) tile_mask[t] = 0;
+    }
+    activity.assign(names.size(), 0);
+}
+
+uint32_t ZoneMap::evaluate(const vector<uint32_t>& tile_counts, uint32_t min_pixels,
+                           int bounds[4]) {
+    fill(activity.begin(), activity.end(), 0);
+    for (size_t t = 0; t < tile_counts.size(); t++) {
+        uint32_t count = tile_counts[t];
+        uint32_t zones = tile_mask[t];
+        if (count == 0 || zones == 0) continue;
+        while (zones) {
+            int z = __builtin_ctz(zones);
+            activity[z] += count;
+            zones &= zones - 1;
+        }
+    }
+
+    uint32_t active = 0;
+    for (size_t z = 0; z < activity.size(); z++) {
+        if (activity[z] >= min_pixels) active |= 1u << z;
+    }
+    if (!active) return 0;
+
+    // Second pass only on frames with motion: box of the tiles that fed an
+    // active zone
+    bounds[0] = tx;
+    bounds[1] = ty;
+    bounds[2] = -1;
+    bounds[3] = -1;
+    for (int y = 0; y < ty; y++) {
+        for (int x = 0; x < tx; x++) {
+            size_t t = static_cast<size_t>(y) * tx + x;
+            if (tile_counts[t] == 0 || !(tile_mask[t] & active)) continue;
+            bounds[0] = min(bounds[0], x);
+            bounds[1] = min(bounds[1], y);
+            bounds[2] = max(bounds[2], x);
+            bounds[3] = max(bounds[3], y);
+        }
+    }
+    return active;
+}
@@ -0,0 +1,65 @@
+//
+// Motion zones: named include/exclude areas precomputed as per-tile bitmasks
+// over the motion kernel's tile grid.
+//
+#ifndef OPENSENTRY_MOTION_ZONES_H
+#define OPENSENTRY_MOTION_ZONES_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One zone as configured, in fractions of the frame (0..1)
+struct ZoneSpec {
+    std::string name;
+    double x = 0;
+    double y = 0;
+    double width = 1;
+    double height = 1;
+    bool exclude = false;   // Motion here is ignored everywhere
+};
+
+// Parses "name:x,y,w,h;!name:x,y,w,h". A leading '!' makes a zone an
+// exclusion. Malformed entries are skipped with a warning.
+std::vector<ZoneSpec> parseZones(const std::string& spec);
+
+// Names of the include zones ZoneMap builds from `specs`, by zone bit.
+// Lets code that only sees zone masks (the MQTT publisher) name them.
+std::vector<std::string> zoneNames(const std::vector<ZoneSpec>& specs);
+
+// Up to 32 include zones. With none configured, the whole frame is a
+// single zone named "frame".
+class ZoneMap {
+public:
+    static const int kMaxZones = 32;
+
+    // Grid is `tiles_x` x `tiles_y` tiles of `tile_size` pixels over an
+    // image of `width` x `height`. A tile belongs to a zone if its centre
+    // lies inside it.
+    ZoneMap(const std::vector<ZoneSpec>& specs, int tiles_x, int tiles_y,
+            int tile_size, int width, int height);
+
+    // Sums per-tile active pixel counts into each zone. Returns the mask
+    // of zones with at least `min_pixels`; `bounds` (tile units, inclusive)
+    // then covers the contributing tiles of those zones.
+    uint32_t evaluate(const std::vector<uint32_t>& tile_counts, uint32_t min_pixels,
+                      int bounds[4]);
+
+    int zone_count() const { return static_cast<int>(names.size()); }
+    const std::string& zone_name(int zone) const { return names[zone]; }
+
+    // Active pixels per zone from the last evaluate()
+    const std::vector<uint32_t>& zone_activity() const { return activity; }
+
+    // Zone bits of each tile (exclusions already cleared)
+    const std::vector<uint32_t>& tile_zones() const { return tile_mask; }
+
+private:
+    int tx;
+    int ty;
+    std::vector<std::string> names;
+    std::vector<uint32_t> tile_mask;   // Per tile, bit i = include zone i
+    std::vector<uint32_t> activity;
+};
+
+#endif // OPENSENTRY_MOTION_ZONES_H
@@ -0,0 +1,96 @@
+//
+// Bounded lock-free multi-producer/single-consumer ring
+//
+#ifndef OPENSENTRY_MPSC_RING_H
+#define OPENSENTRY_MPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Fixed-capacity FIFO that any number of threads push into and one thread
+// pops from (Vyukov's bounded queue). Each cell carries a sequence number
+// that says whose turn it is, so producers only contend on the tail CAS and
+// never wait for one another. Storage is allocated once in the constructor;
+// push/pop never allocate or lock. Capacity is rounded up to a power of two.
+template <typename T>
+class MpscRing {
+public:
+    explicit MpscRing(size_t requested_capacity)
+        : mask(round_up_pow2(requested_capacity < 2 ? 2 : requested_capacity) - 1),
+          cells(new Cell[mask + 1]), head(0), tail(0) {
+        for (size_t i = 0; i <= mask; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    // Any thread. Returns false if the ring is full.
+    bool try_push(const T& item) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                // Our turn for this cell if nobody else claims it first
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;  // The consumer hasn't freed this cell yet
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = item;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side only. Returns false if the ring is empty (or the next
+    // item is claimed but not yet written).
+    bool try_pop(T& item) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        Cell& cell = cells[pos & mask];
+        if (cell.seq.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        item = cell.value;
+        cell.seq.store(pos + mask + 1, std::memory_order_release);
+        head.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate from any thread
+    size_t size() const {
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t h = head.load(std::memory_order_acquire);
+        return t > h ? t - h : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return mask + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    static size_t round_up_pow2(size_t v) {
+        size_t p = 1;
+        while (p < v) p <<= 1;
+        return p;
+    }
+
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    // Consumer and producer indices on separate cache lines
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+#endif // OPENSENTRY_MPSC_RING_H
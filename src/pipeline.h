@@ -0,0 +1,300 @@
+//
+// Frame pipeline building blocks: preallocated frame slots and the bounded
+// queues that connect the capture, motion, encode and network stages.
+//
+#ifndef OPENSENTRY_PIPELINE_H
+#define OPENSENTRY_PIPELINE_H
+
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "spsc_ring.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// What a stage does when the queue in front of the next stage is full.
+enum class DropPolicy {
+    Block,       // Wait for the consumer (back-pressure up to the camera)
+    DropNewest,  // Discard the frame that didn't fit
+    DropOldest   // A full queue gives up its oldest frame to make room
+};
+
+inline DropPolicy parseDropPolicy(const std::string& name) {
+    if (name == "block") return DropPolicy::Block;
+    if (name == "drop_newest") return DropPolicy::DropNewest;
+    return DropPolicy::DropOldest;
+}
+
+inline const char* dropPolicyName(DropPolicy policy) {
+    switch (policy) {
+        case DropPolicy::Block: return "block";
+        case DropPolicy::DropNewest: return "drop_newest";
+        case DropPolicy::DropOldest: return "drop_oldest";
+    }
+    return "unknown";
+}
+
+// ============================================================================
+// Frame slots
+// ============================================================================
+// How a slot holds its image, decided once by the capture backend.
+enum class SlotStorage {
+    Bgr,           // OpenCV capture: BGR Mat, converted into owned YUV420P planes
+    YuvOwned,      // YUV420P planes owned by the slot (repacked captures)
+    DriverBuffer,  // YUV planes borrowed from a driver buffer, no copy
+    Jpeg           // MJPEG driver buffer, decoded into owned YUV420P planes on demand
+};
+
+// One captured frame plus the per-frame results later stages attach to it.
+// Slots are allocated once at startup and recycled for the life of the process.
+struct FrameSlot {
+    cv::Mat bgr;                 // OpenCV capture target (SlotStorage::Bgr only)
+    AVFrame* yuv = nullptr;      // Encoder-ready image; motion runs on its Y plane
+    // SlotStorage::Jpeg: the frame as the camera sent it. Set until a stage
+    // decodes it into `yuv`, which is only valid once this is null again.
+    AVBufferRef* jpeg = nullptr;
+    size_t jpeg_size = 0;
+    int64_t index = 0;           // Capture sequence number
+    std::chrono::steady_clock::time_point captured;  // Source timestamp (drives PTS)
+    std::chrono::steady_clock::time_point arrived;   // When the capture stage got it
+    bool motion = false;         // Motion stage found motion in this frame
+    cv::Rect motion_rect;        // Its bounding box, full-frame coordinates
+    int32_t clip = 0;            // Event clip the frame belongs to (0 = none)
+    std::atomic<bool> in_use{false};
+};
+
+// Fixed set of FrameSlots. Only the capture stage acquires; any stage may
+// release (the motion stage when it drops, the encode stage when done).
+class FramePool {
+public:
+    FramePool(size_t count, int width, int height, SlotStorage storage)
+        : slots(new FrameSlot[count]), slot_count(count), next(0), storage(storage), waiters(0) {
+        for (size_t i = 0; i < slot_count; i++) {
+            FrameSlot& slot = slots[i];
+            if (storage == SlotStorage::Bgr) {
+                slot.bgr.create(height, width, CV_8UC3);
+            }
+            slot.yuv = av_frame_alloc();
+            if (storage != SlotStorage::DriverBuffer) {
+                slot.yuv->format = AV_PIX_FMT_YUV420P;
+                slot.yuv->width = width;
+                slot.yuv->height = height;
+                av_frame_get_buffer(slot.yuv, 0);
+            }
+        }
+    }
+
+    ~FramePool() {
+        for (size_t i = 0; i < slot_count; i++) {
+            av_frame_free(&slots[i].yuv);
+            av_buffer_unref(&slots[i].jpeg);
+        }
+    }
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    // Returns nullptr if every slot is still held by a downstream stage.
+    FrameSlot* acquire() {
+        for (size_t n = 0; n < slot_count; n++) {
+            FrameSlot& slot = slots[next];
+            next = (next + 1) % slot_count;
+            bool expected = false;
+            if (slot.in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    // Blocks until a slot is free or running goes false (then nullptr).
+    FrameSlot* acquire_wait(const std::atomic<bool>& running) {
+        while (running) {
+            FrameSlot* slot = acquire();
+            if (slot) return slot;
+            std::unique_lock<std::mutex> lock(mutex);
+            waiters.fetch_add(1);
+            // Either this sees the slot release() just freed, or release()
+            // sees the waiter and notifies
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            slot = acquire();
+            if (!slot && running) {
+                cond.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            waiters.fetch_sub(1);
+            if (slot) return slot;
+        }
+        return nullptr;
+    }
+
+    void release(FrameSlot* slot) {
+        if (!slot) return;
+        if (storage == SlotStorage::DriverBuffer) {
+            av_frame_unref(slot->yuv);  // Hands the buffer back to the driver
+        }
+        av_buffer_unref(&slot->jpeg);   // Same for an undecoded MJPEG frame
+        slot->in_use.store(false, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_all();
+        }
+    }
+
+    size_t size() const { return slot_count; }
+    SlotStorage slot_storage() const { return storage; }
+
+private:
+    std::unique_ptr<FrameSlot[]> slots;
+    size_t slot_count;
+    size_t next;  // Only touched by the acquiring (capture) thread
+    SlotStorage storage;
+    std::atomic<int> waiters;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+// ============================================================================
+// Stage queue
+// ============================================================================
+// SPSC ring between two pipeline stages plus the drop policy applied when it
+// backs up. The ring itself is lock-free; the mutex/condvar pair is only used
+// to park a thread that has nothing to do, never on the data path.
+//
+// Items come out in the order they went in. Under DropOldest the producer
+// cannot take the oldest entry off an SPSC ring itself, so the ring is sized
+// with as much slack again as the queue's depth: push() lands in the slack,
+// and the consumer discards exactly the entries past `limit` before it takes
+// the next one. A late consumer therefore loses only the frames that would
+// have been evicted, and never sees more than `limit` of backlog.
+template <typename T>
+class StageQueue {
+public:
+    StageQueue(size_t depth, DropPolicy policy)
+        : ring(ring_size(depth, policy)),
+          limit(policy == DropPolicy::DropOldest ? std::max<size_t>(depth, 1) : ring.capacity()),
+          policy(policy), dropped(0), waiters(0) {}
+
+    // Producer side. Returns false if the item was not queued (dropped by
+    // policy, or the pipeline is stopping); the caller keeps ownership.
+    // A DropOldest queue only refuses an item once the consumer has fallen
+    // a whole depth behind and the slack is used up as well.
+    bool push(const T& item, const std::atomic<bool>& running) {
+        while (!ring.try_push(item)) {
+            if (policy != DropPolicy::Block) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (!running) return false;
+            wait_until([this] { return ring.size() < ring.capacity(); }, running);
+        }
+        wake();
+        return true;
+    }
+
+    // Consumer side. Blocks until an item arrives or running goes false.
+    // Entries a DropOldest push evicted are handed to `discard` first.
+    template <typename Discard>
+    bool pop(T& item, const std::atomic<bool>& running, Discard discard) {
+        evict(discard);
+        while (!ring.try_pop(item)) {
+            if (!running) return false;
+            wait_until([this] { return !ring.empty(); }, running);
+            evict(discard);
+        }
+        wake();  // Space freed for a blocked producer
+        return true;
+    }
+
+    // Non-blocking pop used when draining at shutdown. Returns every queued
+    // entry, evicted or not, so the caller can release them all.
+    bool try_pop(T& item) { return ring.try_pop(item); }
+
+    // Non-blocking pop with the same drop handling as pop(), for consumers
+    // run from the worker pool rather than a thread of their own.
+    template <typename Discard>
+    bool poll(T& item, Discard discard) {
+        evict(discard);
+        if (!ring.try_pop(item)) return false;
+        wake();
+        return true;
+    }
+
+    // Whether push() would block right now (Block policy and full). Exact
+    // from the producer side: the consumer can only make room.
+    bool would_block() const {
+        return policy == DropPolicy::Block && ring.size() >= ring.capacity();
+    }
+
+    size_t depth() const { return std::min(ring.size(), limit); }
+    size_t capacity() const { return limit; }
+    // Most entries the queue can hold at once, counting those already
+    // evicted but not yet discarded by the consumer. Size buffer pools
+    // from this rather than capacity().
+    size_t max_held() const { return ring.capacity(); }
+    // The same, for a queue not yet constructed
+    static size_t max_held(size_t depth, DropPolicy policy) {
+        return SpscRing<T>::capacity_for(ring_size(depth, policy));
+    }
+    uint64_t dropped_count() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    static size_t ring_size(size_t depth, DropPolicy policy) {
+        return policy == DropPolicy::DropOldest ? 2 * std::max<size_t>(depth, 1) : depth;
+    }
+
+    // Consumer side: drop the oldest entries until at most `limit` remain.
+    // The producer only ever adds, so the size seen here is a lower bound
+    // and nothing newer than the first `limit` survivors is discarded.
+    template <typename Discard>
+    void evict(Discard discard) {
+        if (policy != DropPolicy::DropOldest) return;
+        size_t queued = ring.size();
+        T stale;
+        while (queued > limit && ring.try_pop(stale)) {
+            discard(stale);
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            --queued;
+        }
+    }
+
+    template <typename Ready>
+    void wait_until(Ready ready, const std::atomic<bool>& running) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiters.fetch_add(1);
+        // Timed wait so a stop request is noticed promptly even if nobody
+        // ever pushes again.
+        if (!ready() && running) {
+            cond.wait_for(lock, std::chrono::milliseconds(10));
+        }
+        waiters.fetch_sub(1);
+    }
+
+    void wake() {
+        // Pairs with the waiter count increment: either the waiter sees the
+        // new ring state, or we see the waiter and notify it.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_all();
+        }
+    }
+
+    SpscRing<T> ring;
+    size_t limit;  // Logical depth; entries past it have been evicted
+    DropPolicy policy;
+    std::atomic<uint64_t> dropped;
+    std::atomic<int> waiters;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+#endif // OPENSENTRY_PIPELINE_H
@@ -0,0 +1,160 @@
+//
+// Closed-loop quality control
+//
+#include "quality_controller.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+vector<QualityRung> parseQualityLadder(const string& spec, int max_fps) {
+    vector<QualityRung> ladder;
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ';')) {
+        if (item.empty()) {
+            continue;
+        }
+        QualityRung rung;
+        int fields = sscanf(item.c_str(), "%d:%d:%d", &rung.fps, &rung.max_kbps, &rung.crf_offset);
+        if (fields < 2 || rung.fps <= 0 || rung.max_kbps < 0) {
+            cerr << "[Quality] Ignoring ladder rung '" << item << "' (expected fps:kbps[:crf])" << endl;
+            continue;
+        }
+        rung.fps = min(rung.fps, max_fps);
+        ladder.push_back(rung);
+    }
+    return ladder;
+}
+
+string defaultQualityLadder(int fps) {
+    stringstream ss;
+    ss << fps << ":6000;"
+       << fps << ":3000;"
+       << max(1, fps / 2) << ":1500;"
+       << max(1, fps / 4) << ":800:4";
+    return ss.str();
+}
+
+QualityController::QualityController(const QualityControlConfig& cfg)
+    : config(cfg), current(0), started(false), probing(false), overloaded_windows(0), calm_sec(0),
+      recover_scale(1), last_reason("start"), encode_load(0), write_load(0), backlog_ratio(0),
+      vbv_kbps(0) {
+    for (const QualityRung& r : config.ladder) {
+        vbv_kbps = max(vbv_kbps, r.max_kbps);
+    }
+}
+
+void QualityController::configure_codec(AVCodecContext* codec) const {
+    // x264 only allows VBV to be reconfigured if it was on from the start,
+    // so open with the top rung's cap
+    if (vbv_kbps > 0) {
+        codec->rc_max_rate = static_cast<int64_t>(vbv_kbps) * 1000;
+        codec->rc_buffer_size = vbv_kbps * 1000;   // One second of VBV buffer
+    }
+}
+
+void QualityController::apply_bitrate(AVCodecContext* codec) const {
+    // An uncapped rung goes back to the ceiling the encoder was opened with
+    int kbps = rung().max_kbps > 0 ? rung().max_kbps : vbv_kbps;
+    if (kbps > 0) {
+        codec->rc_max_rate = static_cast<int64_t>(kbps) * 1000;
+        codec->rc_buffer_size = kbps * 1000;
+    }
+}
+
+bool QualityController::update(const PressureSample& sample, chrono::steady_clock::time_point now) {
+    if (!enabled()) {
+        return false;
+    }
+    if (!started) {
+        started = true;
+        window_start = now;
+        last = sample;
+        return false;
+    }
+    double elapsed = chrono::duration<double>(now - window_start).count();
+    if (elapsed < config.window_sec) {
+        return false;
+    }
+
+    // Time per frame in each stage against the interval the current rung
+    // allows it. Encoding runs on the shared pool and writing on its own
+    // thread, so either one near 1.0 means the stream can't keep up.
+    double interval_us = 1e6 / rung().fps;
+    uint64_t frames = sample.frames_encoded - last.frames_encoded;
+    uint64_t packets = sample.packets_written - last.packets_written;
+    encode_load = frames ? (sample.encode_us - last.encode_us) / static_cast<double>(frames) / interval_us : 0;
+    write_load = packets ? (sample.write_us - last.write_us) / static_cast<double>(packets) / interval_us : 0;
+    backlog_ratio = static_cast<double>(sample.backlog) / max<size_t>(sample.backlog_capacity, 1);
+    uint64_t dropped = sample.dropped - last.dropped;
+    uint64_t shed = sample.shed - last.shed;
+    last = sample;
+    window_start = now;
+
+    const char* pressure = nullptr;
+    if (write_load > config.overload || backlog_ratio >= 0.5 || shed > 0) {
+        pressure = "network";
+    } else if (encode_load > config.overload) {
+        pressure = "cpu";
+    } else if (dropped > 0) {
+        pressure = "drops";
+    }
+
+    if (pressure) {
+        calm_sec = 0;
+        // Two windows in a row, so a single keyframe or hiccup doesn't count
+        if (++overloaded_windows >= 2 && current + 1 < rung_count()) {
+            // A step down soon after stepping up means that rung didn't
+            // hold; wait longer before trying it again
+            if (probing && chrono::duration<double>(now - last_step_up).count() < config.recover_sec) {
+                recover_scale = min(recover_scale * 2, 8.0);
+            }
+            probing = false;
+            current++;
+            overloaded_windows = 0;
+            last_reason = pressure;
+            return true;
+        }
+        return false;
+    }
+
+    overloaded_windows = 0;
+    bool headroom = encode_load < config.headroom && write_load < config.headroom &&
+                    backlog_ratio < 0.25 && dropped == 0 && shed == 0;
+    if (!headroom) {
+        calm_sec = 0;
+        return false;
+    }
+    calm_sec += elapsed;
+    if (probing && chrono::duration<double>(now - last_step_up).count() >= config.recover_sec) {
+        probing = false;
+        recover_scale = max(recover_scale / 2, 1.0);
+    }
+    if (current > 0 && calm_sec >= config.recover_sec * recover_scale) {
+        current--;
+        calm_sec = 0;
+        probing = true;
+        last_step_up = now;
+        last_reason = "recovered";
+        return true;
+    }
+    return false;
+}
+
+QualityReport QualityController::report() const {
+    QualityReport r;
+    r.rung = current;
+    r.rungs = rung_count();
+    r.fps = rung().fps;
+    r.max_kbps = rung().max_kbps;
+    r.crf_offset = rung().crf_offset;
+    r.reason = last_reason;
+    r.encode_load = static_cast<float>(encode_load);
+    r.write_load = static_cast<float>(write_load);
+    r.backlog = static_cast<float>(backlog_ratio);
+    return r;
+}
@@ -0,0 +1,113 @@
+//
+// Closed-loop quality control: steps the encoder down a ladder of rungs
+// (frame rate, bitrate cap, CRF) when encoding or the network can't keep
+// up, and back up once the pressure has been gone for a while.
+//
+#ifndef OPENSENTRY_QUALITY_CONTROLLER_H
+#define OPENSENTRY_QUALITY_CONTROLLER_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// One step of the ladder. Everything here can change on a running x264
+// without new stream headers.
+struct QualityRung {
+    int fps = 30;          // Output frame rate cap
+    int max_kbps = 0;      // VBV max bitrate (0 = uncapped)
+    int crf_offset = 0;    // Added to the active/idle CRF
+};
+
+// Parses "fps:kbps[:crf_offset];..." best rung first. Frame rates are
+// capped at `max_fps`; malformed rungs are skipped with a warning.
+std::vector<QualityRung> parseQualityLadder(const std::string& spec, int max_fps);
+
+// Default ladder for a stream at `fps`
+std::string defaultQualityLadder(int fps);
+
+struct QualityControlConfig {
+    std::vector<QualityRung> ladder;  // Empty disables the controller
+    double window_sec = 2;            // Pressure is judged per window
+    double overload = 0.85;           // Share of the frame interval spent encoding/writing that counts as overload
+    double headroom = 0.5;            // ...and below which there is room to step up
+    double recover_sec = 15;          // Calm time before stepping back up
+};
+
+// Pipeline counters at one instant; the controller works on the change
+// between windows
+struct PressureSample {
+    uint64_t encode_us = 0;        // Cumulative time in the encoder
+    uint64_t frames_encoded = 0;
+    uint64_t write_us = 0;         // Cumulative time in av_interleaved_write_frame
+    uint64_t packets_written = 0;
+    uint64_t dropped = 0;          // Cumulative frames dropped between stages
+    uint64_t shed = 0;             // Cumulative packets the output queue dropped
+    size_t backlog = 0;            // Packets waiting for the writer now
+    size_t backlog_capacity = 1;
+};
+
+// The controller's state after a change, for opensentry/<id>/quality.
+// Plain data so it can travel through the MQTT event queue.
+struct QualityReport {
+    int rung = 0;
+    int rungs = 0;
+    int fps = 0;
+    int max_kbps = 0;
+    int crf_offset = 0;
+    const char* reason = "";   // Static string
+    float encode_load = 0;
+    float write_load = 0;
+    float backlog = 0;
+};
+
+class QualityController {
+public:
+    explicit QualityController(const QualityControlConfig& config);
+
+    bool enabled() const { return !config.ladder.empty(); }
+
+    // Call before avcodec_open2: x264 has to start with VBV on, or the cap
+    // can't be changed later
+    void configure_codec(AVCodecContext* codec) const;
+
+    // Feeds the current counters. Returns true at most once per window,
+    // when the rung changed; apply it with apply_bitrate() and rung().
+    bool update(const PressureSample& sample, std::chrono::steady_clock::time_point now);
+
+    // Sets the VBV cap of the current rung; libx264 reconfigures before
+    // the next frame
+    void apply_bitrate(AVCodecContext* codec) const;
+
+    const QualityRung& rung() const { return config.ladder[current]; }
+    int rung_index() const { return current; }
+    int rung_count() const { return static_cast<int>(config.ladder.size()); }
+
+    // Why the last change happened ("cpu", "drops", "network", "recovered")
+    const char* reason() const { return last_reason; }
+
+    QualityReport report() const;
+
+private:
+    QualityControlConfig config;
+    int current;
+    bool started;
+    bool probing;              // Stepped up and not yet proven stable
+    std::chrono::steady_clock::time_point window_start;
+    std::chrono::steady_clock::time_point last_step_up;
+    PressureSample last;
+    int overloaded_windows;
+    double calm_sec;
+    double recover_scale;      // Grows when a step up didn't hold
+    const char* last_reason;
+    double encode_load;
+    double write_load;
+    double backlog_ratio;
+    int vbv_kbps;              // Highest cap on the ladder, set at open
+};
+
+#endif // OPENSENTRY_QUALITY_CONTROLLER_H
@@ -0,0 +1,148 @@
+//
+// Motion snapshots
+//
+#include "snapshot.h"
+
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+using namespace cv;
+using namespace std;
+
+void SnapshotCache::add(shared_ptr<const Snapshot> snapshot) {
+    entries.push_back(move(snapshot));
+    while (entries.size() > capacity) {
+        entries.pop_front();
+    }
+}
+
+vector<shared_ptr<const Snapshot>> SnapshotCache::recent() const {
+    return vector<shared_ptr<const Snapshot>>(entries.begin(), entries.end());
+}
+
+SnapshotMaker::SnapshotMaker(const SnapshotConfig& cfg, int w, int h, AVPixelFormat fmt, size_t count)
+    : config(cfg), width(w), height(h), format(fmt), next_id(1), skipped(0), scaler(nullptr) {
+    if (!enabled()) return;
+    // Frames are only allocated when snapshots are on; at 1080p each is 3 MB
+    slots.resize(count);
+    for (Slot& slot : slots) {
+        slot.frame = av_frame_alloc();
+        slot.frame->format = format;
+        slot.frame->width = width;
+        slot.frame->height = height;
+        av_frame_get_buffer(slot.frame, 0);
+        free_slots.push_back(&slot);
+    }
+    jpeg_params = {IMWRITE_JPEG_QUALITY, max(1, min(100, config.quality))};
+}
+
+SnapshotMaker::~SnapshotMaker() {
+    for (Slot& slot : slots) {
+        av_frame_free(&slot.frame);
+    }
+    sws_freeContext(scaler);
+}
+
+uint32_t SnapshotMaker::capture(const AVFrame* frame, const Rect& region, int64_t timestamp) {
+    if (!enabled()) return 0;
+    Slot* slot;
+    {
+        lock_guard<mutex> lock(slots_mutex);
+        if (free_slots.empty()) {
+            skipped++;
+            return 0;
+        }
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    // The one full-size copy; everything else happens on the worker
+    av_frame_copy(slot->frame, frame);
+    slot->region = region;
+    slot->timestamp = timestamp;
+    slot->id = next_id++;
+
+    lock_guard<mutex> lock(slots_mutex);
+    pending.push_back(slot);
+    return slot->id;
+}
+
+void SnapshotMaker::encode_pending(const function<void(shared_ptr<const Snapshot>)>& done) {
+    while (true) {
+        Slot* slot;
+        {
+            lock_guard<mutex> lock(slots_mutex);
+            if (pending.empty()) return;
+            slot = pending.front();
+            pending.pop_front();
+        }
+        shared_ptr<Snapshot> snapshot = make_shared<Snapshot>();
+        bool ok = encode(*slot, *snapshot);
+        {
+            lock_guard<mutex> lock(slots_mutex);
+            free_slots.push_back(slot);
+        }
+        if (ok) {
+            done(snapshot);
+        }
+    }
+}
+
+Rect SnapshotMaker::source_area(const Rect& region) const {
+    Rect area(0, 0, width, height);
+    if (config.crop && region.area() > 0) {
+        int mx = static_cast<int>(region.width * config.crop_margin);
+        int my = static_cast<int>(region.height * config.crop_margin);
+        area = Rect(region.x - mx, region.y - my, region.width + 2 * mx, region.height + 2 * my) &
+               Rect(0, 0, width, height);
+    }
+    // Chroma is subsampled 2x2 in both formats: keep the crop on even pixels
+    area.x &= ~1;
+    area.y &= ~1;
+    area.width = max(2, area.width & ~1);
+    area.height = max(2, area.height & ~1);
+    return area;
+}
+
+bool SnapshotMaker::encode(const Slot& slot, Snapshot& out) {
+    Rect area = source_area(slot.region);
+    int out_w = min(config.width, area.width) & ~1;
+    int out_h = max(2, static_cast<int>(lround(static_cast<double>(out_w) * area.height / area.width)) & ~1);
+
+    // Point the scaler at the crop inside the planes instead of copying it
+    const AVFrame* f = slot.frame;
+    const uint8_t* src[4] = {nullptr, nullptr, nullptr, nullptr};
+    int strides[4] = {0, 0, 0, 0};
+    src[0] = f->data[0] + area.y * f->linesize[0] + area.x;
+    strides[0] = f->linesize[0];
+    if (format == AV_PIX_FMT_NV12) {
+        src[1] = f->data[1] + (area.y / 2) * f->linesize[1] + area.x;
+        strides[1] = f->linesize[1];
+    } else {
+        src[1] = f->data[1] + (area.y / 2) * f->linesize[1] + area.x / 2;
+        src[2] = f->data[2] + (area.y / 2) * f->linesize[2] + area.x / 2;
+        strides[1] = f->linesize[1];
+        strides[2] = f->linesize[2];
+    }
+
+    scaler = sws_getCachedContext(scaler, area.width, area.height, format,
+                                  out_w, out_h, AV_PIX_FMT_BGR24,
+                                  SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!scaler) {
+        cerr << "[Snapshot] Cannot scale " << area.width << "x" << area.height << " to " << out_w << "x" << out_h << endl;
+        return false;
+    }
+    bgr.create(out_h, out_w, CV_8UC3);
+    uint8_t* dst[] = {bgr.data};
+    const int dst_stride[] = {static_cast<int>(bgr.step[0])};
+    sws_scale(scaler, src, strides, 0, area.height, dst, dst_stride);
+
+    if (!imencode(".jpg", bgr, out.jpeg, jpeg_params)) {
+        cerr << "[Snapshot] JPEG encoding failed" << endl;
+        return false;
+    }
+    out.id = slot.id;
+    out.timestamp = slot.timestamp;
+    return true;
+}
@@ -0,0 +1,102 @@
+//
+// Motion snapshots: a downscaled JPEG of the frame that started a motion
+// event, so a dashboard can show what triggered it without decoding the
+// stream. The motion stage only copies the frame into a pooled buffer;
+// cropping, scaling and JPEG encoding run on a worker.
+//
+#ifndef OPENSENTRY_SNAPSHOT_H
+#define OPENSENTRY_SNAPSHOT_H
+
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+struct SnapshotConfig {
+    int width = 320;             // Thumbnail width (0 disables snapshots)
+    bool crop = false;           // Crop to the motion box instead of the whole frame
+    double crop_margin = 0.25;   // Extra context around the box, as a share of its size
+    int quality = 80;            // JPEG quality (1-100)
+    size_t cache_size = 8;       // Thumbnails kept per camera for re-sending
+};
+
+struct Snapshot {
+    uint32_t id = 0;             // Per camera, from 1
+    int64_t timestamp = 0;       // Unix seconds of the triggering frame
+    std::vector<uint8_t> jpeg;
+};
+
+// The last few snapshots of one camera, newest last
+class SnapshotCache {
+public:
+    explicit SnapshotCache(size_t capacity) : capacity(capacity) {}
+
+    void add(std::shared_ptr<const Snapshot> snapshot);
+    std::vector<std::shared_ptr<const Snapshot>> recent() const;
+
+private:
+    size_t capacity;
+    std::deque<std::shared_ptr<const Snapshot>> entries;
+};
+
+class SnapshotMaker {
+public:
+    // For frames of `width` x `height` in `format` (YUV420P or NV12).
+    // `slots` frame copies can be waiting for the worker at once.
+    SnapshotMaker(const SnapshotConfig& config, int width, int height, AVPixelFormat format,
+                  size_t slots = 2);
+    ~SnapshotMaker();
+
+    SnapshotMaker(const SnapshotMaker&) = delete;
+    SnapshotMaker& operator=(const SnapshotMaker&) = delete;
+
+    bool enabled() const { return config.width > 0; }
+
+    // Motion stage: copies `frame` for the worker. Returns the snapshot's
+    // id, or 0 if every slot is still busy (the snapshot is skipped rather
+    // than waiting).
+    uint32_t capture(const AVFrame* frame, const cv::Rect& region, int64_t timestamp);
+
+    // Worker: encodes every captured frame and hands each result to `done`
+    void encode_pending(const std::function<void(std::shared_ptr<const Snapshot>)>& done);
+
+    uint64_t skipped_count() const { return skipped; }
+
+private:
+    struct Slot {
+        AVFrame* frame = nullptr;
+        cv::Rect region;
+        uint32_t id = 0;
+        int64_t timestamp = 0;
+    };
+
+    // Area to encode: the whole frame, or the padded motion box
+    cv::Rect source_area(const cv::Rect& region) const;
+    bool encode(const Slot& slot, Snapshot& out);
+
+    SnapshotConfig config;
+    int width;
+    int height;
+    AVPixelFormat format;
+    std::vector<Slot> slots;
+    std::vector<Slot*> free_slots;
+    std::deque<Slot*> pending;
+    std::mutex slots_mutex;       // Guards free_slots and pending only
+    uint32_t next_id;
+    uint64_t skipped;
+
+    // Worker-side scratch, reused between snapshots
+    SwsContext* scaler;
+    cv::Mat bgr;
+    std::vector<int> jpeg_params;
+};
+
+#endif // OPENSENTRY_SNAPSHOT_H
@@ -0,0 +1,74 @@
+//
+// Bounded lock-free single-producer/single-consumer ring
+//
+#ifndef OPENSENTRY_SPSC_RING_H
+#define OPENSENTRY_SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Fixed-capacity FIFO shared by exactly one producer thread and one consumer
+// thread. Storage is allocated once in the constructor; push/pop never
+// allocate or lock. Capacity is rounded up to a power of two.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t requested_capacity)
+        : mask(capacity_for(requested_capacity) - 1),
+          buffer(mask + 1), head(0), tail(0) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Capacity a ring constructed with `requested_capacity` ends up with
+    static size_t capacity_for(size_t requested_capacity) {
+        return round_up_pow2(requested_capacity < 2 ? 2 : requested_capacity);
+    }
+
+    // Producer side. Returns false if the ring is full.
+    bool try_push(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) {
+            return false;
+        }
+        buffer[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the ring is empty.
+    bool try_pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = buffer[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate when called from a third thread; exact from either end.
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return mask + 1; }
+
+private:
+    static size_t round_up_pow2(size_t v) {
+        size_t p = 1;
+        while (p < v) p <<= 1;
+        return p;
+    }
+
+    const size_t mask;
+    std::vector<T> buffer;
+    // Producer and consumer indices live on separate cache lines so the two
+    // threads don't false-share.
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+#endif // OPENSENTRY_SPSC_RING_H
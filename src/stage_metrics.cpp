@@ -0,0 +1,309 @@
+//
+// Pipeline instrumentation
+//
+#include "stage_metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+
+// Indices into MetricsReporter's counter arrays
+enum Counter { Captured, Analysed, FramesEncoded, PacketsEncoded, Written, SubstreamEncoded, SubstreamWritten,
+               CounterCount };
+
+string fixed(double value, int decimals) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+    return buf;
+}
+
+// Label values may not contain raw quotes, backslashes or newlines
+string promLabel(const string& value) {
+    string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') out += '\\';
+        if (c == '\n') {
+            out += "\\n";
+            continue;
+        }
+        out += c;
+    }
+    return out;
+}
+
+} // namespace
+
+// ============================================================================
+// Histogram
+// ============================================================================
+LatencyHistogram::LatencyHistogram() : sum_us(0) {
+    for (int b = 0; b < kBuckets; b++) {
+        counts[b].store(0, memory_order_relaxed);
+    }
+}
+
+int LatencyHistogram::bucketFor(uint64_t us) {
+    if (us < static_cast<uint64_t>(kSubCount)) return static_cast<int>(us);
+    int exponent = 63 - __builtin_clzll(us);
+    if (exponent > kMaxExponent) return kBuckets - 1;
+    int sub = static_cast<int>((us >> (exponent - kSubBits)) & (kSubCount - 1));
+    return (exponent - kSubBits + 1) * kSubCount + sub;
+}
+
+uint64_t LatencyHistogram::bucketValue(int bucket) {
+    if (bucket < kSubCount) return static_cast<uint64_t>(bucket);
+    int group = bucket / kSubCount;
+    uint64_t low = static_cast<uint64_t>(kSubCount + bucket % kSubCount) << (group - 1);
+    uint64_t width = 1ull << (group - 1);
+    return low + width / 2;
+}
+
+void LatencyHistogram::snapshot(HistogramSnapshot& out) const {
+    out.counts.resize(kBuckets);
+    out.count = 0;
+    for (int b = 0; b < kBuckets; b++) {
+        out.counts[b] = counts[b].load(memory_order_relaxed);
+        out.count += out.counts[b];
+    }
+    out.sum_us = sum_us.load(memory_order_relaxed);
+}
+
+HistogramSnapshot HistogramSnapshot::since(const HistogramSnapshot& earlier) const {
+    HistogramSnapshot delta;
+    delta.counts.resize(counts.size());
+    for (size_t b = 0; b < counts.size(); b++) {
+        uint64_t before = b < earlier.counts.size() ? earlier.counts[b] : 0;
+        delta.counts[b] = counts[b] - before;
+        delta.count += delta.counts[b];
+    }
+    delta.sum_us = sum_us - earlier.sum_us;
+    return delta;
+}
+
+uint64_t HistogramSnapshot::percentile(double q) const {
+    if (count == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(ceil(q * count)));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < counts.size(); b++) {
+        seen += counts[b];
+        if (seen >= rank) return LatencyHistogram::bucketValue(static_cast<int>(b));
+    }
+    return max();
+}
+
+uint64_t HistogramSnapshot::max() const {
+    for (size_t b = counts.size(); b-- > 0;) {
+        if (counts[b]) return LatencyHistogram::bucketValue(static_cast<int>(b));
+    }
+    return 0;
+}
+
+const char* stageName(Stage stage) {
+    switch (stage) {
+        case Stage::CaptureWait: return "capture_wait";
+        case Stage::Convert: return "convert";
+        case Stage::Prefilter: return "prefilter";
+        case Stage::DecodeMotion: return "decode_motion";
+        case Stage::DecodeEncode: return "decode_encode";
+        case Stage::MotionPrepare: return "motion_prepare";
+        case Stage::MotionDetect: return "motion_detect";
+        case Stage::Encode: return "encode";
+        case Stage::Write: return "write";
+        case Stage::SubstreamScale: return "substream_scale";
+        case Stage::SubstreamEncode: return "substream_encode";
+        case Stage::SubstreamWrite: return "substream_write";
+        case Stage::Count: break;
+    }
+    return "unknown";
+}
+
+// ============================================================================
+// Reporter
+// ============================================================================
+MetricsReporter::MetricsReporter(const PipelineMetrics& metrics, const string& camera_id)
+    : source(metrics), camera(camera_id), last_time(chrono::steady_clock::now()),
+      interval_sec(0), detection_idle(false), cadence_changes(0), first_packet_ms(-1) {
+    fill(last_counters, last_counters + CounterCount, 0);
+    fill(counters, counters + CounterCount, 0);
+    for (int s = 0; s < PipelineMetrics::kStages; s++) {
+        source.latency[s].snapshot(last_totals[s]);
+    }
+}
+
+void MetricsReporter::sample(const vector<QueueStats>& queues) {
+    auto now = chrono::steady_clock::now();
+    interval_sec = chrono::duration<double>(now - last_time).count();
+    last_time = now;
+
+    copy(counters, counters + CounterCount, last_counters);
+    counters[Captured] = source.frames_captured.load(memory_order_relaxed);
+    counters[Analysed] = source.frames_analysed.load(memory_order_relaxed);
+    counters[FramesEncoded] = source.frames_encoded.load(memory_order_relaxed);
+    counters[PacketsEncoded] = source.packets_encoded.load(memory_order_relaxed);
+    counters[Written] = source.packets_written.load(memory_order_relaxed);
+    counters[SubstreamEncoded] = source.substream_frames.load(memory_order_relaxed);
+    counters[SubstreamWritten] = source.substream_written.load(memory_order_relaxed);
+    detection_idle = source.detection_idle.load(memory_order_relaxed);
+    cadence_changes = source.cadence_changes.load(memory_order_relaxed);
+    first_packet_ms = source.first_packet_ms.load(memory_order_relaxed);
+
+    for (int s = 0; s < PipelineMetrics::kStages; s++) {
+        source.latency[s].snapshot(totals[s]);
+        window[s] = totals[s].since(last_totals[s]);
+        swap(last_totals[s], totals[s]);
+    }
+    queue_stats = queues;
+}
+
+string MetricsReporter::json() const {
+    double dt = interval_sec > 0 ? interval_sec : 1;
+    auto rate = [&](int c) { return fixed((counters[c] - last_counters[c]) / dt, 1); };
+
+    string json = "{"
+        "\"timestamp\": " + to_string(time(nullptr)) + ","
+        "\"interval\": " + fixed(interval_sec, 1) + ","
+        "\"fps\": {"
+            "\"capture\": " + rate(Captured) + ","
+            "\"analyse\": " + rate(Analysed) + ","
+            "\"encode\": " + rate(FramesEncoded) + ","
+            "\"output\": " + rate(Written) + ","
+            "\"substream\": " + rate(SubstreamEncoded) + ","
+            "\"substream_output\": " + rate(SubstreamWritten) + "},"
+        // Frames sent to x264 that have not come out yet (lookahead, threads)
+        "\"encoder_pending\": " + to_string(counters[FramesEncoded] - counters[PacketsEncoded]) + ","
+        // idle: analysing at MOTION_IDLE_FPS; changes are cumulative
+        "\"detection\": {"
+            "\"cadence\": \"" + string(detection_idle ? "idle" : "every_frame") + "\","
+            "\"changes\": " + to_string(cadence_changes) + "},"
+        // Startup to the first packet sent; null while still connecting
+        "\"first_packet_ms\": " + (first_packet_ms >= 0 ? to_string(first_packet_ms) : "null") + ",";
+
+    json += "\"queues\": {";
+    for (size_t q = 0; q < queue_stats.size(); q++) {
+        const QueueStats& stats = queue_stats[q];
+        if (q) json += ",";
+        json += string("\"") + stats.name + "\": {"
+            "\"depth\": " + to_string(stats.depth) + ","
+            "\"capacity\": " + to_string(stats.capacity) + ","
+            "\"dropped\": " + to_string(stats.dropped) + "}";
+    }
+    json += "},";
+
+    // busy: share of wall time the stage spent in this step, so a value
+    // near 1 marks the stage that limits the frame rate
+    json += "\"stages\": {";
+    for (int s = 0; s < PipelineMetrics::kStages; s++) {
+        const HistogramSnapshot& h = window[s];
+        if (s) json += ",";
+        json += string("\"") + stageName(static_cast<Stage>(s)) + "\": {"
+            "\"count\": " + to_string(h.count) + ","
+            "\"p50_us\": " + to_string(h.percentile(0.5)) + ","
+            "\"p99_us\": " + to_string(h.percentile(0.99)) + ","
+            "\"max_us\": " + to_string(h.max()) + ","
+            "\"busy\": " + fixed(h.sum_us / (dt * 1e6), 3) + "}";
+    }
+    json += "}}";
+    return json;
+}
+
+string MetricsReporter::prometheus(const vector<const MetricsReporter*>& reporters) {
+    // Each metric family is written once with a series per camera
+    const char* names[] = {"capture", "analyse", "encode", "encoder_output", "output",
+                           "substream_encode", "substream_output"};
+    ostringstream out;
+
+    out << "# HELP opensentry_stage_latency_seconds Pipeline stage latency over the last reporting interval\n"
+        << "# TYPE opensentry_stage_latency_seconds summary\n";
+    for (const MetricsReporter* r : reporters) {
+        string cam = "camera=\"" + promLabel(r->camera) + "\"";
+        for (int s = 0; s < PipelineMetrics::kStages; s++) {
+            string labels = cam + ",stage=\"" + stageName(static_cast<Stage>(s)) + "\"";
+            const HistogramSnapshot& h = r->window[s];
+            const HistogramSnapshot& total = r->last_totals[s];  // Swapped in by sample()
+            out << "opensentry_stage_latency_seconds{" << labels << ",quantile=\"0.5\"} "
+                << fixed(h.percentile(0.5) / 1e6, 6) << "\n"
+                << "opensentry_stage_latency_seconds{" << labels << ",quantile=\"0.99\"} "
+                << fixed(h.percentile(0.99) / 1e6, 6) << "\n"
+                << "opensentry_stage_latency_seconds_sum{" << labels << "} "
+                << fixed(total.sum_us / 1e6, 6) << "\n"
+                << "opensentry_stage_latency_seconds_count{" << labels << "} " << total.count << "\n";
+        }
+    }
+
+    out << "# HELP opensentry_frames_total Frames through each pipeline point\n"
+        << "# TYPE opensentry_frames_total counter\n";
+    for (const MetricsReporter* r : reporters) {
+        string cam = "camera=\"" + promLabel(r->camera) + "\"";
+        for (int c = 0; c < CounterCount; c++) {
+            out << "opensentry_frames_total{" << cam << ",point=\"" << names[c] << "\"} " << r->counters[c] << "\n";
+        }
+    }
+    out << "# HELP opensentry_fps Frame rate over the last reporting interval\n"
+        << "# TYPE opensentry_fps gauge\n";
+    for (const MetricsReporter* r : reporters) {
+        string cam = "camera=\"" + promLabel(r->camera) + "\"";
+        double dt = r->interval_sec > 0 ? r->interval_sec : 1;
+        for (int c = 0; c < CounterCount; c++) {
+            out << "opensentry_fps{" << cam << ",point=\"" << names[c] << "\"} "
+                << fixed((r->counters[c] - r->last_counters[c]) / dt, 2) << "\n";
+        }
+    }
+
+    out << "# HELP opensentry_detection_idle 1 while motion detection runs at the idle rate, 0 while it analyses every frame\n"
+        << "# TYPE opensentry_detection_idle gauge\n";
+    for (const MetricsReporter* r : reporters) {
+        out << "opensentry_detection_idle{camera=\"" << promLabel(r->camera) << "\"} " << (r->detection_idle ? 1 : 0) << "\n";
+    }
+    out << "# HELP opensentry_detection_cadence_changes_total Switches between idle and every-frame detection\n"
+        << "# TYPE opensentry_detection_cadence_changes_total counter\n";
+    for (const MetricsReporter* r : reporters) {
+        out << "opensentry_detection_cadence_changes_total{camera=\"" << promLabel(r->camera) << "\"} "
+            << r->cadence_changes << "\n";
+    }
+
+    out << "# HELP opensentry_time_to_first_packet_seconds Process start to the first packet sent\n"
+        << "# TYPE opensentry_time_to_first_packet_seconds gauge\n";
+    for (const MetricsReporter* r : reporters) {
+        if (r->first_packet_ms < 0) continue;
+        out << "opensentry_time_to_first_packet_seconds{camera=\"" << promLabel(r->camera) << "\"} "
+            << fixed(r->first_packet_ms / 1e3, 3) << "\n";
+    }
+
+    out << "# HELP opensentry_queue_depth Items waiting between pipeline stages\n"
+        << "# TYPE opensentry_queue_depth gauge\n";
+    for (const MetricsReporter* r : reporters) {
+        string cam = "camera=\"" + promLabel(r->camera) + "\"";
+        for (const QueueStats& q : r->queue_stats) {
+            out << "opensentry_queue_depth{" << cam << ",queue=\"" << q.name << "\"} " << q.depth << "\n";
+        }
+        out << "opensentry_queue_depth{" << cam << ",queue=\"encoder\"} "
+            << r->counters[FramesEncoded] - r->counters[PacketsEncoded] << "\n";
+    }
+    out << "# HELP opensentry_dropped_frames_total Frames dropped by a full queue\n"
+        << "# TYPE opensentry_dropped_frames_total counter\n";
+    for (const MetricsReporter* r : reporters) {
+        string cam = "camera=\"" + promLabel(r->camera) + "\"";
+        for (const QueueStats& q : r->queue_stats) {
+            out << "opensentry_dropped_frames_total{" << cam << ",queue=\"" << q.name << "\"} " << q.dropped << "\n";
+        }
+    }
+    return out.str();
+}
+
+bool MetricsReporter::write_prometheus(const string& path, const vector<const MetricsReporter*>& reporters) {
+    string tmp = path + ".tmp";
+    {
+        ofstream file(tmp, ios::trunc);
+        if (!file) return false;
+        file << prometheus(reporters);
+        if (!file) return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
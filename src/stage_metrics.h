@@ -0,0 +1,160 @@
+//
+// Pipeline instrumentation: lock-free per-stage latency histograms and
+// frame counters, sampled periodically into JSON (MQTT) and Prometheus text.
+//
+#ifndef OPENSENTRY_STAGE_METRICS_H
+#define OPENSENTRY_STAGE_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Copy of a histogram's cumulative counts at one point in time
+struct HistogramSnapshot {
+    std::vector<uint64_t> counts;
+    uint64_t count = 0;
+    uint64_t sum_us = 0;
+
+    // What was recorded between `earlier` and this snapshot
+    HistogramSnapshot since(const HistogramSnapshot& earlier) const;
+
+    // Value at quantile `q` (0..1) in microseconds, 0 when empty
+    uint64_t percentile(double q) const;
+    uint64_t max() const;
+};
+
+// HDR-style log-linear histogram of durations in microseconds: exact below
+// 16 us, then 16 buckets per power of two (about 6% resolution) up to ~70
+// minutes. Recording is two relaxed atomic stores with no locks or RMW,
+// which is only correct with one writer at a time per histogram (a stage
+// thread, or a worker pool strand); any thread may take snapshots.
+class LatencyHistogram {
+public:
+    static const int kSubBits = 4;
+    static const int kSubCount = 1 << kSubBits;
+    static const int kMaxExponent = 31;
+    static const int kBuckets = (kMaxExponent - kSubBits + 2) * kSubCount;
+
+    LatencyHistogram();
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record_us(uint64_t us) {
+        std::atomic<uint64_t>& bucket = counts[bucketFor(us)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum_us.store(sum_us.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+    }
+
+    template <typename Rep, typename Period>
+    void record(std::chrono::duration<Rep, Period> elapsed) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        record_us(us > 0 ? static_cast<uint64_t>(us) : 0);
+    }
+
+    void record_since(std::chrono::steady_clock::time_point start) {
+        record(std::chrono::steady_clock::now() - start);
+    }
+
+    void snapshot(HistogramSnapshot& out) const;
+
+    // Cumulative recorded time, without copying the buckets
+    uint64_t total_us() const { return sum_us.load(std::memory_order_relaxed); }
+
+    static int bucketFor(uint64_t us);
+    static uint64_t bucketValue(int bucket);  // Midpoint of the bucket's range
+
+private:
+    std::atomic<uint64_t> counts[kBuckets];
+    std::atomic<uint64_t> sum_us;
+};
+
+// Timed pipeline stages. Each is recorded by exactly one stage.
+enum class Stage {
+    CaptureWait,    // Source read: waiting for and dequeuing the next frame
+    Convert,        // BGR -> YUV420P sws_scale (OpenCV sources only)
+    Prefilter,      // MJPEG DC extraction and block compare (MJPEG capture only)
+    DecodeMotion,   // Full MJPEG decode of a frame motion analyses in detail
+    DecodeEncode,   // Full MJPEG decode of a frame only the encoder needs
+    MotionPrepare,  // Luma decimation and blur
+    MotionDetect,   // Fused diff/threshold/dilate kernel and zone evaluation
+    Encode,         // avcodec_send_frame + avcodec_receive_packet
+    Write,          // av_interleaved_write_frame
+    SubstreamScale,   // Scaling a frame for the substream (on the encode strand)
+    SubstreamEncode,  // Substream avcodec_send_frame + avcodec_receive_packet
+    SubstreamWrite,   // Substream av_interleaved_write_frame
+    Count
+};
+
+const char* stageName(Stage stage);
+
+struct PipelineMetrics {
+    static const int kStages = static_cast<int>(Stage::Count);
+
+    LatencyHistogram latency[kStages];
+    std::atomic<uint64_t> frames_captured{0};  // Delivered to motion (paused skips excluded)
+    std::atomic<uint64_t> frames_analysed{0};  // Run through the motion detector
+    std::atomic<uint64_t> frames_encoded{0};   // Sent to the encoder
+    std::atomic<uint64_t> packets_encoded{0};  // Received from the encoder
+    std::atomic<uint64_t> packets_written{0};  // Handed to the muxer
+    std::atomic<uint64_t> substream_frames{0};   // Sent to the substream encoder
+    std::atomic<uint64_t> substream_written{0};  // Substream packets handed to its muxer
+
+    // Detection cadence, as set by the motion stage's scheduler
+    std::atomic<bool> detection_idle{false};
+    std::atomic<uint64_t> cadence_changes{0};  // Idle <-> every frame, either way
+
+    // Process start to the first main-stream packet written, -1 until then
+    std::atomic<int64_t> first_packet_ms{-1};
+
+    LatencyHistogram& operator[](Stage stage) { return latency[static_cast<int>(stage)]; }
+};
+
+// State of one inter-stage queue at sampling time
+struct QueueStats {
+    const char* name;
+    size_t depth;
+    size_t capacity;
+    uint64_t dropped;   // Cumulative
+};
+
+// Turns successive samples of PipelineMetrics into per-interval reports.
+// Only used from one (reporting) thread.
+class MetricsReporter {
+public:
+    MetricsReporter(const PipelineMetrics& metrics, const std::string& camera_id);
+
+    // Closes the interval since the previous sample (or construction)
+    void sample(const std::vector<QueueStats>& queues);
+
+    // Report of the last interval for opensentry/<id>/metrics
+    std::string json() const;
+
+    // Prometheus text exposition format for one or more cameras; quantiles
+    // cover the last interval, counters are cumulative
+    static std::string prometheus(const std::vector<const MetricsReporter*>& reporters);
+
+    // Writes prometheus() to `path` via a temporary file and rename, so a
+    // scraper (e.g. node_exporter's textfile collector) never sees half a file
+    static bool write_prometheus(const std::string& path,
+                                 const std::vector<const MetricsReporter*>& reporters);
+
+private:
+    const PipelineMetrics& source;
+    std::string camera;
+
+    std::chrono::steady_clock::time_point last_time;
+    double interval_sec;
+    uint64_t last_counters[7];
+    uint64_t counters[7];
+    bool detection_idle;
+    uint64_t cadence_changes;
+    int64_t first_packet_ms;
+    HistogramSnapshot last_totals[PipelineMetrics::kStages];
+    HistogramSnapshot totals[PipelineMetrics::kStages];
+    HistogramSnapshot window[PipelineMetrics::kStages];
+    std::vector<QueueStats> queue_stats;
+};
+
+#endif // OPENSENTRY_STAGE_METRICS_H
@@ -0,0 +1,222 @@
+//
+// Stream output and its packet queue
+//
+#include "stream_output.h"
+
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+namespace {
+
+int64_t steadyMicros() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace
+
+// ============================================================================
+// OutputQueue
+// ============================================================================
+OutputQueue::OutputQueue(size_t capacity)
+    : cap(capacity), queued(capacity), head(0), count(0),
+      waiting_for_key(false), keyframe_wanted(false), dropped(0), gop_drops(0) {
+    // The queue plus the packet the writer holds
+    for (size_t i = 0; i < cap + 1; i++) {
+        storage.push_back(av_packet_alloc());
+    }
+    free_packets = storage;
+}
+
+OutputQueue::~OutputQueue() {
+    for (AVPacket* pkt : storage) {
+        av_packet_free(&pkt);
+    }
+}
+
+void OutputQueue::push(AVPacket* pkt) {
+    lock_guard<std::mutex> lock(mutex);
+    if (count >= cap) {
+        shed();
+    }
+    bool key = pkt->flags & AV_PKT_FLAG_KEY;
+    if (waiting_for_key && !key) {
+        av_packet_unref(pkt);
+        dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    waiting_for_key = false;
+
+    // shed() always frees a packet, and the writer holds at most one
+    AVPacket* out = free_packets.back();
+    free_packets.pop_back();
+    av_packet_move_ref(out, pkt);
+    at(count++) = out;
+    cond.notify_one();
+}
+
+bool OutputQueue::pop(AVPacket*& pkt, const atomic<bool>& running) {
+    unique_lock<std::mutex> lock(mutex);
+    while (count == 0) {
+        if (!running) return false;
+        // Timed so a stop request is noticed even if nothing is encoded
+        cond.wait_for(lock, chrono::milliseconds(10));
+    }
+    pkt = at(0);
+    head = (head + 1) % cap;
+    count--;
+    return true;
+}
+
+void OutputQueue::recycle(AVPacket* pkt) {
+    av_packet_unref(pkt);
+    lock_guard<std::mutex> lock(mutex);
+    free_packets.push_back(pkt);
+}
+
+void OutputQueue::restart() {
+    lock_guard<std::mutex> lock(mutex);
+    discard(count);
+    waiting_for_key = true;
+    keyframe_wanted = true;
+}
+
+size_t OutputQueue::depth() const {
+    lock_guard<std::mutex> lock(mutex);
+    return count;
+}
+
+void OutputQueue::shed() {
+    // Nothing references a disposable frame, so it goes without a trace
+    for (size_t i = 0; i < count; i++) {
+        if (at(i)->flags & AV_PKT_FLAG_DISPOSABLE) {
+            av_packet_unref(at(i));
+            free_packets.push_back(at(i));
+            // Close the gap by moving the newer packets up one
+            for (size_t j = i + 1; j < count; j++) {
+                at(j - 1) = at(j);
+            }
+            count--;
+            dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    // Otherwise the oldest GOP: the decoder freezes on the last frame it
+    // had until the keyframe that follows
+    gop_drops.fetch_add(1, memory_order_relaxed);
+    for (size_t i = 1; i < count; i++) {
+        if (at(i)->flags & AV_PKT_FLAG_KEY) {
+            discard(i);
+            return;
+        }
+    }
+    discard(count);
+    waiting_for_key = true;
+    keyframe_wanted = true;
+}
+
+void OutputQueue::discard(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        av_packet_unref(at(0));
+        free_packets.push_back(at(0));
+        head = (head + 1) % cap;
+        count--;
+    }
+    dropped.fetch_add(n, memory_order_relaxed);
+}
+
+// ============================================================================
+// StreamOutput
+// ============================================================================
+StreamOutput::StreamOutput(const string& url, const char* format,
+                           chrono::milliseconds io_timeout, const atomic<bool>& run)
+    : target(url), format_name(format), timeout(io_timeout), running(run),
+      ctx(nullptr), stream(nullptr), codec_time_base({1, 90000}),
+      header_written(false), closing(false), deadline_us(0) {}
+
+StreamOutput::~StreamOutput() {
+    close(true);
+}
+
+bool StreamOutput::create() {
+    avformat_alloc_output_context2(&ctx, nullptr, format_name, target.c_str());
+    if (!ctx) {
+        return false;
+    }
+    ctx->interrupt_callback.callback = interrupted;
+    ctx->interrupt_callback.opaque = this;
+    return true;
+}
+
+bool StreamOutput::needs_global_header() const {
+    return ctx && (ctx->oformat->flags & AVFMT_GLOBALHEADER);
+}
+
+StreamOutput::Status StreamOutput::connect(const AVCodecContext* codec) {
+    stream = avformat_new_stream(ctx, nullptr);
+    if (!stream) {
+        return Status::NoMuxer;
+    }
+    avcodec_parameters_from_context(stream->codecpar, codec);
+    stream->time_base = codec->time_base;
+    codec_time_base = codec->time_base;
+
+    arm();
+    if (!(ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open2(&ctx->pb, target.c_str(), AVIO_FLAG_WRITE, &ctx->interrupt_callback, nullptr) < 0) {
+            return Status::CannotOpen;
+        }
+    }
+    if (avformat_write_header(ctx, nullptr) < 0) {
+        return Status::HeaderFailed;
+    }
+    header_written = true;
+    return Status::Ok;
+}
+
+int StreamOutput::write(AVPacket* pkt) {
+    // The muxer may have picked its own time base in write_header
+    av_packet_rescale_ts(pkt, codec_time_base, stream->time_base);
+    pkt->stream_index = stream->index;
+    arm();
+    return av_interleaved_write_frame(ctx, pkt);
+}
+
+bool StreamOutput::reset() {
+    close(false);
+    return create();
+}
+
+bool StreamOutput::reconnectable() const {
+    return format_name && strcmp(format_name, "rtsp") == 0;
+}
+
+void StreamOutput::close(bool trailer) {
+    if (!ctx) return;
+    closing = true;
+    if (trailer && header_written) {
+        arm();
+        av_write_trailer(ctx);
+    }
+    if (!(ctx->oformat->flags & AVFMT_NOFILE) && ctx->pb) {
+        avio_closep(&ctx->pb);
+    }
+    avformat_free_context(ctx);
+    ctx = nullptr;
+    stream = nullptr;
+    header_written = false;
+    closing = false;
+}
+
+void StreamOutput::arm() {
+    deadline_us = steadyMicros() + chrono::duration_cast<chrono::microseconds>(timeout).count();
+}
+
+int StreamOutput::interrupted(void* opaque) {
+    StreamOutput* self = static_cast<StreamOutput*>(opaque);
+    if (!self->running && !self->closing) return 1;
+    return steadyMicros() > self->deadline_us ? 1 : 0;
+}
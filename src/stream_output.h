@@ -0,0 +1,129 @@
+//
+// Stream output: the muxer a camera's encoded packets go to (RTSP to
+// MediaMTX, a file, or the null muxer), and the bounded queue in front of
+// it that sheds load instead of stalling the encoder.
+//
+#ifndef OPENSENTRY_STREAM_OUTPUT_H
+#define OPENSENTRY_STREAM_OUTPUT_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+// Encoded packets waiting for the network writer. push() never blocks:
+// when the queue is full it drops, cheapest loss first:
+//   1. the oldest disposable (non-reference) packet, which nothing decodes from
+//   2. the oldest GOP, up to the next queued keyframe
+//   3. everything queued, holding new packets back until a keyframe, which
+//      is requested from the encoder
+// so a stalled uplink costs the viewer a freeze, never a corrupt picture.
+class OutputQueue {
+public:
+    explicit OutputQueue(size_t capacity);
+    ~OutputQueue();
+
+    OutputQueue(const OutputQueue&) = delete;
+    OutputQueue& operator=(const OutputQueue&) = delete;
+
+    // Encoder side: moves `pkt`'s reference into the queue (or drops it)
+    void push(AVPacket* pkt);
+
+    // Writer side: blocks until a packet is queued or running goes false.
+    // The packet must come back through recycle() once written.
+    bool pop(AVPacket*& pkt, const std::atomic<bool>& running);
+    void recycle(AVPacket* pkt);
+
+    // Discards everything queued and holds packets back until a keyframe,
+    // which is requested from the encoder. For a fresh connection.
+    void restart();
+
+    // True once per keyframe the queue wants; the encoder forces an IDR
+    bool take_keyframe_request() { return keyframe_wanted.exchange(false); }
+
+    size_t depth() const;
+    size_t capacity() const { return cap; }
+    uint64_t dropped_count() const { return dropped.load(std::memory_order_relaxed); }
+    uint64_t dropped_gops() const { return gop_drops.load(std::memory_order_relaxed); }
+
+private:
+    void shed();
+    void discard(size_t n);
+    // i-th queued packet, oldest first
+    AVPacket*& at(size_t i) { return queued[(head + i) % cap]; }
+
+    size_t cap;
+    std::vector<AVPacket*> storage;
+    std::vector<AVPacket*> free_packets;
+    std::vector<AVPacket*> queued;  // Circular, `cap` entries from `head`
+    size_t head;
+    size_t count;
+    bool waiting_for_key;
+    std::atomic<bool> keyframe_wanted;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> gop_drops;
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+};
+
+// The muxer end of a stream. Every blocking call (connecting, writing) is
+// bounded by `timeout` and by `running`, so a dead TCP connection surfaces
+// as an error instead of hanging the writer.
+class StreamOutput {
+public:
+    enum class Status { Ok, NoMuxer, CannotOpen, HeaderFailed };
+
+    // `format` null guesses the muxer from the file extension
+    StreamOutput(const std::string& url, const char* format,
+                 std::chrono::milliseconds timeout, const std::atomic<bool>& running);
+    ~StreamOutput();
+
+    StreamOutput(const StreamOutput&) = delete;
+    StreamOutput& operator=(const StreamOutput&) = delete;
+
+    // Creates the muxer; the encoder is opened after this so it can honour
+    // needs_global_header()
+    bool create();
+    bool needs_global_header() const;
+
+    // Adds the stream for the opened `codec`, connects (or opens the file)
+    // and writes the header
+    Status connect(const AVCodecContext* codec);
+
+    // Writes one packet in `codec`'s time base. Returns an AVERROR code.
+    int write(AVPacket* pkt);
+
+    // Tears down a broken connection (no trailer) and creates a fresh muxer,
+    // ready for connect()
+    bool reset();
+
+    // RTSP can be reconnected; a file or null output that fails is finished
+    bool reconnectable() const;
+    const std::string& url() const { return target; }
+
+private:
+    static int interrupted(void* opaque);
+    void close(bool trailer);
+    void arm();
+
+    std::string target;
+    const char* format_name;
+    std::chrono::milliseconds timeout;
+    const std::atomic<bool>& running;
+    AVFormatContext* ctx;
+    AVStream* stream;
+    AVRational codec_time_base;
+    bool header_written;
+    bool closing;                       // Lets the trailer out after running goes false
+    std::atomic<int64_t> deadline_us;   // steady_clock; checked by FFmpeg's I/O loops
+};
+
+#endif // OPENSENTRY_STREAM_OUTPUT_H
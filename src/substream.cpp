@@ -0,0 +1,180 @@
+//
+// Low-resolution substream encoder
+//
+#include "substream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+
+extern "C" {
+#include <libavutil/opt.h>
+}
+
+using namespace std;
+
+bool parseSubstreamSize(const string& spec, SubstreamConfig& config) {
+    config.width = 0;
+    config.height = 0;
+    if (spec.empty() || spec == "off") return true;
+    int w = 0, h = 0;
+    int n = sscanf(spec.c_str(), "%dx%d", &w, &h);
+    if (n < 1 || w <= 0 || (n == 2 && h <= 0)) return false;
+    config.width = w;
+    config.height = n == 2 ? h : 0;
+    return true;
+}
+
+Substream::Substream(const SubstreamConfig& cfg, int w, int h, AVPixelFormat fmt,
+                     size_t queue_capacity, PipelineMetrics& stage_metrics)
+    : config(cfg), in_width(w), in_height(h), format(fmt), metrics(stage_metrics),
+      ctx(nullptr), pkt(av_packet_alloc()), queue(queue_capacity), scaler(nullptr),
+      limiter(cfg.fps), clock(max(1, cfg.fps)), skipped(0) {
+    // Never upscale; both planes of 4:2:0 need even sizes
+    out_width = min(config.width, in_width) & ~1;
+    out_height = config.height > 0
+        ? min(config.height, in_height)
+        : static_cast<int>(lround(static_cast<double>(out_width) * in_height / in_width));
+    out_width = max(2, out_width);
+    out_height = max(2, out_height & ~1);
+
+    slots.resize(max<size_t>(1, config.slots));
+    for (Slot& slot : slots) {
+        slot.frame = av_frame_alloc();
+        slot.frame->format = format;
+        slot.frame->width = out_width;
+        slot.frame->height = out_height;
+        av_frame_get_buffer(slot.frame, 0);
+        free_slots.push_back(&slot);
+    }
+}
+
+Substream::~Substream() {
+    for (Slot& slot : slots) {
+        av_frame_free(&slot.frame);
+    }
+    avcodec_free_context(&ctx);
+    av_packet_free(&pkt);
+    sws_freeContext(scaler);
+}
+
+bool Substream::open(bool global_header, int threads) {
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!codec) {
+        cerr << "[Substream] H.264 codec not found" << endl;
+        return false;
+    }
+    ctx = avcodec_alloc_context3(codec);
+    ctx->width = out_width;
+    ctx->height = out_height;
+    ctx->time_base = StreamClock::kTimeBase;
+    ctx->framerate = {max(1, config.fps), 1};
+    ctx->pix_fmt = format;
+    ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+    ctx->thread_count = threads;
+    av_opt_set(ctx->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(ctx->priv_data, "forced-idr", "1", 0);
+    av_opt_set(ctx->priv_data, "crf", to_string(config.crf).c_str(), 0);
+    if (global_header) {
+        ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(ctx, codec, nullptr) < 0) {
+        cerr << "[Substream] Could not open codec" << endl;
+        avcodec_free_context(&ctx);
+        return false;
+    }
+    return true;
+}
+
+bool Substream::due(chrono::steady_clock::time_point captured) {
+    return limiter.accept(captured);
+}
+
+bool Substream::capture(const AVFrame* frame, chrono::steady_clock::time_point captured,
+                        chrono::steady_clock::time_point arrived) {
+    return queue_frame(frame, clock.pts(captured, arrived), false);
+}
+
+bool Substream::capture_frozen(const AVFrame* frame, chrono::steady_clock::time_point now, bool keyframe) {
+    return queue_frame(frame, clock.pts_now(now), keyframe);
+}
+
+bool Substream::queue_frame(const AVFrame* frame, int64_t pts, bool keyframe) {
+    Slot* slot;
+    {
+        lock_guard<mutex> lock(slots_mutex);
+        if (free_slots.empty()) {
+            skipped++;
+            return false;
+        }
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+
+    // The captured frame is only readable until the encode stage releases
+    // it, so this is the substream's one pass over it: every plane is
+    // scaled straight into the slot (MJPEG and BGR captures arrive here
+    // as YUV420P, NV12 stays NV12)
+    auto start = chrono::steady_clock::now();
+    AVPixelFormat in_format = static_cast<AVPixelFormat>(frame->format);
+    scaler = sws_getCachedContext(scaler, in_width, in_height, in_format,
+                                  out_width, out_height, format,
+                                  SWS_BILINEAR, nullptr, nullptr, nullptr);
+    bool ok = scaler != nullptr && av_frame_make_writable(slot->frame) >= 0;
+    if (ok) {
+        sws_scale(scaler, frame->data, frame->linesize, 0, in_height, slot->frame->data, slot->frame->linesize);
+    }
+    metrics[Stage::SubstreamScale].record_since(start);
+
+    lock_guard<mutex> lock(slots_mutex);
+    if (!ok) {
+        cerr << "[Substream] Cannot scale " << in_width << "x" << in_height << " to "
+             << out_width << "x" << out_height << endl;
+        free_slots.push_back(slot);
+        return false;
+    }
+    slot->frame->pts = pts;
+    slot->keyframe = keyframe;
+    pending.push_back(slot);
+    return true;
+}
+
+bool Substream::encode_pending() {
+    while (true) {
+        Slot* slot;
+        {
+            lock_guard<mutex> lock(slots_mutex);
+            if (pending.empty()) return true;
+            slot = pending.front();
+            pending.pop_front();
+        }
+
+        // The output queue wants an IDR after dropping a GOP or reconnecting
+        bool keyframe = slot->keyframe || queue.take_keyframe_request();
+        slot->frame->pict_type = keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+        auto start = chrono::steady_clock::now();
+        int ret = avcodec_send_frame(ctx, slot->frame);
+        {
+            lock_guard<mutex> lock(slots_mutex);
+            free_slots.push_back(slot);
+        }
+        if (ret < 0) {
+            cerr << "[Substream] Error sending frame" << endl;
+            return false;
+        }
+        metrics.substream_frames.fetch_add(1, memory_order_relaxed);
+        while (true) {
+            ret = avcodec_receive_packet(ctx, pkt);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
+            if (ret < 0) {
+                cerr << "[Substream] Error encoding" << endl;
+                return false;
+            }
+            queue.push(pkt);
+        }
+        metrics[Stage::SubstreamEncode].record_since(start);
+    }
+}
@@ -0,0 +1,113 @@
+//
+// Substream: a second, low-resolution H.264 encode of a camera for grid
+// views, published next to the main stream. It is fed from the frames the
+// encode stage already holds (no second capture): the encode stage scales
+// each frame due for the substream into a pooled buffer in one pass, and
+// the substream's own strand encodes it.
+//
+#ifndef OPENSENTRY_SUBSTREAM_H
+#define OPENSENTRY_SUBSTREAM_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "frame_clock.h"
+#include "stage_metrics.h"
+#include "stream_output.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+struct SubstreamConfig {
+    int width = 0;               // 0 disables the substream
+    int height = 0;              // 0 keeps the camera's aspect ratio
+    int fps = 10;
+    int crf = 28;                // x264 CRF
+    size_t slots = 2;            // Scaled frames that can wait for the encoder at once
+};
+
+// Parses SUBSTREAM_SIZE: "WxH", "W" (height from the aspect ratio), or
+// empty / "off"
+bool parseSubstreamSize(const std::string& spec, SubstreamConfig& config);
+
+class Substream {
+public:
+    // For frames of `width` x `height` in `format` (YUV420P or NV12), which
+    // is also what the substream is encoded as
+    Substream(const SubstreamConfig& config, int width, int height, AVPixelFormat format,
+              size_t queue_capacity, PipelineMetrics& metrics);
+    ~Substream();
+
+    Substream(const Substream&) = delete;
+    Substream& operator=(const Substream&) = delete;
+
+    // Opens the encoder. `global_header` as the output's
+    // needs_global_header(); `threads` as for the main encoder.
+    bool open(bool global_header, int threads);
+    AVCodecContext* codec() const { return ctx; }
+    int width() const { return out_width; }
+    int height() const { return out_height; }
+    int fps() const { return config.fps; }
+
+    // Encode stage: whether the live frame captured at `captured` belongs
+    // in the substream. Decides on capture timestamps, like the capture
+    // stage's rate limit.
+    bool due(std::chrono::steady_clock::time_point captured);
+
+    // Encode stage: scales `frame` into a free slot for the encoder. Returns
+    // false if every slot is still waiting (the frame is skipped rather
+    // than holding up the main stream).
+    bool capture(const AVFrame* frame, std::chrono::steady_clock::time_point captured,
+                 std::chrono::steady_clock::time_point arrived);
+
+    // Encode stage, while paused: the frozen frame, re-sent with the main
+    // stream's keepalives
+    bool capture_frozen(const AVFrame* frame, std::chrono::steady_clock::time_point now, bool keyframe);
+
+    // Substream strand: encodes every captured frame into the output
+    // queue. Returns false on an encoder error.
+    bool encode_pending();
+
+    OutputQueue& output_queue() { return queue; }
+    const OutputQueue& output_queue() const { return queue; }
+    uint64_t skipped_count() const { return skipped; }
+
+private:
+    struct Slot {
+        AVFrame* frame = nullptr;
+        bool keyframe = false;
+    };
+
+    bool queue_frame(const AVFrame* frame, int64_t pts, bool keyframe);
+
+    SubstreamConfig config;
+    int in_width;
+    int in_height;
+    AVPixelFormat format;
+    int out_width;
+    int out_height;
+    PipelineMetrics& metrics;
+
+    AVCodecContext* ctx;
+    AVPacket* pkt;
+    OutputQueue queue;             // substream encode -> substream write
+
+    std::vector<Slot> slots;
+    std::vector<Slot*> free_slots;
+    std::deque<Slot*> pending;
+    std::mutex slots_mutex;        // Guards free_slots and pending only
+
+    // Encode-stage side
+    SwsContext* scaler;
+    FrameRateLimiter limiter;
+    StreamClock clock;
+    uint64_t skipped;
+};
+
+#endif // OPENSENTRY_SUBSTREAM_H
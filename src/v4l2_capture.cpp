@@ -0,0 +1,359 @@
+//
+// Native V4L2 capture backend
+//
+#include "v4l2_capture.h"
+#include "frame_clock.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+extern "C" {
+#include <libavutil/buffer.h>
+}
+
+using namespace std;
+
+namespace {
+
+int xioctl(int fd, unsigned long request, void* arg) {
+    int r;
+    do {
+        r = ioctl(fd, request, arg);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+uint32_t fourcc_for(V4L2Capture::Format format) {
+    switch (format) {
+        case V4L2Capture::Format::YUV420: return V4L2_PIX_FMT_YUV420;
+        case V4L2Capture::Format::NV12: return V4L2_PIX_FMT_NV12;
+        case V4L2Capture::Format::YUYV: return V4L2_PIX_FMT_YUYV;
+        case V4L2Capture::Format::MJPEG: return V4L2_PIX_FMT_MJPEG;
+        case V4L2Capture::Format::None: break;
+    }
+    return 0;
+}
+
+// YUYV (4:2:2 packed) -> YUV420P. Luma is a straight copy; each chroma
+// sample is the average of the two source rows it covers.
+void repack_yuyv(const uint8_t* src, int src_stride, int width, int height, AVFrame* dst) {
+    for (int y = 0; y < height; y += 2) {
+        const uint8_t* row0 = src + static_cast<size_t>(y) * src_stride;
+        const uint8_t* row1 = (y + 1 < height) ? row0 + src_stride : row0;
+        uint8_t* y0 = dst->data[0] + static_cast<size_t>(y) * dst->linesize[0];
+        uint8_t* y1 = (y + 1 < height) ? y0 + dst->linesize[0] : nullptr;
+        uint8_t* u = dst->data[1] + static_cast<size_t>(y / 2) * dst->linesize[1];
+        uint8_t* v = dst->data[2] + static_cast<size_t>(y / 2) * dst->linesize[2];
+
+        for (int x = 0; x < width; x += 2) {
+            const uint8_t* p0 = row0 + x * 2;
+            const uint8_t* p1 = row1 + x * 2;
+            y0[x] = p0[0];
+            y0[x + 1] = p0[2];
+            if (y1) {
+                y1[x] = p1[0];
+                y1[x + 1] = p1[2];
+            }
+            u[x / 2] = static_cast<uint8_t>((p0[1] + p1[1] + 1) >> 1);
+            v[x / 2] = static_cast<uint8_t>((p0[3] + p1[3] + 1) >> 1);
+        }
+    }
+}
+
+} // namespace
+
+V4L2Capture::V4L2Capture(const string& device)
+    : device_(device), fd_(-1), format_(Format::None),
+      width_(0), height_(0), stride_(0), streaming_(false) {}
+
+V4L2Capture::~V4L2Capture() {
+    stop();
+    unmap_buffers();
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool V4L2Capture::open(int fps, unsigned buffer_count, bool mjpeg) {
+    fd_ = ::open(device_.c_str(), O_RDWR | O_NONBLOCK);
+    if (fd_ < 0) {
+        cerr << "[V4L2] Cannot open " << device_ << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    v4l2_capability cap;
+    memset(&cap, 0, sizeof(cap));
+    if (xioctl(fd_, VIDIOC_QUERYCAP, &cap) < 0 ||
+        !(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
+        !(cap.capabilities & V4L2_CAP_STREAMING)) {
+        cerr << "[V4L2] " << device_ << " does not support streaming capture" << endl;
+        return false;
+    }
+
+    if (!negotiate_format(mjpeg)) {
+        return false;
+    }
+
+    // Best effort - plenty of UVC cameras ignore this
+    v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = fps;
+    xioctl(fd_, VIDIOC_S_PARM, &parm);
+
+    v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = buffer_count;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd_, VIDIOC_REQBUFS, &req) < 0 || req.count < 2) {
+        cerr << "[V4L2] Buffer request failed: " << strerror(errno) << endl;
+        return false;
+    }
+
+    buffers_.resize(req.count);
+    for (unsigned i = 0; i < req.count; i++) {
+        v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(fd_, VIDIOC_QUERYBUF, &buf) < 0) {
+            cerr << "[V4L2] QUERYBUF failed: " << strerror(errno) << endl;
+            return false;
+        }
+
+        void* start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, buf.m.offset);
+        if (start == MAP_FAILED) {
+            cerr << "[V4L2] mmap failed: " << strerror(errno) << endl;
+            return false;
+        }
+        buffers_[i].start = start;
+        buffers_[i].length = buf.length;
+        buffers_[i].owner = this;
+        buffers_[i].index = static_cast<int>(i);
+    }
+
+    cout << "[V4L2] " << device_ << ": " << width_ << "x" << height_ << " "
+         << format_name() << ", " << buffers_.size() << " mmap buffers"
+         << (format_ == Format::MJPEG ? " (decoded on demand)" :
+             zero_copy() ? " (zero-copy)" : " (repacked to YUV420P)") << endl;
+    return true;
+}
+
+bool V4L2Capture::negotiate_format(bool mjpeg) {
+    // Which of our formats does the device offer?
+    bool offered[5] = {false, false, false, false, false};
+    v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    while (xioctl(fd_, VIDIOC_ENUM_FMT, &desc) == 0) {
+        if (desc.pixelformat == V4L2_PIX_FMT_YUV420) offered[static_cast<int>(Format::YUV420)] = true;
+        if (desc.pixelformat == V4L2_PIX_FMT_NV12) offered[static_cast<int>(Format::NV12)] = true;
+        if (desc.pixelformat == V4L2_PIX_FMT_YUYV) offered[static_cast<int>(Format::YUYV)] = true;
+        if (desc.pixelformat == V4L2_PIX_FMT_MJPEG) offered[static_cast<int>(Format::MJPEG)] = true;
+        desc.index++;
+    }
+
+    // Keep the device's current resolution, same as OpenCV would
+    v4l2_format current;
+    memset(&current, 0, sizeof(current));
+    current.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(fd_, VIDIOC_G_FMT, &current) < 0) {
+        cerr << "[V4L2] G_FMT failed: " << strerror(errno) << endl;
+        return false;
+    }
+
+    vector<Format> preference = {Format::YUV420, Format::NV12, Format::YUYV};
+    if (mjpeg) preference = {Format::MJPEG};
+    for (Format candidate : preference) {
+        if (!offered[static_cast<int>(candidate)]) continue;
+
+        v4l2_format fmt = current;
+        fmt.fmt.pix.pixelformat = fourcc_for(candidate);
+        fmt.fmt.pix.field = V4L2_FIELD_NONE;
+        if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0) continue;
+        if (fmt.fmt.pix.pixelformat != fourcc_for(candidate)) continue;
+        // Odd sizes don't subsample cleanly to 4:2:0
+        if ((fmt.fmt.pix.width & 1) || (fmt.fmt.pix.height & 1)) continue;
+
+        format_ = candidate;
+        width_ = static_cast<int>(fmt.fmt.pix.width);
+        height_ = static_cast<int>(fmt.fmt.pix.height);
+        stride_ = static_cast<int>(fmt.fmt.pix.bytesperline);
+        if (stride_ == 0) {
+            stride_ = (candidate == Format::YUYV) ? width_ * 2 : width_;
+        }
+        return true;
+    }
+
+    if (mjpeg) {
+        cerr << "[V4L2] " << device_ << " does not offer MJPEG" << endl;
+    } else {
+        cerr << "[V4L2] " << device_ << " offers no YUV format (YUV420/NV12/YUYV)" << endl;
+    }
+    return false;
+}
+
+bool V4L2Capture::start() {
+    for (size_t i = 0; i < buffers_.size(); i++) {
+        if (!requeue(static_cast<int>(i))) {
+            cerr << "[V4L2] QBUF failed: " << strerror(errno) << endl;
+            return false;
+        }
+    }
+
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0) {
+        cerr << "[V4L2] STREAMON failed: " << strerror(errno) << endl;
+        return false;
+    }
+    streaming_ = true;
+    return true;
+}
+
+void V4L2Capture::stop() {
+    if (!streaming_.exchange(false)) return;
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(fd_, VIDIOC_STREAMOFF, &type);
+}
+
+int V4L2Capture::dequeue(int timeout_ms, chrono::steady_clock::time_point& captured, int& index, size_t& bytes) {
+    pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r == 0 || (r < 0 && errno == EINTR)) {
+        return 0;
+    }
+    if (r < 0) {
+        cerr << "[V4L2] poll failed: " << strerror(errno) << endl;
+        return -1;
+    }
+
+    v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd_, VIDIOC_DQBUF, &buf) < 0) {
+        if (errno == EAGAIN) return 0;
+        cerr << "[V4L2] DQBUF failed: " << strerror(errno) << endl;
+        return -1;
+    }
+
+    // Stamped when the driver finished filling the buffer, so time spent
+    // waiting in the queue doesn't show up as jitter
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        captured = steadyFromTimeval(buf.timestamp.tv_sec, buf.timestamp.tv_usec);
+    } else {
+        captured = chrono::steady_clock::now();
+    }
+    index = static_cast<int>(buf.index);
+    bytes = buf.bytesused;
+    return 1;
+}
+
+AVBufferRef* V4L2Capture::wrap(int index) {
+    // release_buffer() requeues it once the encoder and every pipeline
+    // stage have dropped their references
+    Buffer& b = buffers_[index];
+    AVBufferRef* ref = av_buffer_create(static_cast<uint8_t*>(b.start), b.length, release_buffer, &b, 0);
+    if (!ref) requeue(index);
+    return ref;
+}
+
+int V4L2Capture::read(AVFrame* dst, int timeout_ms, chrono::steady_clock::time_point& captured) {
+    int index;
+    size_t bytes;
+    int r = dequeue(timeout_ms, captured, index, bytes);
+    if (r <= 0) return r;
+
+    Buffer& b = buffers_[index];
+    uint8_t* base = static_cast<uint8_t*>(b.start);
+
+    if (format_ == Format::YUYV) {
+        repack_yuyv(base, stride_, width_, height_, dst);
+        requeue(b.index);
+        return 1;
+    }
+
+    // Wrap the driver buffer instead of copying it
+    dst->buf[0] = wrap(index);
+    if (!dst->buf[0]) return -1;
+    dst->format = output_format();
+    dst->width = width_;
+    dst->height = height_;
+    dst->data[0] = base;
+    dst->linesize[0] = stride_;
+    if (format_ == Format::NV12) {
+        dst->data[1] = base + static_cast<size_t>(stride_) * height_;
+        dst->linesize[1] = stride_;
+    } else {
+        dst->data[1] = base + static_cast<size_t>(stride_) * height_;
+        dst->linesize[1] = stride_ / 2;
+        dst->data[2] = dst->data[1] + static_cast<size_t>(stride_ / 2) * (height_ / 2);
+        dst->linesize[2] = stride_ / 2;
+    }
+    return 1;
+}
+
+int V4L2Capture::read_jpeg(AVBufferRef** jpeg, size_t& size, int timeout_ms,
+                           chrono::steady_clock::time_point& captured) {
+    int index;
+    int r = dequeue(timeout_ms, captured, index, size);
+    if (r <= 0) return r;
+    // Some drivers hand out an empty buffer after a USB hiccup
+    if (size == 0 || size > buffers_[index].length) {
+        requeue(index);
+        return 0;
+    }
+    *jpeg = wrap(index);
+    return *jpeg ? 1 : -1;
+}
+
+void V4L2Capture::release_buffer(void* opaque, uint8_t* /*data*/) {
+    Buffer* b = static_cast<Buffer*>(opaque);
+    b->owner->requeue(b->index);
+}
+
+bool V4L2Capture::requeue(int index) {
+    v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = static_cast<unsigned>(index);
+    return xioctl(fd_, VIDIOC_QBUF, &buf) == 0;
+}
+
+void V4L2Capture::unmap_buffers() {
+    for (Buffer& b : buffers_) {
+        if (b.start) munmap(b.start, b.length);
+    }
+    buffers_.clear();
+}
+
+AVPixelFormat V4L2Capture::output_format() const {
+    return format_ == Format::NV12 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+}
+
+const char* V4L2Capture::format_name() const {
+    switch (format_) {
+        case Format::YUV420: return "YUV420";
+        case Format::NV12: return "NV12";
+        case Format::YUYV: return "YUYV";
+        case Format::MJPEG: return "MJPEG";
+        case Format::None: break;
+    }
+    return "none";
+}
@@ -0,0 +1,93 @@
+//
+// Native V4L2 capture backend: mmap streaming I/O with YUV output that can be
+// handed to the H.264 encoder without a BGR round trip, or with the
+// camera's MJPEG frames passed on undecoded.
+//
+#ifndef OPENSENTRY_V4L2_CAPTURE_H
+#define OPENSENTRY_V4L2_CAPTURE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+}
+
+class V4L2Capture {
+public:
+    // Camera formats we know how to feed the encoder, in order of
+    // preference. MJPEG is only used when asked for.
+    enum class Format { None, YUV420, NV12, YUYV, MJPEG };
+
+    explicit V4L2Capture(const std::string& device);
+    ~V4L2Capture();
+
+    V4L2Capture(const V4L2Capture&) = delete;
+    V4L2Capture& operator=(const V4L2Capture&) = delete;
+
+    // Opens the device, negotiates a YUV format (or MJPEG, with `mjpeg`)
+    // and maps `buffer_count` driver buffers. Returns false if the device
+    // can't stream it; the caller should fall back to the OpenCV path.
+    bool open(int fps, unsigned buffer_count, bool mjpeg = false);
+    bool start();
+    void stop();
+
+    // Dequeues the next filled buffer into `dst`. For YUV420/NV12 the frame
+    // planes point straight into the driver buffer, which is requeued when
+    // the last reference to `dst` is dropped (av_frame_unref). YUYV is
+    // repacked into `dst`'s own YUV420P planes and the driver buffer is
+    // requeued immediately. `captured` is set to the driver's timestamp
+    // when it is on the monotonic clock, else to the dequeue time.
+    // Returns 1 on a frame, 0 on timeout, -1 on error.
+    int read(AVFrame* dst, int timeout_ms, std::chrono::steady_clock::time_point& captured);
+
+    // MJPEG: dequeues the next frame as a reference to the driver buffer,
+    // requeued once `jpeg` is unreferenced, and its length in bytes.
+    // Otherwise as read().
+    int read_jpeg(AVBufferRef** jpeg, size_t& size, int timeout_ms,
+                  std::chrono::steady_clock::time_point& captured);
+
+    // True if read() wraps driver memory; `dst` must then be an empty frame
+    // rather than one with its own buffers.
+    bool zero_copy() const { return format_ == Format::YUV420 || format_ == Format::NV12; }
+    AVPixelFormat output_format() const;
+    Format format() const { return format_; }
+    const char* format_name() const;
+
+    int fd() const { return fd_; }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    unsigned buffer_count() const { return static_cast<unsigned>(buffers_.size()); }
+
+private:
+    struct Buffer {
+        void* start = nullptr;
+        size_t length = 0;
+        V4L2Capture* owner = nullptr;
+        int index = 0;
+    };
+
+    static void release_buffer(void* opaque, uint8_t* data);
+    bool negotiate_format(bool mjpeg);
+    // Waits for and dequeues a filled buffer: 1 with its index and length,
+    // 0 on timeout, -1 on error
+    int dequeue(int timeout_ms, std::chrono::steady_clock::time_point& captured, int& index, size_t& bytes);
+    AVBufferRef* wrap(int index);
+    bool requeue(int index);
+    void unmap_buffers();
+
+    std::string device_;
+    int fd_;
+    Format format_;
+    int width_;
+    int height_;
+    int stride_;
+    std::vector<Buffer> buffers_;
+    std::atomic<bool> streaming_;
+};
+
+#endif // OPENSENTRY_V4L2_CAPTURE_H
@@ -0,0 +1,73 @@
+//
+// Worker pool
+//
+#include "worker_pool.h"
+
+using namespace std;
+
+WorkerPool::WorkerPool(int threads) : stopping(false) {
+    for (int i = 0; i < (threads < 1 ? 1 : threads); i++) {
+        workers.emplace_back(&WorkerPool::worker_loop, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    stop();
+}
+
+void WorkerPool::schedule(Strand& strand) {
+    int state = strand.state.load();
+    while (true) {
+        if (state == Strand::Queued || state == Strand::Rerun) return;
+        int next = state == Strand::Idle ? Strand::Queued : Strand::Rerun;
+        if (strand.state.compare_exchange_weak(state, next)) {
+            if (next == Strand::Queued) enqueue(&strand);
+            return;
+        }
+    }
+}
+
+void WorkerPool::stop() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        if (stopping) return;
+        stopping = true;
+    }
+    cond.notify_all();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void WorkerPool::enqueue(Strand* strand) {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        ready.push_back(strand);
+    }
+    cond.notify_one();
+}
+
+void WorkerPool::worker_loop() {
+    while (true) {
+        Strand* strand;
+        {
+            unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return stopping || !ready.empty(); });
+            if (stopping) return;
+            strand = ready.front();
+            ready.pop_front();
+        }
+
+        strand->state.store(Strand::Running);
+        strand->work();
+
+        // Back to idle unless scheduled while running; then go round again
+        // behind whatever else is waiting, so one busy camera can't starve
+        // the others
+        int state = Strand::Running;
+        if (!strand->state.compare_exchange_strong(state, Strand::Idle)) {
+            strand->state.store(Strand::Queued);
+            enqueue(strand);
+        }
+    }
+}
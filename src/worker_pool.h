@@ -0,0 +1,73 @@
+//
+// Fixed worker pool shared by every camera session. Work is submitted as
+// strands: a strand never runs on two workers at once and each run sees the
+// previous one's writes, so per-camera stage state (motion detector,
+// encoder) needs no locking while cameras and stages spread across cores.
+//
+#ifndef OPENSENTRY_WORKER_POOL_H
+#define OPENSENTRY_WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Strand {
+public:
+    explicit Strand(std::function<void()> work) : work(std::move(work)), state(Idle) {}
+
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+
+    // True when neither queued nor running. Only stays true once nothing
+    // can schedule the strand again.
+    bool idle() const { return state.load() == Idle; }
+
+private:
+    friend class WorkerPool;
+
+    enum State {
+        Idle,       // Not queued
+        Queued,     // Waiting for a worker
+        Running,    // On a worker
+        Rerun       // On a worker, and scheduled again meanwhile
+    };
+
+    std::function<void()> work;
+    std::atomic<int> state;
+};
+
+class WorkerPool {
+public:
+    explicit WorkerPool(int threads);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Makes sure `strand` runs (again) after this call. Cheap when it is
+    // already queued; if it is running it is requeued when it finishes,
+    // so a producer that pushed before scheduling is never missed.
+    void schedule(Strand& strand);
+
+    // Stops the workers; strands still queued do not run. Call once every
+    // strand is idle.
+    void stop();
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+private:
+    void worker_loop();
+    void enqueue(Strand* strand);
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Strand*> ready;
+    bool stopping;
+    std::vector<std::thread> workers;
+};
+
+#endif // OPENSENTRY_WORKER_POOL_H
@@ -0,0 +1,41 @@
+//
+// Helpers for working on YUV AVFrames with OpenCV without copying
+//
+#include "yuv_utils.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+
+using namespace cv;
+
+namespace {
+// BT.601 limited-range red
+const int RED_Y = 81;
+const int RED_U = 90;
+const int RED_V = 240;
+}
+
+Mat lumaPlane(const AVFrame* frame) {
+    return Mat(frame->height, frame->width, CV_8UC1, frame->data[0], frame->linesize[0]);
+}
+
+void drawRectYuv(AVFrame* frame, const Rect& rect, int thickness) {
+    Mat luma = lumaPlane(frame);
+    rectangle(luma, rect, Scalar(RED_Y), thickness);
+
+    // Chroma is subsampled 2x in both directions
+    Rect half(rect.x / 2, rect.y / 2, std::max(1, rect.width / 2), std::max(1, rect.height / 2));
+    int half_thickness = std::max(1, thickness / 2);
+    int cw = (frame->width + 1) / 2;
+    int ch = (frame->height + 1) / 2;
+
+    if (frame->format == AV_PIX_FMT_NV12) {
+        Mat uv(ch, cw, CV_8UC2, frame->data[1], frame->linesize[1]);
+        rectangle(uv, half, Scalar(RED_U, RED_V), half_thickness);
+    } else {
+        Mat u(ch, cw, CV_8UC1, frame->data[1], frame->linesize[1]);
+        Mat v(ch, cw, CV_8UC1, frame->data[2], frame->linesize[2]);
+        rectangle(u, half, Scalar(RED_U), half_thickness);
+        rectangle(v, half, Scalar(RED_V), half_thickness);
+    }
+}
@@ -0,0 +1,20 @@
+//
+// Helpers for working on YUV AVFrames with OpenCV without copying
+//
+#ifndef OPENSENTRY_YUV_UTILS_H
+#define OPENSENTRY_YUV_UTILS_H
+
+#include <opencv2/core.hpp>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Mat header over the frame's Y plane (no copy). Writes go to the frame.
+cv::Mat lumaPlane(const AVFrame* frame);
+
+// Draws the motion box in red on a YUV420P or NV12 frame, matching the
+// Scalar(0, 0, 255) box the BGR path draws.
+void drawRectYuv(AVFrame* frame, const cv::Rect& rect, int thickness);
+
+#endif // OPENSENTRY_YUV_UTILS_H